@@ -3,7 +3,7 @@ import random
 
 COMMAND_READ = 0x06
 COMMAND_WRITE = 0x08
-MAX_BLOCK = 12
+MAX_BLOCK = 16
 
 D_ID = 0x83
 SER_C = 0x84
@@ -1,16 +1,2 @@
 ./check.py 
-./write.py idm 012E0123456789AB 
-./write.py sys 88B4 
-./write.py ser 0000 000B
-./write.py 0 00000000000000000000000000000000 
-./write.py 1 00000000000000000000000000000000 
-./write.py 2 00000000000000000000000000000000 
-./write.py 3 00000000000000000000000000000000 
-./write.py 4 00000000000000000000000000000000 
-./write.py 5 00000000000000000000000000000000 
-./write.py 6 00000000000000000000000000000000 
-./write.py 7 00000000000000000000000000000000 
-./write.py 8 00000000000000000000000000000000 
-./write.py 9 00000000000000000000000000000000 
-./write.py 10 00000000000000000000000000000000 
-./write.py 11 00000000000000000000000000000000
+./image.py restore deploy.json
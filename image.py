@@ -0,0 +1,242 @@
+#!/usr/bin/env python3
+
+# Dump or restore a whole SiliCa card image in one connection.
+# Usage examples:
+# python image.py dump card.json
+# python image.py restore card.json
+# python image.py --port /dev/ttyUSB0 restore card.json
+#
+# With --port the card is accessed over the serial channel (see uart.py)
+# instead of an NFC reader.
+#
+# Card image file (JSON):
+# {
+#   "format": "silica-card-image",
+#   "version": 1,
+#   "idm": "012E0123456789AB",
+#   "pmm": "0001FFFFFFFFFFFF",
+#   "system_codes": ["88B4"],
+#   "service_codes": ["0000", "000B"],
+#   "blocks": {"00": "00112233445566778899AABBCCDDEEFF", ...},
+#   "error": "..."
+# }
+# blocks holds user blocks 00-0F and the area/service nodes C0-C7, in hex.
+# Blocks missing from an image are left as they are on restore.
+# error is the last failed command (blocks E0-E1), dumped for reference
+# and never restored.
+
+import argparse
+import json
+import sys
+
+FORMAT = "silica-card-image"
+VERSION = 1
+
+COMMAND_READ = 0x06
+COMMAND_WRITE = 0x08
+
+BLOCK_MAX = 12  # blocks per Read/Write Without Encryption
+MAX_SYSTEM = 4
+MAX_SERVICE = 4
+
+D_ID = 0x83
+SER_C = 0x84
+SYS_C = 0x85
+ERROR_BLOCK = 0xE0
+DATA_BLOCKS = list(range(16)) + list(range(0xC0, 0xC8))
+
+
+class VerifyError(Exception):
+    pass
+
+
+def read_blocks(tag, block_nums: list[int], timeout: float = 1.0) -> list[bytes]:
+    """Read blocks, up to BLOCK_MAX per command."""
+    blocks = []
+    for i in range(0, len(block_nums), BLOCK_MAX):
+        part = block_nums[i:i + BLOCK_MAX]
+        cmd_data = bytearray([1, 0xFF, 0xFF, len(part)])
+        for block_num in part:
+            cmd_data += bytes([0x80, block_num])
+        data = tag.send_cmd_recv_rsp(COMMAND_READ, bytes(cmd_data), timeout)[1:]
+        blocks += [data[16 * j:16 * (j + 1)] for j in range(len(part))]
+    return blocks
+
+
+def write_blocks(tag, block_nums: list[int], blocks: list[bytes], timeout: float = 1.0) -> None:
+    """Write blocks, up to BLOCK_MAX per command."""
+    for i in range(0, len(block_nums), BLOCK_MAX):
+        part = block_nums[i:i + BLOCK_MAX]
+        cmd_data = bytearray([1, 0xFF, 0xFF, len(part)])
+        for block_num in part:
+            cmd_data += bytes([0x80, block_num])
+        for block in blocks[i:i + len(part)]:
+            cmd_data += block
+        tag.send_cmd_recv_rsp(COMMAND_WRITE, bytes(cmd_data), timeout)
+
+
+def split_codes(data: bytes, count: int, swap: bool) -> list[str]:
+    """Codes of a SYS_C or SER_C block, without trailing unused entries."""
+    codes = [data[2 * i:2 * i + 2] for i in range(count)]
+    if swap:
+        codes = [code[::-1] for code in codes]
+    while codes and codes[-1] == bytes(2):
+        codes.pop()
+    return [code.hex().upper() for code in codes]
+
+
+def join_codes(codes: list[str], count: int, swap: bool) -> bytes:
+    if len(codes) > count:
+        raise ValueError(f"at most {count} codes are supported")
+    data = bytearray()
+    for code in codes:
+        b = bytes.fromhex(code)
+        if len(b) != 2:
+            raise ValueError(f"code {code} must be 2 bytes")
+        data += b[::-1] if swap else b
+    return bytes(data) + bytes(16 - len(data))
+
+
+# service codes are stored little endian, system codes as written
+def system_blocks(image: dict) -> dict[int, bytes]:
+    blocks = {}
+    if "idm" in image:
+        blocks[D_ID] = bytes.fromhex(image["idm"]) + bytes.fromhex(image["pmm"])
+    if "system_codes" in image:
+        blocks[SYS_C] = join_codes(image["system_codes"], MAX_SYSTEM, False)
+    if "service_codes" in image:
+        blocks[SER_C] = join_codes(image["service_codes"], MAX_SERVICE, True)
+    return blocks
+
+
+def data_blocks(image: dict) -> dict[int, bytes]:
+    blocks = {}
+    for key, value in image.get("blocks", {}).items():
+        block_num = int(key, 16)
+        if block_num not in DATA_BLOCKS:
+            raise ValueError(f"block {key} is not part of an image")
+        data = bytes.fromhex(value)
+        if len(data) != 16:
+            raise ValueError(f"block {key} must be 16 bytes")
+        blocks[block_num] = data
+    return blocks
+
+
+def validate_image(image: dict) -> None:
+    if image.get("format") != FORMAT:
+        raise ValueError("not a SiliCa card image")
+    if image.get("version") != VERSION:
+        raise ValueError(f"unsupported image version {image.get('version')}")
+    if ("idm" in image) != ("pmm" in image):
+        raise ValueError("idm and pmm go together")
+    for block_num, data in system_blocks(image).items():
+        if block_num == D_ID and len(data) != 16:
+            raise ValueError("idm and pmm must be 8 bytes each")
+    data_blocks(image)
+
+
+def load_image(path: str) -> dict:
+    with open(path) as f:
+        image = json.load(f)
+    validate_image(image)
+    return image
+
+
+def save_image(path: str, image: dict) -> None:
+    with open(path, "w") as f:
+        json.dump(image, f, indent=2)
+        f.write("\n")
+
+
+def dump_image(tag, timeout: float = 1.0) -> dict:
+    block_nums = [D_ID, SYS_C, SER_C] + DATA_BLOCKS + [ERROR_BLOCK, ERROR_BLOCK + 1]
+    blocks = dict(zip(block_nums, read_blocks(tag, block_nums, timeout)))
+
+    return {
+        "format": FORMAT,
+        "version": VERSION,
+        "idm": blocks[D_ID][:8].hex().upper(),
+        "pmm": blocks[D_ID][8:].hex().upper(),
+        "system_codes": split_codes(blocks[SYS_C], MAX_SYSTEM, False),
+        "service_codes": split_codes(blocks[SER_C], MAX_SERVICE, True),
+        "blocks": {f"{n:02X}": blocks[n].hex().upper() for n in DATA_BLOCKS},
+        "error": (blocks[ERROR_BLOCK] + blocks[ERROR_BLOCK + 1]).hex().upper(),
+    }
+
+
+def restore_image(tag, image: dict, timeout: float = 1.0) -> None:
+    """
+    Write an image and verify it with a single read-back.
+    Raises VerifyError if the card holds different data afterwards.
+    """
+    system = system_blocks(image)
+    data = data_blocks(image)
+
+    # system blocks take one command each, IDm last as it addresses the card
+    for block_num in (SYS_C, SER_C, D_ID):
+        if block_num in system:
+            write_blocks(tag, [block_num], [system[block_num]], timeout)
+    if D_ID in system:
+        tag.idm = system[D_ID][:8]
+
+    write_blocks(tag, list(data), list(data.values()), timeout)
+
+    expected = {**system, **data}
+    block_nums = list(expected)
+    for block_num, block in zip(block_nums, read_blocks(tag, block_nums, timeout)):
+        if block != expected[block_num]:
+            raise VerifyError(f"data mismatch in block {block_num:02X}h")
+
+
+def connect(port: str):
+    """Return a tag on the serial port, or wait for one on the NFC reader."""
+    if port is not None:
+        import uart
+        return None, uart.SerialTag(uart.SerialChannel.open(port))
+
+    import nfc
+    clf = nfc.ContactlessFrontend("tty")
+    print("Waiting for a FeliCa...")
+    tag = clf.connect(rdwr={"targets": ["212F"], 'on-connect': lambda tag: False})
+    return clf, tag
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Dump or restore a whole SiliCa card image in one connection.",
+    )
+    parser.add_argument("--port", help="use the serial channel on this port instead of NFC")
+    parser.add_argument("command", choices=["dump", "restore"])
+    parser.add_argument("file", help="card image (JSON)")
+    args = parser.parse_args(argv[1:])
+
+    try:
+        image = load_image(args.file) if args.command == "restore" else None
+
+        clf, tag = connect(args.port)
+        try:
+            if tag is None:
+                print("No tag found")
+                return 1
+            print("Tag found:", tag)
+
+            if args.command == "dump":
+                save_image(args.file, dump_image(tag))
+                print("Dump completed")
+            else:
+                restore_image(tag, image)
+                print("Restore completed")
+        finally:
+            if clf is not None:
+                clf.close()
+
+    except Exception as exc:
+        print("Error:", exc)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,471 @@
+#!/usr/bin/env python3
+
+# Provision a batch of SiliCa cards with several readers at once.
+# Usage examples:
+# python provision.py manifest.json --reader usb:054c:06c3 --reader tty:USB0
+# python provision.py manifest.json --port /dev/ttyUSB0 --port /dev/ttyUSB1
+# python provision.py manifest.json --simulate 4 --fault-rate 0.1 --stuck-rate 0.05
+#
+# Manifest (JSON):
+# {
+#   "format": "silica-manifest",
+#   "version": 1,
+#   "template": "deploy.json",
+#   "idm_first": "012E000000000001",
+#   "count": 100,
+#   "cards": [...]
+# }
+# template is a card image file (see image.py), relative to the manifest,
+# or an image object. Card i of the series gets the template with IDm
+# idm_first + i. cards optionally lists further complete card images.
+#
+# Each reader has its own worker, which waits for a card, restores the
+# next image with a read-back verify, logs the result and waits for the
+# card to be removed. A failed image is written again to the same card,
+# up to MAX_ATTEMPTS times. A card that still fails is quarantined: its
+# IDm is set back to the one it arrived with, so that two cards never
+# carry the IDm of an image, and the operator is told to set it aside.
+# Its image goes to the next card if the wipe was verified, and is given
+# up otherwise. The exit status is 1 if any card was quarantined or any
+# image was not provisioned.
+#
+# --reader takes an nfcpy device path, --port a serial channel (see
+# uart.py), which may also be a pty of a host build of the firmware.
+# --simulate runs readers with simulated cards, no hardware needed.
+
+import argparse
+import json
+import os
+import queue
+import random
+import struct
+import sys
+import threading
+import time
+
+import image
+import uart
+
+MANIFEST_FORMAT = "silica-manifest"
+MANIFEST_VERSION = 1
+
+DEFAULT_PMM = "0001FFFFFFFFFFFF"
+MAX_ATTEMPTS = 3  # writes of an image to the same card
+MAX_CARDS = 2  # cards an image is written to before it is given up
+
+# interval of presence checks while waiting for a card to be removed
+PRESENCE_INTERVAL = 0.2
+
+
+def load_manifest(path: str) -> list[dict]:
+    """Card images of a manifest, in order."""
+    with open(path) as f:
+        manifest = json.load(f)
+    if manifest.get("format") != MANIFEST_FORMAT:
+        raise ValueError("not a SiliCa manifest")
+    if manifest.get("version") != MANIFEST_VERSION:
+        raise ValueError(f"unsupported manifest version {manifest.get('version')}")
+
+    cards = []
+    if "template" in manifest:
+        template = manifest["template"]
+        if isinstance(template, str):
+            with open(os.path.join(os.path.dirname(path), template)) as f:
+                template = json.load(f)
+        template = {k: v for k, v in template.items() if k != "error"}
+        template.setdefault("pmm", DEFAULT_PMM)
+
+        first = int(manifest["idm_first"], 16)
+        for i in range(manifest["count"]):
+            card = dict(template, idm=f"{first + i:016X}")
+            image.validate_image(card)
+            cards.append(card)
+
+    for card in manifest.get("cards", []):
+        image.validate_image(card)
+        cards.append(card)
+
+    return cards
+
+
+class NfcReader:
+    """Reader driven by nfcpy."""
+
+    def __init__(self, path: str):
+        import nfc
+        self.name = path
+        self.clf = nfc.ContactlessFrontend(path)
+
+    def wait_for_card(self, stop: threading.Event):
+        tag = self.clf.connect(
+            rdwr={"targets": ["212F"], 'on-connect': lambda tag: False},
+            terminate=stop.is_set)
+        return tag or None
+
+    def wait_for_removal(self, tag, stop: threading.Event) -> None:
+        while not stop.is_set() and tag.is_present:
+            time.sleep(PRESENCE_INTERVAL)
+
+    def close(self) -> None:
+        self.clf.close()
+
+
+class SerialReader:
+    """Card on the serial channel, present while it answers Polling."""
+
+    def __init__(self, path: str):
+        self.name = path
+        self.channel = uart.SerialChannel.open(path, timeout=PRESENCE_INTERVAL)
+
+    def wait_for_card(self, stop: threading.Event):
+        while not stop.is_set():
+            try:
+                return uart.SerialTag(self.channel)
+            except uart.SerialError:
+                time.sleep(PRESENCE_INTERVAL)
+        return None
+
+    def wait_for_removal(self, tag, stop: threading.Event) -> None:
+        while not stop.is_set():
+            try:
+                tag.polling()
+            except uart.SerialError:
+                return
+            time.sleep(PRESENCE_INTERVAL)
+
+    def close(self) -> None:
+        self.channel.port.close()
+
+
+def flip_bit(data: bytes, bit: int) -> bytes:
+    data = bytearray(data)
+    data[bit // 8] ^= 1 << (bit % 8)
+    return bytes(data)
+
+
+class SimulatedCard:
+    """
+    Model of a blank SiliCa for the commands used in provisioning.
+    With a fault, one of the first writes stores a flipped bit, which the
+    verify catches. A stuck card has a bit of a data block that never
+    changes, so every write of that block fails the verify.
+    """
+
+    def __init__(self, rng: random.Random, fault: bool, stuck: bool):
+        self.rng = rng
+        self.writes_to_fault = rng.randrange(8) if fault else -1
+        self.stuck = (rng.randrange(16), rng.randrange(128)) if stuck else None
+        self.blocks = {n: bytes(16) for n in range(16)}
+        self.blocks.update({n: b"\xFF" * 16 for n in range(0xC0, 0xC8)})
+        self.blocks[image.D_ID] = rng.randbytes(8) + bytes.fromhex(DEFAULT_PMM)
+        self.blocks[image.SYS_C] = bytes(16)
+        self.blocks[image.SER_C] = bytes(16)
+        self.blocks[image.ERROR_BLOCK] = bytes(16)
+        self.blocks[image.ERROR_BLOCK + 1] = bytes(16)
+
+    @property
+    def idm(self) -> bytes:
+        return self.blocks[image.D_ID][:8]
+
+    def write(self, block_num: int, data: bytes) -> bool:
+        if block_num in (image.D_ID, image.SYS_C, image.SER_C):
+            # codes take the first 8 bytes of their blocks
+            if block_num != image.D_ID:
+                data = data[:8] + bytes(8)
+        elif block_num not in self.blocks or block_num >= image.ERROR_BLOCK:
+            return False
+
+        if self.writes_to_fault == 0:
+            data = flip_bit(data, self.rng.randrange(128))
+        self.writes_to_fault -= 1
+        if self.stuck is not None and self.stuck[0] == block_num:
+            data = flip_bit(data, self.stuck[1])
+
+        self.blocks[block_num] = data
+        return True
+
+    def exchange(self, cmd_code: int, cmd_data: bytes) -> bytes:
+        """Response after the IDm, starting with the status flags."""
+        m = cmd_data[0]
+        n = cmd_data[1 + 2 * m]
+        block_list = cmd_data[2 + 2 * m:2 + 2 * m + 2 * n]
+        block_nums = [block_list[2 * i + 1] for i in range(n)]
+
+        if cmd_code == image.COMMAND_READ:
+            if any(b not in self.blocks for b in block_nums):
+                return bytes([0xFF, 0xA8])
+            return bytes([0, 0, n]) + b"".join(self.blocks[b] for b in block_nums)
+
+        data = cmd_data[2 + 2 * m + 2 * n:]
+        system = any(b in (image.D_ID, image.SYS_C, image.SER_C) for b in block_nums)
+        if system and n != 1:
+            return bytes([0xFF, 0xA8])
+        for i, block_num in enumerate(block_nums):
+            if not self.write(block_num, data[16 * i:16 * (i + 1)]):
+                return bytes([0xFF, 0xA8])
+        return bytes([0, 0])
+
+
+class SimulatedTag:
+    """Simulated card with the command interface of nfcpy's Type3Tag."""
+
+    def __init__(self, card: SimulatedCard, latency: float):
+        self.card = card
+        self.latency = latency
+        self.idm = card.idm
+
+    def send_cmd_recv_rsp(self, cmd_code: int, cmd_data: bytes, timeout: float = 1.0) -> bytes:
+        time.sleep(self.latency)
+        if self.idm != self.card.idm:
+            raise TimeoutError("no response")
+        rsp = self.card.exchange(cmd_code, cmd_data)
+        if rsp[0] != 0:
+            raise uart.CommandError(struct.unpack(">H", rsp[0:2])[0])
+        return rsp[2:]
+
+    def polling(self, system_code: int = 0xFFFF) -> tuple[bytes, bytes]:
+        time.sleep(self.latency)
+        block = self.card.blocks[image.D_ID]
+        return block[:8], block[8:16]
+
+    def __str__(self) -> str:
+        return f"Simulated SiliCa ID={self.idm.hex().upper()}"
+
+
+class SimulatedReader:
+    """
+    Reader with an operator placing and removing simulated cards after
+    random delays. latency is the time of one command exchange.
+    """
+
+    def __init__(self, name: str, seed: int, fault_rate: float, stuck_rate: float,
+                 latency: float = 0.01):
+        self.name = name
+        self.rng = random.Random(seed)
+        self.fault_rate = fault_rate
+        self.stuck_rate = stuck_rate
+        self.latency = latency
+
+    def wait_for_card(self, stop: threading.Event):
+        if stop.wait(self.rng.uniform(0.05, 0.2)):
+            return None
+        card = SimulatedCard(self.rng, self.rng.random() < self.fault_rate,
+                             self.rng.random() < self.stuck_rate)
+        return SimulatedTag(card, self.latency)
+
+    def wait_for_removal(self, tag, stop: threading.Event) -> None:
+        stop.wait(self.rng.uniform(0.05, 0.2))
+
+    def close(self) -> None:
+        pass
+
+
+class Job:
+    def __init__(self, index: int, card: dict):
+        self.index = index
+        self.card = card
+        self.cards = 0  # cards the image was written to
+
+
+class Batch:
+    """Jobs left to provision and the log of every card."""
+
+    def __init__(self, cards: list[dict], log_path: str):
+        self.jobs = queue.Queue()
+        for index, card in enumerate(cards):
+            self.jobs.put(Job(index, card))
+        self.remaining = len(cards)
+        self.failed = 0  # jobs given up after MAX_CARDS
+        self.quarantined = []  # IDms the quarantined cards arrived with
+        self.records = []
+        self.lock = threading.Lock()
+        self.log = open(log_path, "a") if log_path else None
+
+    def take(self, stop: threading.Event):
+        """Next job, or None once every job is done."""
+        while not stop.is_set():
+            try:
+                return self.jobs.get(timeout=0.1)
+            except queue.Empty:
+                with self.lock:
+                    if self.remaining == 0:
+                        return None
+        return None
+
+    def finish(self, job: Job, reader: str, idm: str, attempts: int, seconds: float,
+               error: str = None, wiped: bool = None) -> None:
+        """
+        Log a card. A failed card is quarantined, and its image is written
+        to the next card only if the card was wiped.
+        """
+        job.cards += 1
+        retry = error is not None and wiped and job.cards < MAX_CARDS
+        if retry:
+            self.jobs.put(job)
+
+        record = {
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S"),
+            "reader": reader,
+            "job": job.index,
+            "card": idm,
+            "idm": job.card.get("idm"),
+            "result": "ok" if error is None else "quarantined",
+            "error": error,
+            "attempts": attempts,
+            "wiped": wiped,
+            "seconds": round(seconds, 3),
+        }
+
+        with self.lock:
+            if not retry:
+                self.remaining -= 1
+            if error is not None:
+                self.quarantined.append(idm)
+                if not retry:
+                    self.failed += 1
+            self.records.append(record)
+            if error is None:
+                status = "ok"
+            else:
+                status = (f"error: {error}, QUARANTINED, set the card aside, "
+                          + ("wiped" if wiped else "NOT WIPED, it may hold the IDm of the image")
+                          + (", image goes to the next card" if retry else ", image given up"))
+            print(f"[{reader}] card {idm} job {job.index} ({job.card.get('idm')}) "
+                  f"{status} in {seconds:.3f}s")
+            if self.log:
+                self.log.write(json.dumps(record) + "\n")
+                self.log.flush()
+
+
+def restore(tag, card: dict) -> tuple[int, str]:
+    """
+    Write an image to a card, again while it fails, up to MAX_ATTEMPTS
+    times. Returns the number of attempts and the last error, or None.
+    """
+    error = None
+    for attempt in range(1, MAX_ATTEMPTS + 1):
+        try:
+            if attempt > 1:
+                # a failed attempt may have left the IDm of the image
+                tag.idm = tag.polling()[0]
+            image.restore_image(tag, card)
+            return attempt, None
+        except Exception as exc:
+            error = str(exc) or type(exc).__name__
+    return MAX_ATTEMPTS, error
+
+
+def wipe(tag, idm: bytes) -> bool:
+    """Set the IDm of a card back to the one it arrived with and verify it."""
+    try:
+        tag.idm, pmm = tag.polling()
+        image.write_blocks(tag, [image.D_ID], [idm + pmm])
+        tag.idm = idm
+        return image.read_blocks(tag, [image.D_ID])[0][:8] == idm
+    except Exception:
+        return False
+
+
+def worker(reader, batch: Batch, stop: threading.Event) -> None:
+    while True:
+        job = batch.take(stop)
+        if job is None:
+            return
+
+        tag = reader.wait_for_card(stop)
+        if tag is None:
+            batch.jobs.put(job)
+            return
+
+        # the card is identified by the IDm it arrived with
+        arrived = bytes(tag.idm)
+        start = time.monotonic()
+        attempts, error = restore(tag, job.card)
+        wiped = None if error is None else wipe(tag, arrived)
+        batch.finish(job, reader.name, arrived.hex().upper(), attempts,
+                     time.monotonic() - start, error, wiped)
+
+        reader.wait_for_removal(tag, stop)
+
+
+def report(batch: Batch, elapsed: float) -> None:
+    ok = [r for r in batch.records if r["result"] == "ok"]
+    retried = sum(1 for r in ok if r["attempts"] > 1)
+    print(f"{len(ok)} cards provisioned in {elapsed:.1f}s ({60 * len(ok) / elapsed:.1f} cards/min), "
+          f"{retried} after a retry, {len(batch.quarantined)} cards quarantined, "
+          f"{batch.failed} images given up, {batch.remaining} left")
+    if batch.quarantined:
+        print("Quarantined cards, by the IDm they arrived with:", " ".join(batch.quarantined))
+
+    for reader in sorted({r["reader"] for r in batch.records}):
+        seconds = [r["seconds"] for r in ok if r["reader"] == reader]
+        mean = sum(seconds) / len(seconds) if seconds else 0.0
+        print(f"  {reader}: {len(seconds)} cards, {mean:.3f}s per card")
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Provision a batch of SiliCa cards with several readers at once.",
+    )
+    parser.add_argument("manifest", help="manifest of card images (JSON)")
+    parser.add_argument("--reader", action="append", default=[], help="nfcpy device path")
+    parser.add_argument("--port", action="append", default=[], help="serial channel port")
+    parser.add_argument("--simulate", type=int, default=0, help="number of simulated readers")
+    parser.add_argument("--fault-rate", type=float, default=0.0,
+                        help="share of simulated cards that corrupt a write")
+    parser.add_argument("--stuck-rate", type=float, default=0.0,
+                        help="share of simulated cards with a stuck bit")
+    parser.add_argument("--seed", type=int, default=1, help="seed of the simulation")
+    parser.add_argument("--log", default="provision.log", help="JSON lines log of every card")
+    args = parser.parse_args(argv[1:])
+
+    try:
+        cards = load_manifest(args.manifest)
+    except (OSError, ValueError, KeyError) as exc:
+        print("Error in manifest:", exc)
+        return 1
+
+    readers = []
+    try:
+        readers += [NfcReader(path) for path in args.reader]
+        readers += [SerialReader(path) for path in args.port]
+    except Exception as exc:
+        print("Error opening reader:", exc)
+        for reader in readers:
+            reader.close()
+        return 1
+    readers += [SimulatedReader(f"sim{i}", args.seed + i, args.fault_rate, args.stuck_rate)
+                for i in range(args.simulate)]
+    if not readers:
+        print("No readers, use --reader, --port or --simulate")
+        return 1
+
+    batch = Batch(cards, args.log)
+    stop = threading.Event()
+    threads = [threading.Thread(target=worker, args=(reader, batch, stop)) for reader in readers]
+
+    print(f"Provisioning {len(cards)} cards with {len(readers)} readers")
+    start = time.monotonic()
+    for thread in threads:
+        thread.start()
+    try:
+        while any(thread.is_alive() for thread in threads):
+            time.sleep(0.1)
+    except KeyboardInterrupt:
+        print("Stopping after the current cards")
+        stop.set()
+    for thread in threads:
+        thread.join()
+    elapsed = time.monotonic() - start
+
+    for reader in readers:
+        reader.close()
+
+    report(batch, elapsed)
+    ok = batch.remaining == 0 and batch.failed == 0 and not batch.quarantined
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
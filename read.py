@@ -34,7 +34,7 @@ def main(argv):
             print("Last Error Command:", data[1:length].hex(' ').upper())
         
         elif argv[1] in ('dfc', 'ID'):
-            cmd_data = bytearray([1, 0x00, 0x00, 1, 0x80, 0x82])
+            cmd_data = bytearray([1, 0xFF, 0xFF, 1, 0x80, 0x82])
             data = tag.send_cmd_recv_rsp(COMMAND_READ, bytes(cmd_data), 1)[1:]
             print("block 0x82 (ID) data:", data.hex(' ').upper())
 
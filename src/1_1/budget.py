@@ -0,0 +1,76 @@
+# Memory budget check for SiliCa firmware
+# Reports static SRAM and flash usage after linking and fails the build
+# when a budget set in platformio.ini is exceeded:
+#   custom_sram_budget   bytes of .data, .bss and .noinit
+#                        (the rest of the SRAM is left for the stack)
+#   custom_flash_budget  bytes of .text, .rodata and .data
+#                        (must end before the block data area)
+
+import subprocess
+
+Import("env")
+
+# number of largest symbols listed for each memory
+SYMBOL_COUNT = 10
+
+SRAM_SECTIONS = (".data", ".bss", ".noinit")
+FLASH_SECTIONS = (".text", ".rodata", ".data")
+
+SRAM_TYPES = "bBdD"
+FLASH_TYPES = "tTrR"
+
+
+def run(tool, *args):
+    return subprocess.check_output(
+        [env.subst(tool)] + list(args), env=env["ENV"], universal_newlines=True
+    )
+
+
+def section_sizes(elf):
+    sizes = {}
+    for line in run("$SIZETOOL", "-A", elf).splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0].startswith("."):
+            sizes[fields[0]] = int(fields[1])
+    return sizes
+
+
+def symbol_sizes(elf):
+    symbols = []
+    nm = env.subst("$SIZETOOL").replace("size", "nm")
+    for line in run(nm, "--size-sort", "-S", "-C", elf).splitlines():
+        fields = line.split(None, 3)
+        if len(fields) == 4:
+            symbols.append((int(fields[1], 16), fields[2], fields[3]))
+    return symbols
+
+
+def report(name, used, budget, symbols, types):
+    print("%-6s %5d / %5d bytes (%d%%)" % (name, used, budget, 100 * used // budget))
+    largest = sorted((s for s in symbols if s[1] in types), reverse=True)
+    for size, _, symbol in largest[:SYMBOL_COUNT]:
+        print("  %5d  %s" % (size, symbol))
+    return used <= budget
+
+
+def check_budget(source, target, env):
+    elf = str(target[0])
+    sizes = section_sizes(elf)
+    symbols = symbol_sizes(elf)
+
+    sram = sum(sizes.get(s, 0) for s in SRAM_SECTIONS)
+    flash = sum(sizes.get(s, 0) for s in FLASH_SECTIONS)
+
+    sram_budget = int(env.GetProjectOption("custom_sram_budget"))
+    flash_budget = int(env.GetProjectOption("custom_flash_budget"))
+
+    print("Memory budget")
+    ok = report("SRAM", sram, sram_budget, symbols, SRAM_TYPES)
+    ok &= report("Flash", flash, flash_budget, symbols, FLASH_TYPES)
+
+    if not ok:
+        print("Error: memory budget exceeded")
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", check_budget)
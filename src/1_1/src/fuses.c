@@ -9,6 +9,6 @@ FUSES = {
     .SYSCFG0 = FUSE_SYSCFG0_DEFAULT | FUSE_EESAVE_bm, // do not erase EEPROM on chip erase
     .SYSCFG1 = SUT_1MS_gc, // 1ms startup time
     .APPEND = FUSE_APPEND_DEFAULT,
-    .BOOTEND = FUSE_BOOTEND_DEFAULT,
+    .BOOTEND = 0x3F, // boot section for the program up to 0x3EFF, the last 256 bytes hold block data
 };
 #endif
@@ -0,0 +1,282 @@
+// MAC_A generation of FeliCa Lite-S for
+// JIS X 6319-4 compatible card "SiliCa"
+//
+// MAC_A is a CBC-MAC with two-key Triple-DES (encrypt-decrypt-encrypt).
+// The session key is the Triple-DES CBC encryption of the random
+// challenge RC under the card key CK, and RC1 is the initial vector.
+// The card keeps 8-byte units in little endian, so every unit is
+// byte-reversed on its way in and out of DES.
+//
+// DES is optimized for speed within a small footprint:
+// - the S-boxes are merged with the P permutation into 32-bit tables,
+//   so each round is 8 table lookups
+// - the key schedule is expanded once per session into 48-bit subkeys,
+//   packed into 6 bytes per round to keep the SRAM within its budget,
+//   and unpacked with constant shifts in each round
+// - the initial and final permutations are applied once per Triple-DES
+//   operation, as they cancel out between its three stages
+
+#ifdef SILICA_MAC_A
+
+#include <stdint.h>
+#include <string.h>
+#include "silica.h"
+
+// S-boxes, 4 rows of 16 columns each
+static constexpr uint8_t sbox[8][64] = {
+    {14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7,
+     0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8,
+     4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0,
+     15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13},
+    {15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10,
+     3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5,
+     0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15,
+     13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9},
+    {10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8,
+     13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1,
+     13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7,
+     1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12},
+    {7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15,
+     13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9,
+     10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4,
+     3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14},
+    {2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9,
+     14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6,
+     4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14,
+     11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3},
+    {12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11,
+     10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8,
+     9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6,
+     4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13},
+    {4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1,
+     13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6,
+     1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2,
+     6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12},
+    {13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7,
+     1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2,
+     7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8,
+     2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11},
+};
+
+// P permutation, bit 1 is the most significant
+static constexpr uint8_t p_perm[32] = {
+    16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+    2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25};
+
+// permuted choice 1, C in the first 28 entries and D in the rest
+static constexpr uint8_t pc1[56] = {
+    57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+    10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+    63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+    14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4};
+
+// permuted choice 2, selects 48 of the 56 bits of C and D
+static constexpr uint8_t pc2[48] = {
+    14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+    23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+    41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+    44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32};
+
+// left rotations of C and D before each round
+static constexpr uint8_t key_shifts[16] = {1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1};
+
+// S-box i followed by the P permutation, indexed by the 6 input bits
+struct sp_table_t
+{
+    uint32_t value[8][64];
+};
+
+static constexpr sp_table_t make_sp_table()
+{
+    sp_table_t table = {};
+    for (int i = 0; i < 8; i++)
+    {
+        for (int x = 0; x < 64; x++)
+        {
+            // the outer bits select the row, the inner bits the column
+            int row = ((x >> 4) & 0x02) | (x & 0x01);
+            int column = (x >> 1) & 0x0F;
+            uint32_t s = (uint32_t)sbox[i][16 * row + column] << (28 - 4 * i);
+
+            uint32_t p = 0;
+            for (int j = 0; j < 32; j++)
+            {
+                if (s & (0x80000000UL >> (p_perm[j] - 1)))
+                    p |= 0x80000000UL >> j;
+            }
+            table.value[i][x] = p;
+        }
+    }
+    return table;
+}
+
+// constant data is placed in flash, which is memory-mapped on tinyAVR
+static constexpr sp_table_t sp_table = make_sp_table();
+
+// 48-bit subkeys of the 16 rounds, the 6 bits for S-box 1 first
+typedef uint8_t key_schedule_t[16][6];
+
+// key schedules of the session key, SK1 and SK2
+// also used for the card key while the session key is generated
+static key_schedule_t schedule[2];
+
+// initial vector of the session, RC1
+static uint8_t session_iv[8];
+
+// state of the MAC being generated
+static uint8_t mac_state[8];
+static uint8_t mac_first_key;
+
+// expand a key in card byte order into its subkeys
+static void expand_key(const uint8_t *key, key_schedule_t &subkeys)
+{
+    // C in bits 55-28 and D in bits 27-0
+    uint32_t c = 0;
+    uint32_t d = 0;
+    for (int i = 0; i < 56; i++)
+    {
+        // bit n of DES is in byte 7 - (n - 1) / 8 of the card
+        int n = pc1[i] - 1;
+        uint32_t bit = (key[7 - n / 8] >> (7 - n % 8)) & 1;
+        if (i < 28)
+            c = (c << 1) | bit;
+        else
+            d = (d << 1) | bit;
+    }
+
+    for (int round = 0; round < 16; round++)
+    {
+        for (int k = 0; k < key_shifts[round]; k++)
+        {
+            c = ((c << 1) | (c >> 27)) & 0x0FFFFFFF;
+            d = ((d << 1) | (d >> 27)) & 0x0FFFFFFF;
+        }
+
+        memset(subkeys[round], 0, 6);
+        for (int i = 0; i < 48; i++)
+        {
+            int n = pc2[i] - 1;
+            uint32_t bit = n < 28 ? c >> (27 - n) : d >> (55 - n);
+            subkeys[round][i / 8] |= (bit & 1) << (7 - i % 8);
+        }
+    }
+}
+
+// round function, expansion E is taken from R rotated right by one bit
+// each 3 bytes of the subkey hold the 6 bits for 4 S-boxes
+static inline uint32_t feistel(uint32_t r, const uint8_t *k)
+{
+    uint32_t t = (r >> 1) | (r << 31);
+    return sp_table.value[0][((t >> 26) & 0x3F) ^ (k[0] >> 2)] |
+           sp_table.value[1][((t >> 22) & 0x3F) ^ (((k[0] << 4) | (k[1] >> 4)) & 0x3F)] |
+           sp_table.value[2][((t >> 18) & 0x3F) ^ (((k[1] << 2) | (k[2] >> 6)) & 0x3F)] |
+           sp_table.value[3][((t >> 14) & 0x3F) ^ (k[2] & 0x3F)] |
+           sp_table.value[4][((t >> 10) & 0x3F) ^ (k[3] >> 2)] |
+           sp_table.value[5][((t >> 6) & 0x3F) ^ (((k[3] << 4) | (k[4] >> 4)) & 0x3F)] |
+           sp_table.value[6][((t >> 2) & 0x3F) ^ (((k[4] << 2) | (k[5] >> 6)) & 0x3F)] |
+           sp_table.value[7][(((t << 2) | (t >> 30)) & 0x3F) ^ (k[5] & 0x3F)];
+}
+
+// 16 rounds of DES between the initial and final permutations
+// the halves are swapped at the end, ready for the final permutation
+// or for the rounds of the next stage
+static void des_rounds(uint32_t &l, uint32_t &r, const key_schedule_t &subkeys, bool decrypt)
+{
+    for (int round = 0; round < 16; round++)
+    {
+        uint32_t t = l ^ feistel(r, subkeys[decrypt ? 15 - round : round]);
+        l = r;
+        r = t;
+    }
+
+    uint32_t t = l;
+    l = r;
+    r = t;
+}
+
+// bit of each input byte taken by the bytes of the initial permutation
+static constexpr uint8_t ip_bits[8] = {6, 4, 2, 0, 7, 5, 3, 1};
+
+// encrypt 8 bytes in card byte order in place with Triple-DES
+// key schedule `first` is used for the encryptions, the other one for
+// the decryption
+static void triple_des(uint8_t *data, int first)
+{
+    // initial permutation of the byte-reversed data
+    uint8_t x[8] = {};
+    for (int k = 0; k < 8; k++)
+    {
+        uint8_t in = data[k];
+        for (int i = 0; i < 8; i++)
+            x[i] = (x[i] << 1) | ((in >> ip_bits[i]) & 1);
+    }
+
+    // every byte is widened before it is shifted, int has 16 bits on AVR
+    uint32_t l = ((uint32_t)x[0] << 24) | ((uint32_t)x[1] << 16) | ((uint32_t)x[2] << 8) | x[3];
+    uint32_t r = ((uint32_t)x[4] << 24) | ((uint32_t)x[5] << 16) | ((uint32_t)x[6] << 8) | x[7];
+
+    des_rounds(l, r, schedule[first], false);
+    des_rounds(l, r, schedule[1 - first], true);
+    des_rounds(l, r, schedule[first], false);
+
+    x[0] = l >> 24;
+    x[1] = l >> 16;
+    x[2] = l >> 8;
+    x[3] = l;
+    x[4] = r >> 24;
+    x[5] = r >> 16;
+    x[6] = r >> 8;
+    x[7] = r;
+
+    // final permutation back into card byte order
+    for (int k = 0; k < 8; k++)
+    {
+        uint8_t out = 0;
+        for (int i = 0; i < 8; i++)
+            out |= ((x[i] >> (7 - k)) & 1) << ip_bits[i];
+        data[k] = out;
+    }
+}
+
+// start a session with the random challenge written to RC
+// ck and rc are 16 bytes each in card byte order
+void mac_start_session(const uint8_t *ck, const uint8_t *rc)
+{
+    expand_key(ck, schedule[0]);
+    expand_key(ck + 8, schedule[1]);
+
+    // SK1 = E(RC1), SK2 = E(RC2 ^ SK1)
+    uint8_t sk[16];
+    memcpy(sk, rc, 16);
+    triple_des(sk, 0);
+    for (int i = 0; i < 8; i++)
+        sk[8 + i] ^= sk[i];
+    triple_des(sk + 8, 0);
+
+    expand_key(sk, schedule[0]);
+    expand_key(sk + 8, schedule[1]);
+    memcpy(session_iv, rc, 8);
+}
+
+// start a MAC, a MAC for writing uses SK2 and SK1 swapped
+void mac_begin(bool write)
+{
+    memcpy(mac_state, session_iv, 8);
+    mac_first_key = write ? 1 : 0;
+}
+
+// add 8 bytes to the MAC
+void mac_update(const uint8_t *data)
+{
+    for (int i = 0; i < 8; i++)
+        mac_state[i] ^= data[i];
+    triple_des(mac_state, mac_first_key);
+}
+
+// copy the 8-byte MAC
+void mac_end(uint8_t *mac)
+{
+    memcpy(mac, mac_state, 8);
+}
+
+#endif
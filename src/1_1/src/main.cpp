@@ -1,46 +1,385 @@
 // Implementation of the application layer for
 // JIS X 6319-4 compatible card "SiliCa"
 
-#include <stdio.h>
 #include <string.h>
 #include <avr/eeprom.h>
 #include "silica.h"
 
+// blocks 0 to BLOCK_MAX - 1 are stored in EEPROM and the rest of
+// the user area up to block 0xF in flash
 static constexpr int BLOCK_MAX = 12;
+static constexpr int USER_BLOCK_MAX = 16;
+
+// area and service nodes are stored in flash after the user blocks,
+// NODE_BLOCK_COUNT blocks from NODE_BLOCK with two 8-byte records each:
+// node code, end service code (areas only), key version, reserved
+// all little endian, erased records (code 0xFFFF) are unused
+static constexpr int NODE_BLOCK = 0xC0;
+static constexpr int NODE_BLOCK_COUNT = 8;
+static constexpr int NODE_MAX = 2 * NODE_BLOCK_COUNT;
+static constexpr uint16_t NODE_DATA_OFFSET = 16 * (USER_BLOCK_MAX - BLOCK_MAX);
+static_assert(NODE_DATA_OFFSET + 16 * NODE_BLOCK_COUNT <= FLASH_DATA_SIZE, "flash data area is too small");
+
+#ifdef SILICA_MAC_A
+// the card key CK and its version CKV follow the nodes in flash
+static constexpr uint16_t CK_DATA_OFFSET = NODE_DATA_OFFSET + 16 * NODE_BLOCK_COUNT;
+static constexpr uint16_t CKV_DATA_OFFSET = CK_DATA_OFFSET + 16;
+static_assert(CKV_DATA_OFFSET + 16 <= FLASH_DATA_SIZE, "flash data area is too small");
+#endif
+
+static_assert(BLOCK_MAX <= RESPONSE_BLOCK_MAX, "too many blocks for a response");
+static_assert(13 + 16 * RESPONSE_BLOCK_MAX <= PACKET_MAX, "response does not fit in a packet");
 static constexpr int SYSTEM_MAX = 4;
 static constexpr int SERVICE_MAX = 4;
 
+// number of services in one Read/Write Without Encryption command
+// block list elements address services with a 4-bit index
+static constexpr int SERVICE_LIST_MAX = 16;
+
 constexpr int LAST_ERROR_SIZE = 2;
 
 static uint8_t idm[8];
 static uint8_t pmm[8];
 
-static uint8_t EEMEM idm_eep[8];
-static uint8_t EEMEM pmm_eep[8];
-
 static uint8_t service_code[2 * SERVICE_MAX];
 static uint8_t system_code[2 * SYSTEM_MAX];
 
-static uint8_t EEMEM service_code_eep[2 * SERVICE_MAX];
-static uint8_t EEMEM system_code_eep[2 * SYSTEM_MAX];
+// IDm, PMm and the code tables are stored at the end of the flash data
+// area, which leaves an EEPROM page to the journal of storage.cpp
+static constexpr uint16_t IDM_DATA_OFFSET = FLASH_DATA_SIZE - 32;
+static constexpr uint16_t PMM_DATA_OFFSET = IDM_DATA_OFFSET + 8;
+static constexpr uint16_t SERVICE_CODE_DATA_OFFSET = PMM_DATA_OFFSET + 8;
+static constexpr uint16_t SYSTEM_CODE_DATA_OFFSET = SERVICE_CODE_DATA_OFFSET + 2 * SERVICE_MAX;
+static_assert(SYSTEM_CODE_DATA_OFFSET + 2 * SYSTEM_MAX == FLASH_DATA_SIZE, "settings must end the flash data area");
+static_assert(IDM_DATA_OFFSET % PROGMEM_PAGE_SIZE + 32 <= PROGMEM_PAGE_SIZE, "settings must not cross a flash page");
+static_assert(NODE_DATA_OFFSET + 16 * NODE_BLOCK_COUNT <= IDM_DATA_OFFSET, "nodes overlap the settings");
+#ifdef SILICA_MAC_A
+static_assert(CKV_DATA_OFFSET + 16 <= IDM_DATA_OFFSET, "card key overlaps the settings");
+#endif
 
 static uint8_t EEMEM block_data_eep[16 * BLOCK_MAX];
 
 static const int ERROR_BLOCK = 0xE0;
 static uint8_t EEMEM last_error_eep[16 * LAST_ERROR_SIZE];
 
-static uint8_t response[0xFF] = {};
+#ifdef SILICA_LATENCY_STATS
+static const int LATENCY_STATS_BLOCK = 0xF0;
+#endif
+
+// the response is built in place over the command
+// each field of the command is read before it is overwritten
+static uint8_t *response;
+
+// response handed to the data link layer
+static response_t result;
+
+// system blocks 0x82 to 0x85 (ID, D_ID, SER_C, SYS_C)
+// rebuilt whenever IDm, PMm, service codes or system codes change
+static uint8_t system_blocks[4][16];
+
+// system block 0x88 (MC)
+static const uint8_t mc_block[16] = {
+    0xFF, 0xFF, 0xFF, // access permission
+    0x00,             // NDEF compatibility, AIC uses 0x00 so NDEF can't work :(
+    0xFF,             // RF parameter
+    // memory config
+};
+
+// unsupported system blocks read as zeros
+static const uint8_t zero_block[16] = {};
+
+#ifdef SILICA_MAC_A
+// write count (WCNT) and external authentication (STATE) of FeliCa Lite-S
+// STATE is kept from the power-up, which starts every session
+// their blocks are generated into the response like MAC_A
+static uint8_t wcnt[3];
+static bool ext_auth = false;
+
+// WCNT is reserved ahead in the user row, see storage_write_counter()
+// a MAC_A for writing is only accepted at a count below wcnt_limit, so
+// WCNT never goes back after a power loss and a write can't be replayed;
+// up to WCNT_RESERVE counts are skipped at each power-up instead
+static constexpr uint32_t WCNT_RESERVE = 16;
+static constexpr uint32_t WCNT_MAX = 0xFFFFFF;
+static uint32_t wcnt_limit;
+#endif
+
+// access rights of a service without encryption
+static constexpr uint8_t ACCESS_READ = 0x01;
+static constexpr uint8_t ACCESS_WRITE = 0x02;
+
+// area or service in the sorted node index
+struct node_t
+{
+    uint16_t code;
+    uint16_t end;         // end service code of an area
+    uint16_t key_version; // little endian as sent
+    uint8_t access;
+    bool listed; // found by Search Service Code
+};
+
+// nodes that exist without configuration
+// the root area, the wildcard service used by the tools and the fixed
+// services of FeliCa Lite-S, which readers use for RC, STATE and MAC_A
+static constexpr node_t builtin_nodes[] = {
+    {0x0000, 0xFFFE, 0x0000, 0, true},
+    {0xFFFF, 0x0000, 0x0000, ACCESS_READ | ACCESS_WRITE, false},
+    {0x0009, 0x0000, 0x0000, ACCESS_READ | ACCESS_WRITE, false},
+    {0x000B, 0x0000, 0x0000, ACCESS_READ, false},
+};
+static constexpr int BUILTIN_NODE_COUNT = sizeof(builtin_nodes) / sizeof(builtin_nodes[0]);
+
+// nodes sorted by code, rebuilt whenever service codes or nodes change
+// sorting by code puts each area right before the nodes it covers
+static node_t node_index[NODE_MAX + SERVICE_MAX + BUILTIN_NODE_COUNT];
+static uint8_t node_count;
+
+// number of request codes supported by Polling
+static constexpr int REQUEST_CODE_MAX = 3;
+
+// prebuilt Polling responses for each system and request code
+// rebuilt whenever IDm, PMm or system codes change
+static uint8_t polling_response[SYSTEM_MAX][REQUEST_CODE_MAX][20];
+
+void update_polling_response()
+{
+    for (int i = 0; i < SYSTEM_MAX; i++)
+    {
+        for (int request_code = 0; request_code < REQUEST_CODE_MAX; request_code++)
+        {
+            uint8_t *dst = polling_response[i][request_code];
+
+            if (request_code == 0x00)
+                dst[0] = 18;
+            else
+                dst[0] = 20;
+
+            // response code
+            dst[1] = 0x01;
+
+            memcpy(dst + 2, idm, 8);
+            memcpy(dst + 10, pmm, 8);
+
+            if (i > 0)
+            {
+                // update the top nibble of IDm with the system index
+                dst[2] = (i << 4) | (dst[2] & 0x0F);
+            }
+
+            // system code request
+            if (request_code == 0x01)
+            {
+                memcpy(dst + 18, system_code + 2 * i, 2);
+            }
+            // communication performance request
+            if (request_code == 0x02)
+            {
+                dst[18] = 0x00; // reserved
+#ifdef SILICA_424K
+                dst[19] = 0x83; // 212kbps and 424kbps, rate detected automatically
+#else
+                dst[19] = 0x01; // only 212kbps communication is supported
+#endif
+            }
+        }
+    }
+}
+
+void update_system_blocks()
+{
+    uint8_t *dst = system_blocks[0x82 - 0x82]; // ID
+    memcpy(dst, idm, 8);
+    // Aime Amusement IC DFC
+    dst[8] = 0x00;
+    dst[9] = 0x78;
+    memset(dst + 10, 0x00, 6);
+
+    dst = system_blocks[0x83 - 0x82]; // D_ID
+    memcpy(dst, idm, 8);
+    memcpy(dst + 8, pmm, 8);
+
+    dst = system_blocks[0x84 - 0x82]; // SER_C
+    memcpy(dst, service_code, 2 * SERVICE_MAX);
+    memset(dst + 2 * SERVICE_MAX, 0x00, 16 - 2 * SERVICE_MAX);
+
+    dst = system_blocks[0x85 - 0x82]; // SYS_C
+    memcpy(dst, system_code, 2 * SYSTEM_MAX);
+    memset(dst + 2 * SYSTEM_MAX, 0x00, 16 - 2 * SYSTEM_MAX);
+}
+
+// areas have attribute 0b00000x in the low 6 bits of the code
+static inline bool is_area(uint16_t code)
+{
+    return (code & 0x3E) == 0x00;
+}
+
+// services have attributes 0b001000 to 0b010111
+static inline bool is_service(uint16_t code)
+{
+    uint8_t attribute = code & 0x3F;
+    return 0x08 <= attribute && attribute < 0x18;
+}
+
+// access rights from the attribute in the low 6 bits of a service code
+// areas and services that need authentication are not accessible
+static uint8_t service_access(uint16_t code)
+{
+    uint8_t attribute = code & 0x3F;
+
+    // without authentication
+    if (!is_service(code) || !(attribute & 0x01))
+        return 0;
+
+    // random and cyclic services, bit 1 is set for read only
+    if (attribute < 0x10)
+        return (attribute & 0x02) ? ACCESS_READ : ACCESS_READ | ACCESS_WRITE;
+
+    // purse services, only direct access is writable
+    return attribute == 0x11 ? ACCESS_READ | ACCESS_WRITE : ACCESS_READ;
+}
+
+// position of a code in the node index, or where it would be inserted
+static int search_node(uint16_t code)
+{
+    int low = 0;
+    int high = node_count;
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (node_index[mid].code < code)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// node of a code, nullptr if it does not exist
+static const node_t *find_node(uint16_t code)
+{
+    int i = search_node(code);
+    if (i < node_count && node_index[i].code == code)
+        return &node_index[i];
+    return nullptr;
+}
+
+// insert a node unless its code is already in the index
+static void add_node(const node_t &node)
+{
+    int i = search_node(node.code);
+    if (i < node_count && node_index[i].code == node.code)
+        return;
+
+    memmove(&node_index[i + 1], &node_index[i], (node_count - i) * sizeof(node_t));
+    node_index[i] = node;
+    node_count++;
+}
+
+// insert a node from its code, unknown attributes are ignored
+// unless access is given
+// an area must end with an end service code (attribute 0b111110) above it
+// access is added to the rights the attribute gives
+static void add_node(uint16_t code, uint16_t end, uint16_t key_version, uint8_t access = 0)
+{
+    if (is_area(code))
+    {
+        if ((end & 0x3F) != 0x3E || end < code)
+            return;
+    }
+    else if (!is_service(code) && access == 0)
+    {
+        return;
+    }
+
+    node_t node;
+    node.code = code;
+    node.end = is_area(code) ? end : 0x0000;
+    node.key_version = key_version;
+    node.access = service_access(code) | access;
+    node.listed = true;
+    add_node(node);
+}
+
+// nodes stored in flash come first, then service codes and built-in nodes
+// so the first definition of a code wins
+void update_node_index()
+{
+    node_count = 0;
+
+    for (int i = 0; i < NODE_MAX; i++)
+    {
+        const uint8_t *record = storage_flash_data(NODE_DATA_OFFSET + 8 * i);
+        add_node(record[0] | (record[1] << 8), record[2] | (record[3] << 8), record[4] | (record[5] << 8));
+    }
+
+    for (int i = 0; i < SERVICE_MAX; i++)
+    {
+        uint16_t code = service_code[2 * i] | (service_code[2 * i + 1] << 8);
+
+        // unused entries are erased, the wildcard service is built in
+        if (code == 0xFFFF)
+            continue;
+
+        // an area from SER_C covers its own code number only
+        uint16_t end = code == 0x0000 ? 0xFFFE : code | 0x3E;
+
+        // a code from SER_C is readable whatever its attribute, so cards
+        // set up with the area 0x0000 keep working
+        add_node(code, end, 0x0000, ACCESS_READ);
+    }
+
+    for (int i = 0; i < BUILTIN_NODE_COUNT; i++)
+        add_node(builtin_nodes[i]);
+}
+
+// access rights of a service, 0 if it is not found
+static uint8_t find_service(uint16_t code)
+{
+    const node_t *node = find_node(code);
+    return node != nullptr ? node->access : 0;
+}
+
+// look up the service code list of a Read/Write Without Encryption command
+// return the status flag 2 of the command, 0 if all services are found
+static uint8_t parse_service_list(int m, const uint8_t *service_list, uint8_t *access)
+{
+    if (!(1 <= m && m <= SERVICE_LIST_MAX))
+        return 0xA1;
+
+    for (int i = 0; i < m; i++)
+    {
+        access[i] = find_service(service_list[2 * i] | (service_list[2 * i + 1] << 8));
+        if (access[i] == 0)
+            return 0xA6;
+    }
+
+    return 0x00;
+}
 
 void initialize()
 {
-    // read parameters from EEPROM
-    eeprom_read_block(idm, idm_eep, 8);
-    eeprom_read_block(pmm, pmm_eep, 8);
-    eeprom_read_block(service_code, service_code_eep, 2 * SERVICE_MAX);
-    eeprom_read_block(system_code, system_code_eep, 2 * SYSTEM_MAX);
+    // load EEPROM into the RAM cache
+    storage_initialize();
+
+    // read parameters from flash
+    storage_read_flash(idm, IDM_DATA_OFFSET, 8);
+    storage_read_flash(pmm, PMM_DATA_OFFSET, 8);
+    storage_read_flash(service_code, SERVICE_CODE_DATA_OFFSET, 2 * SERVICE_MAX);
+    storage_read_flash(system_code, SYSTEM_CODE_DATA_OFFSET, 2 * SYSTEM_MAX);
+
+#ifdef SILICA_MAC_A
+    // WCNT goes on from the last reserved count
+    wcnt_limit = storage_read_counter();
+    for (int i = 0; i < 3; i++)
+        wcnt[i] = wcnt_limit >> (8 * i);
+#endif
+
+    update_polling_response();
+    update_system_blocks();
+    update_node_index();
 }
 
-bool polling(packet_t command)
+packet_t polling(packet_t command)
 {
     // find system code
     int system_index = -1;
@@ -66,45 +405,13 @@ bool polling(packet_t command)
     }
 
     if (system_index == -1)
-        return false;
+        return nullptr;
 
     uint8_t request_code = command[4];
-    if (request_code == 0x00)
-        response[0] = 18;
-    else
-        response[0] = 20;
-
-    if (request_code > 0x02)
-        return false;
-
-    // response code
-    response[1] = 0x01;
-
-    // time slot (unused)
-    int n = command[5];
-
-    memcpy(response + 2, idm, 8);
-    memcpy(response + 10, pmm, 8);
-
-    if (system_index > 0)
-    {
-        // update the top nibble of IDm with the system index
-        response[2] = (system_index << 4) | (response[2] & 0x0F);
-    }
-
-    // system code request
-    if (request_code == 0x01)
-    {
-        memcpy(response + 18, system_code + 2 * system_index, 2);
-    }
-    // communication performance request
-    if (request_code == 0x02)
-    {
-        response[18] = 0x00; // reserved
-        response[19] = 0x01; // only 212kbps communication is supported
-    }
+    if (request_code >= REQUEST_CODE_MAX)
+        return nullptr;
 
-    return true;
+    return polling_response[system_index][request_code];
 }
 
 bool request_service(packet_t command)
@@ -121,28 +428,38 @@ bool request_service(packet_t command)
 
     response[10] = n;
 
-    // always return key version 0
+    // key version of each node, FFFF if it does not exist
+    // each code is overwritten by its own key version
     for (int i = 0; i < n; i++)
     {
-        response[11 + 2 * i] = 0x00;
-        response[12 + 2 * i] = 0x00;
+        const node_t *node = find_node(command[11 + 2 * i] | (command[12 + 2 * i] << 8));
+        uint16_t key_version = node != nullptr ? node->key_version : 0xFFFF;
+
+        response[11 + 2 * i] = key_version & 0xFF;
+        response[12 + 2 * i] = key_version >> 8;
     }
 
     return true;
 }
 
-int parse_block_list(int n, const uint8_t *block_list, uint8_t *block_nums)
+int parse_block_list(int n, int m, const uint8_t *block_list, uint8_t *block_nums, uint8_t *service_indices)
 {
     int j = 0;
     for (int i = 0; i < n; i++)
     {
-        if (block_list[j] == 0x80)
+        uint8_t element = block_list[j];
+        if ((element & 0x70) != 0x00 || (element & 0x0F) >= m)
+            return 0;
+
+        service_indices[i] = element & 0x0F;
+
+        if (element & 0x80)
         {
             // 2-byte block list element
             block_nums[i] = block_list[j + 1];
             j += 2;
         }
-        else if (block_list[j] == 0x00)
+        else
         {
             // 3-byte block list element
             if (block_list[j + 2] != 0x00)
@@ -150,172 +467,306 @@ int parse_block_list(int n, const uint8_t *block_list, uint8_t *block_nums)
             block_nums[i] = block_list[j + 1];
             j += 3;
         }
-        else
-        {
-            return 0;
-        }
     }
     // size of block list
     return j;
 }
 
-bool read_without_encryption(packet_t command)
+// check that the service of each block allows the access
+static bool check_access(int n, const uint8_t *service_indices, const uint8_t *access, uint8_t required)
 {
-    // check length
-    if (command[0] < 16)
-        return false;
-
-    // number of services
-    int m = command[10];
+    for (int i = 0; i < n; i++)
+    {
+        if (!(access[service_indices[i]] & required))
+            return false;
+    }
+    return true;
+}
 
-    if (m != 1)
+#ifdef SILICA_MAC_A
+// add the block numbers of a command to a MAC, 2 bytes each
+// padded with FFh to 8-byte units
+static void mac_update_block_nums(int n, const uint8_t *block_nums)
+{
+    for (int i = 0; i < n; i += 4)
     {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA1; // status flag 2
+        uint8_t unit[8];
+        memset(unit, 0xFF, 8);
+        for (int j = 0; j < 4 && i + j < n; j++)
+        {
+            unit[2 * j] = block_nums[i + j];
+            unit[2 * j + 1] = 0x00;
+        }
+        mac_update(unit);
+    }
+}
 
-        return true;
+// generate WCNT, STATE and, if it is the last block, MAC_A of a read
+// MAC_A covers the block numbers, including MAC_A, and the data of the
+// blocks before it
+// FeliCa Lite-S reads up to 3 blocks with MAC_A, more are allowed here
+static void read_lite_s_blocks(int n, const uint8_t *block_nums)
+{
+    for (int i = 0; i < n; i++)
+    {
+        uint8_t *dst = response + 13 + 16 * i;
+        if (block_nums[i] == 0x90)
+        {
+            memset(dst, 0x00, 16);
+            memcpy(dst, wcnt, 3);
+        }
+        else if (block_nums[i] == 0x92)
+        {
+            memset(dst, 0x00, 16);
+            dst[0] = ext_auth ? 0x01 : 0x00;
+        }
     }
 
-    uint16_t target_service_code = command[11] | (command[12] << 8);
+    if (block_nums[n - 1] != 0x91)
+        return;
 
-    // number of blocks
-    int n = command[13];
+    uint8_t *mac_a = response + 13 + 16 * (n - 1);
 
-    // find service code
-    bool service_found = false;
-    for (int i = 0; i < SERVICE_MAX; i++)
+    mac_begin(false);
+    mac_update_block_nums(n, block_nums);
+    for (int i = 0; i < n - 1; i++)
     {
-        uint16_t sc = service_code[2 * i] | (service_code[2 * i + 1] << 8);
-        // if (sc == 0)
-        //     continue;
-
-        if (target_service_code == sc)
-        {
-            service_found = true;
-            break;
-        }
+        mac_update(result.blocks[i]);
+        mac_update(result.blocks[i] + 8);
     }
+    mac_end(mac_a);
+    memset(mac_a + 8, 0x00, 8);
+}
 
-    if (target_service_code == 0xFFFF)
+// verify MAC_A of a block written with MAC_A
+// the MAC covers the write count, the block numbers and the data, with
+// the halves of the session key swapped
+static bool verify_write_mac(int block_num, const uint8_t *data, const uint8_t *mac_a)
+{
+    uint8_t unit[8] = {wcnt[0], wcnt[1], wcnt[2], 0x00, (uint8_t)block_num, 0x00, 0x91, 0x00};
+
+    mac_begin(true);
+    mac_update(unit);
+    mac_update(data);
+    mac_update(data + 8);
+    mac_end(unit);
+
+    return memcmp(unit, mac_a, 8) == 0;
+}
+
+// count a successful write, the count stops at FFFFFFh
+static void increment_wcnt()
+{
+    for (int i = 0; i < 3; i++)
     {
-        service_found = true;
+        if (++wcnt[i] != 0x00)
+            return;
     }
+    memset(wcnt, 0xFF, 3);
+}
+
+// reserve counts in the user row unless the current one is reserved
+static void reserve_wcnt()
+{
+    uint32_t count = wcnt[0] | ((uint32_t)wcnt[1] << 8) | ((uint32_t)wcnt[2] << 16);
+    if (count < wcnt_limit || wcnt_limit == WCNT_MAX)
+        return;
+
+    wcnt_limit = count < WCNT_MAX - WCNT_RESERVE ? count + WCNT_RESERVE : WCNT_MAX;
+    storage_write_counter(wcnt_limit);
+}
 
-    if (!service_found)
+// write a system block of FeliCa Lite-S
+// return false if the block can't be written
+static bool write_lite_s_block(int block_num, const uint8_t *data, bool with_mac)
+{
+    switch (block_num)
     {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA6; // status flag 2
+    case 0x80: // RC, starts a new session
+        mac_start_session(storage_flash_data(CK_DATA_OFFSET), data);
+        ext_auth = false;
+        return true;
 
+    case 0x86: // CKV
+        storage_write_flash(data, CKV_DATA_OFFSET, 16);
         return true;
+
+    case 0x87: // CK
+        storage_write_flash(data, CK_DATA_OFFSET, 16);
+        return true;
+
+    case 0x92: // STATE, EXT_AUTH is set by a write with MAC_A only
+        if (!with_mac)
+            return false;
+        ext_auth = data[0] & 0x01;
+        return true;
+
+    default:
+        return false;
     }
+}
+#endif
 
-    if (!(1 <= n && n <= BLOCK_MAX))
+// record the failed command and build an error response
+// the command must still be intact
+bool read_error(packet_t command, uint8_t status)
+{
+    save_error(command);
+    LOG_ERROR("Read failed");
+    LOG_PACKET(command);
+
+    response[0] = 12;      // length
+    response[10] = 0xFF;   // status flag 1
+    response[11] = status; // status flag 2
+    return true;
+}
+
+bool read_without_encryption(packet_t command)
+{
+    // check length
+    int len = command[0];
+    if (len < 16)
+        return false;
+
+    // number of services
+    int m = command[10];
+
+    uint8_t access[SERVICE_LIST_MAX];
+    uint8_t status = parse_service_list(m, command + 11, access);
+    if (status != 0x00)
     {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA2; // status flag 2
+        return read_error(command, status);
+    }
 
-        return true;
+    if (len < 14 + 2 * m)
+        return false;
+
+    // number of blocks
+    int n = command[11 + 2 * m];
+
+    if (!(1 <= n && n <= BLOCK_MAX))
+    {
+        return read_error(command, 0xA2);
     }
 
     uint8_t block_nums[BLOCK_MAX];
-    if (parse_block_list(n, command + 14, block_nums) == 0)
+    uint8_t service_indices[BLOCK_MAX];
+    int N = parse_block_list(n, m, command + 12 + 2 * m, block_nums, service_indices);
+    if (N == 0)
     {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA6; // status flag 2
-        return true;
+        return read_error(command, 0xA6);
     }
 
-    // load block data from EEPROM
+    if (len < 12 + 2 * m + N)
+        return false;
+
+    if (!check_access(n, service_indices, access, ACCESS_READ))
+    {
+        return read_error(command, 0xA5);
+    }
+
+    // locate block data, which is sent from where it is stored
     for (int i = 0; i < n; i++)
     {
         int block_num = block_nums[i];
 
-        bool valid_block = false;
-
-        uint8_t *dst = response + 13 + 16 * i;
+        const uint8_t *src = nullptr;
 
         if (block_num < BLOCK_MAX)
         {
-            valid_block = true;
-            eeprom_read_block(dst, block_data_eep + 16 * block_num, 16);
+            src = storage_data(block_data_eep + 16 * block_num);
         }
-        else if (BLOCK_MAX <= block_num && block_num <= 0xF)
+        else if (block_num < USER_BLOCK_MAX)
         {
-            // we don't have space in EEPROM, so all 0 it is!
-            valid_block = true;
-            memset(dst, 0x00, 16);
+            src = storage_flash_data(16 * (block_num - BLOCK_MAX));
+        }
+        else if (NODE_BLOCK <= block_num && block_num < NODE_BLOCK + NODE_BLOCK_COUNT)
+        {
+            src = storage_flash_data(NODE_DATA_OFFSET + 16 * (block_num - NODE_BLOCK));
         }
         else if (ERROR_BLOCK <= block_num && block_num < ERROR_BLOCK + LAST_ERROR_SIZE)
         {
-            valid_block = true;
-            eeprom_read_block(dst, last_error_eep + (block_num - ERROR_BLOCK) * 16, 16);
+            src = storage_data(last_error_eep + (block_num - ERROR_BLOCK) * 16);
+        }
+#ifdef SILICA_LATENCY_STATS
+        else if (LATENCY_STATS_BLOCK <= block_num && block_num < LATENCY_STATS_BLOCK + LATENCY_STATS_BLOCKS)
+        {
+            // generated below, once the block list is no longer needed
+            src = response + 13 + 16 * i;
         }
+#endif
         else if (0x81 <= block_num && block_num <= 0x92 && block_num != 0x89)
         {
-            valid_block = true;
             switch (block_num)
             {
-                case 0x81: // MAC
-                    memset(dst, 0, 16);
-                    break;
-
                 case 0x82: // ID
-                    memcpy(dst, idm, 8);
-                    // Aime Amusement IC DFC
-                    *(dst+8) = 0x00;
-                    *(dst+9) = 0x78;
-                    memset(dst + 10, 0x00, 6);
-                    break;
-
                 case 0x83: // D_ID
-                    memcpy(dst, idm, 8);
-                    memcpy(dst + 8, pmm, 8);
+                case 0x84: // SER_C
+                case 0x85: // SYS_C
+                    src = system_blocks[block_num - 0x82];
                     break;
 
-                case 0x84: // SER_C
-                    memcpy(dst, service_code, 2 * SERVICE_MAX);
-                    memset(dst + 2 * SERVICE_MAX, 0x00, 16 - 2 * SERVICE_MAX);
+                case 0x88: // MC
+                    src = mc_block;
                     break;
 
-                case 0x85: // SYS_C
-                    memcpy(dst, system_code, 2 * SYSTEM_MAX);
-                    memset(dst + 2 * SYSTEM_MAX, 0x00, 16 - 2 * SYSTEM_MAX);
+#ifdef SILICA_MAC_A
+                case 0x86: // CKV
+                    src = storage_flash_data(CKV_DATA_OFFSET);
                     break;
 
-                case 0x86: // CKV (used in MAC_A authentication)
-                case 0x87: // CK
-                    memset(dst, 0, 16);
+                case 0x91: // MAC_A, must be the last block
+                    if (i == n - 1)
+                        src = response + 13 + 16 * i;
                     break;
 
-                case 0x88: // MC
-                    memset(dst, 0xFF, 3); // access permission
-                    // Since AIC uses 0x00, we can't make NDEF work :(
-                    *(dst + 3) = 0x00; // NDEF compatability
-                    *(dst + 4) = 0xFF; // RF parameter
-                    memset(dst + 5, 0x00, 11); // memory config
+                case 0x90: // WCNT
+                case 0x92: // STATE
+                    // generated below, once the block list is no longer needed
+                    src = response + 13 + 16 * i;
                     break;
+#endif
 
+                case 0x81: // MAC
+#ifndef SILICA_MAC_A
+                case 0x86: // CKV (used in MAC_A authentication)
+#endif
+                case 0x87: // CK
+#ifndef SILICA_MAC_A
                 case 0x90: // WCNT (used in MAC_A authentication)
                 case 0x91: // MAC_A
                 case 0x92: // STATE (used in MAC_A authentication)
-                    memset(dst, 0x00, 16);
-                    break;                
+#endif
+                default:
+                    src = zero_block;
+                    break;
             }
         }
 
+        bool valid_block = src != nullptr;
+        result.blocks[i] = src;
+
         if (!valid_block)
         {
-            response[0] = 12;    // length
-            response[10] = 0xFF; // status flag 1
-            response[11] = 0xA8; // status flag 2
-            return true;
+            return read_error(command, 0xA8);
         }
     }
 
+#ifdef SILICA_LATENCY_STATS
+    // statistics are generated into the response, over the block list
+    for (int i = 0; i < n; i++)
+    {
+        int block_num = block_nums[i];
+        if (LATENCY_STATS_BLOCK <= block_num && block_num < LATENCY_STATS_BLOCK + LATENCY_STATS_BLOCKS)
+            read_latency_stats(block_num - LATENCY_STATS_BLOCK, response + 13 + 16 * i);
+    }
+#endif
+
+#ifdef SILICA_MAC_A
+    // after the statistics, which MAC_A may cover
+    read_lite_s_blocks(n, block_nums);
+#endif
+
     response[0] = 13 + 16 * n; // length
 
     response[10] = 0x00; // status flag 1
@@ -323,6 +774,17 @@ bool read_without_encryption(packet_t command)
 
     response[12] = n; // number of blocks
 
+    result.block_count = n;
+
+    return true;
+}
+
+// build an error response of Write Without Encryption
+bool write_error(uint8_t status)
+{
+    response[0] = 12;      // length
+    response[10] = 0xFF;   // status flag 1
+    response[11] = status; // status flag 2
     return true;
 }
 
@@ -330,45 +792,62 @@ bool write_without_encryption(packet_t command)
 {
     int len = command[0];
     int m = command[10]; // number of services
-    uint16_t target_service_code = command[11] | (command[12] << 8);
-    int n = command[13]; // number of blocks
 
     if (len < 32)
         return false;
 
-    if (m != 1)
-    {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA1; // status flag 2
+    uint8_t access[SERVICE_LIST_MAX];
+    uint8_t status = parse_service_list(m, command + 11, access);
+    if (status != 0x00)
+        return write_error(status);
 
-        return true;
-    }
+    if (len < 30 + 2 * m)
+        return false;
+
+    int n = command[11 + 2 * m]; // number of blocks
 
     if (!(1 <= n && n <= BLOCK_MAX))
-    {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA2; // status flag 2
-        return true;
-    }
+        return write_error(0xA2);
 
     uint8_t block_nums[BLOCK_MAX];
-    int N = parse_block_list(n, command + 14, block_nums);
+    uint8_t service_indices[BLOCK_MAX];
+    int N = parse_block_list(n, m, command + 12 + 2 * m, block_nums, service_indices);
 
     if (N == 0)
-    {
-        response[0] = 12;    // length
-        response[10] = 0xFF; // status flag 1
-        response[11] = 0xA6; // status flag 2
-        return true;
-    }
+        return write_error(0xA6);
 
     // check length
-    if (len != 14 + N + 16 * n)
+    if (len != 12 + 2 * m + N + 16 * n)
         return false;
 
+    // nothing is written unless every block is writable
+    if (!check_access(n, service_indices, access, ACCESS_WRITE))
+        return write_error(0xA5);
+
+    // block data follows the block list
+    const uint8_t *block_data = command + 12 + 2 * m + N;
+
+#ifdef SILICA_MAC_A
+    // a block written with MAC_A is followed by the MAC_A block
+    // the MAC is verified before anything is written
+    bool with_mac = block_nums[n - 1] == 0x91;
+    if (with_mac)
+    {
+        if (n != 2 || !verify_write_mac(block_nums[0], block_data, block_data + 16))
+            return write_error(0xA9);
+
+        // the count is in the user row before the data reaches EEPROM
+        // or flash, which wait for the user row write to complete
+        reserve_wcnt();
+        n = 1;
+    }
+#endif
+
+    // the node index is rebuilt once all blocks are written
+    bool nodes_changed = false;
+
     // write block data to EEPROM
+    // only the RAM cache is updated here, EEPROM is written between frames
     for (int i = 0; i < n; i++)
     {
         int block_num = block_nums[i];
@@ -378,7 +857,18 @@ bool write_without_encryption(packet_t command)
         if (block_num < BLOCK_MAX)
         {
             valid_block = true;
-            eeprom_update_block(command + 14 + N + 16 * i, block_data_eep + 16 * block_num, 16);
+            storage_write(block_data + 16 * i, block_data_eep + 16 * block_num, 16);
+        }
+        else if (block_num < USER_BLOCK_MAX)
+        {
+            valid_block = true;
+            storage_write_flash(block_data + 16 * i, 16 * (block_num - BLOCK_MAX), 16);
+        }
+        else if (NODE_BLOCK <= block_num && block_num < NODE_BLOCK + NODE_BLOCK_COUNT)
+        {
+            valid_block = true;
+            nodes_changed = true;
+            storage_write_flash(block_data + 16 * i, NODE_DATA_OFFSET + 16 * (block_num - NODE_BLOCK), 16);
         }
         
         // On Mutual Authentication (refer to Felica Lite-S User Manual 5.4.2)
@@ -400,11 +890,16 @@ bool write_without_encryption(packet_t command)
         // used in the MAC_A authentication process, SiliCa and similar emulation devices
         // will never work properly on SEGA arcades unless the keys were leaked.
 
+#ifdef SILICA_MAC_A
+        if (write_lite_s_block(block_num, block_data + 16 * i, with_mac))
+            valid_block = true;
+#else
         // RC
         if (block_num == 0x80)
         {
             valid_block = true;
         }
+#endif
 
         // D_ID
         if (n == 1 && block_num == 0x83)
@@ -412,12 +907,15 @@ bool write_without_encryption(packet_t command)
             valid_block = true;
 
             // Update IDm
-            memcpy(idm, command + 16, 8);
-            eeprom_update_block(idm, idm_eep, 8);
+            memcpy(idm, block_data, 8);
+            storage_write_flash(idm, IDM_DATA_OFFSET, 8);
 
             // Update PMm
-            memcpy(pmm, command + 24, 8);
-            eeprom_update_block(pmm, pmm_eep, 8);
+            memcpy(pmm, block_data + 8, 8);
+            storage_write_flash(pmm, PMM_DATA_OFFSET, 8);
+
+            update_polling_response();
+            update_system_blocks();
         }
 
         // SER_C
@@ -425,8 +923,11 @@ bool write_without_encryption(packet_t command)
         {
             valid_block = true;
 
-            memcpy(service_code, command + 16, 2 * SERVICE_MAX);
-            eeprom_update_block(service_code, service_code_eep, 2 * SERVICE_MAX);
+            memcpy(service_code, block_data, 2 * SERVICE_MAX);
+            storage_write_flash(service_code, SERVICE_CODE_DATA_OFFSET, 2 * SERVICE_MAX);
+
+            update_system_blocks();
+            update_node_index();
         }
 
         // SYS_C
@@ -434,10 +935,14 @@ bool write_without_encryption(packet_t command)
         {
             valid_block = true;
 
-            memcpy(system_code, command + 16, 2 * SYSTEM_MAX);
-            eeprom_update_block(system_code, system_code_eep, 2 * SYSTEM_MAX);
+            memcpy(system_code, block_data, 2 * SYSTEM_MAX);
+            storage_write_flash(system_code, SYSTEM_CODE_DATA_OFFSET, 2 * SYSTEM_MAX);
+
+            update_polling_response();
+            update_system_blocks();
         }
 
+#ifndef SILICA_MAC_A
         // STATE
         if (block_num == 0x90)
         {
@@ -449,16 +954,23 @@ bool write_without_encryption(packet_t command)
         {
             valid_block = true;
         }
+#endif
 
         if (!valid_block)
         {
-            response[0] = 12;    // length
-            response[10] = 0xFF; // status flag 1
-            response[11] = 0xA8; // status flag 2
-            return true;
+            if (nodes_changed)
+                update_node_index();
+            return write_error(0xA8);
         }
     }
 
+    if (nodes_changed)
+        update_node_index();
+
+#ifdef SILICA_MAC_A
+    increment_wcnt();
+#endif
+
     response[0] = 12; // length
 
     response[10] = 0x00; // status flag 1
@@ -467,29 +979,45 @@ bool write_without_encryption(packet_t command)
     return true;
 }
 
+// the index counts the nodes in tree order, which is the order of codes
+// areas are returned with their end service code
 bool search_service_code(int index)
 {
-    response[0] = 12;
+    const node_t *node = nullptr;
+    for (int i = 0; i < node_count; i++)
+    {
+        if (!node_index[i].listed)
+            continue;
 
-    if (index < 0 || index >= SERVICE_MAX)
+        if (index == 0)
+        {
+            node = &node_index[i];
+            break;
+        }
+        index--;
+    }
+
+    if (node == nullptr)
     {
+        response[0] = 12;
         response[10] = 0xFF;
         response[11] = 0xFF;
         return true;
     }
 
-    uint8_t sc1 = service_code[2 * index];
-    uint8_t sc2 = service_code[2 * index + 1];
+    response[10] = node->code & 0xFF;
+    response[11] = node->code >> 8;
 
-    if (sc1 == 0x00 && sc2 == 0x00)
+    if (is_area(node->code))
     {
-        response[10] = 0xFF;
-        response[11] = 0xFF;
-        return true;
+        response[0] = 14;
+        response[12] = node->end & 0xFF;
+        response[13] = node->end >> 8;
+    }
+    else
+    {
+        response[0] = 12;
     }
-
-    response[10] = sc1;
-    response[11] = sc2;
 
     return true;
 }
@@ -511,13 +1039,16 @@ bool request_system_code()
         n++;
     }
 
+    if (n == 0)
+        return false;
+
     response[0] = 11 + 2 * n;
     response[10] = n;
-    return n != 0;
+    return true;
 }
 
-// process application layer command and generate response
-packet_t process(packet_t command)
+// process application layer command and generate response packet
+packet_t process_command(packet_t command)
 {
     if (command == nullptr)
         return nullptr;
@@ -527,19 +1058,12 @@ packet_t process(packet_t command)
 
     // Polling
     if (command_code == 0x00)
-    {
-        if (polling(command))
-            return response;
-        else
-            return nullptr;
-    }
+        return polling(command);
 
     // Echo
+    // the response is the command itself
     if (command[1] == 0xF0 && command[2] == 0x00)
-    {
-        memcpy(response, command, len);
-        return response;
-    }
+        return command;
 
     // verify the tail of IDm matches
     if ((command[2] & 0x0F) != (idm[0] & 0x0F))
@@ -551,12 +1075,7 @@ packet_t process(packet_t command)
     if (command_code % 2 != 0)
         return nullptr;
 
-    // set response code
-    response[1] = command_code + 1;
-
-    // copy IDm from command to response
-    memcpy(response + 2, command + 2, 8);
-
+    // IDm of the command is kept in the response
     switch (command_code)
     {
     case 0x02: // Request Service
@@ -574,13 +1093,6 @@ packet_t process(packet_t command)
     case 0x06: // Read Without Encryption
         if (!read_without_encryption(command))
             return nullptr;
-        // status flag 1
-        if (response[10] != 0x00)
-        {
-            save_error(command);
-            Serial_println("Read failed");
-            print_packet(command);
-        }
         break;
     case 0x08: // Write Without Encryption
         if (!write_without_encryption(command))
@@ -609,16 +1121,34 @@ packet_t process(packet_t command)
         return nullptr;
     }
 
+    // set response code last, the command code is kept for failed commands
+    response[1] = command_code + 1;
+
     return response;
 }
 
+// process application layer command and generate response
+// the response overwrites the command
+const response_t *process(uint8_t *command)
+{
+    response = command;
+    result.block_count = 0;
+
+    result.packet = process_command(command);
+    if (result.packet == nullptr)
+        return nullptr;
+
+    return &result;
+}
+
 void save_error(packet_t command)
 {
     int len = command[0];
     if (len > sizeof(last_error_eep))
         len = sizeof(last_error_eep);
 
-    eeprom_update_block(command, last_error_eep, len);
+    // errors can repeat on every frame, so write back on power loss only
+    storage_write_deferred(command, last_error_eep, len);
 }
 
 // Debug: print packet to serial
@@ -631,13 +1161,5 @@ void print_packet(packet_t packet)
         return;
     }
 
-    for (int i = 1; i < len; i++)
-    {
-        char hex_str[5];
-        sprintf(hex_str, "%02X", packet[i]);
-        Serial_print(hex_str);
-        if (i != len - 1)
-            Serial_print(" ");
-    }
-    Serial_println("");
-}
\ No newline at end of file
+    Serial_println_hex(packet + 1, len - 1);
+}
@@ -1,389 +1,1519 @@
 // Implementation of the physical and data link layers for
 // JIS X 6319-4 compatible card "SiliCa"
 
-#include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/crc16.h>
 #include <util/delay.h>
 #include "silica.h"
 
 // data link layer header
-static const uint8_t header[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
+static constexpr uint8_t header[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
 
-// buffer for receiving data and command processing
-static uint8_t rx_buf[0x220] = {};
-static uint8_t command[0x110] = {};
+// maximum number of bytes captured while searching for the sync pattern
+static constexpr int FRAME_MAX = 0x220;
+
+// buffer for the received command followed by its EDC
+// the response is built in place over the command
+static uint8_t command[PACKET_MAX + 2] = {};
+
+// Polling response timing in TCB0 ticks (fclk/2 = fc/8)
+// the first time slot starts 2.417ms (32768/fc) after the end of the command
+// and each time slot lasts 1.208ms (16384/fc)
+static constexpr uint16_t POLLING_DELAY = 32768 / 8;
+static constexpr uint16_t TIME_SLOT = 16384 / 8;
+
+// ticks from the start of send_response() to the first bit of the preamble
+// (two flush bytes of 64 cycles each)
+static constexpr uint16_t TRANSMIT_LATENCY = 128 / 2;
+
+// state of the pseudo random number generator for time slot selection
+static uint16_t random_state = 1;
+
+#ifdef SILICA_424K
+// true if the last command was received at 424kbps
+// the response is sent at the same bit rate
+static bool fast_rate = false;
+#endif
+
+#ifdef SILICA_LATENCY_STATS
+// points in time measured for each command, in TCB0 ticks (2 cycles)
+// the frame is measured from sync lock to the end of the frame,
+// the others from the end of the frame
+enum latency_stage_t
+{
+    LATENCY_FRAME,    // sync lock to end of frame (decode)
+    LATENCY_EDC,      // EDC verified
+    LATENCY_PROCESS,  // return from process()
+    LATENCY_TRANSMIT, // first byte of the response
+    LATENCY_STAGES
+};
+
+// statistics are kept per command code 0x00 to 0x0E
+static constexpr int LATENCY_COMMANDS = 8;
+
+// histogram of each stage over all command codes, to save SRAM
+// bucket i counts below 1 << (LATENCY_SCALE[stage] + i) ticks
+// the checks after the frame take tens of ticks, the frame and the
+// response delay thousands
+static constexpr int LATENCY_BUCKETS = 8;
+static constexpr uint8_t LATENCY_SCALE[LATENCY_STAGES] = {8, 4, 4, 8};
+
+static uint16_t latency[LATENCY_STAGES];
+static uint16_t latency_min[LATENCY_COMMANDS][LATENCY_STAGES];
+static uint16_t latency_max[LATENCY_COMMANDS][LATENCY_STAGES];
+static uint16_t latency_histogram[LATENCY_STAGES][LATENCY_BUCKETS];
+static bool latency_dump_requested = false;
+
+// fewest polls of the SPI flags before a byte arrived, see SPI_receive()
+static uint8_t spi_min_polls = 0xFF;
+
+#define LATENCY_MARK(stage) (latency[stage] = TCB0.CNT)
+#else
+#define LATENCY_MARK(stage)
+#endif
+
+#ifdef SILICA_UART_COMMANDS
+#if SILICA_LOG_LEVEL == 0
+#error "SILICA_UART_COMMANDS needs serial output, set SILICA_LOG_LEVEL above 0"
+#endif
+
+// counters of received frames, reported over the serial command channel
+enum link_stat_t
+{
+    LINK_FRAMES,        // commands with a valid EDC
+    LINK_OVERFLOWS,     // SPI overflows during a frame
+    LINK_SYNC_ERRORS,   // no sync pattern or frame too long
+    LINK_LENGTH_ERRORS, // frame shorter than its length byte
+    LINK_EDC_ERRORS,    // EDC mismatch
+    LINK_SLIPS,         // bytes with invalid Manchester code, SILICA_RESYNC
+    LINK_RELOCKS,       // bit slips followed, SILICA_RESYNC
+    LINK_SERIAL_ERRORS, // serial frames with a bad CRC or type, or cut short
+    LINK_STATS
+};
+
+static uint16_t link_stats[LINK_STATS];
+
+// add to a counter, which stops at FFFFh
+static void add_link_stat(link_stat_t stat, uint16_t n)
+{
+    uint16_t sum = link_stats[stat] + n;
+    link_stats[stat] = sum < n ? 0xFFFF : sum;
+}
+
+#define LINK_COUNT(stat, n) add_link_stat(stat, n)
+#else
+#define LINK_COUNT(stat, n)
+#endif
+
+#if SILICA_LOG_LEVEL > 0
+// ring buffer for serial output, drained by the USART interrupt
+// a message that does not fit is dropped and counted instead of blocking
+static constexpr uint8_t SERIAL_BUFFER_SIZE = 128; // must be a power of 2
+static uint8_t serial_buffer[SERIAL_BUFFER_SIZE];
+static volatile uint8_t serial_head = 0; // written by the main loop
+static volatile uint8_t serial_tail = 0; // written by the interrupt
+static uint16_t serial_dropped = 0;
+
+ISR(USART0_DRE_vect)
+{
+    uint8_t tail = serial_tail;
+    if (tail == serial_head)
+    {
+        // buffer is empty
+        USART0.CTRLA &= ~USART_DREIE_bm;
+        return;
+    }
+    USART0.TXDATAL = serial_buffer[tail];
+    serial_tail = (tail + 1) & (SERIAL_BUFFER_SIZE - 1);
+}
+#endif
+
+#ifdef SILICA_UART_COMMANDS
+// Serial command channel
+//
+// The USART receives commands as well, so that a card can be provisioned
+// over a wire instead of one RF exchange per block. Frames in both
+// directions are
+//   A5h, type, length, payload (length bytes), CRC16 (big endian)
+// with the CRC over type, length and payload, the same CRC as the EDC.
+//   'C' command: the payload is an application layer packet, starting
+//       with its length byte. Answered by 'R' with the response packet
+//       including its blocks, or by 'N' if the command is unsupported.
+//       Reads and writes of up to BLOCK_MAX blocks load or dump a card
+//       image in a few frames, and blocks E0h-E1h hold the error log.
+//   'S' statistics: no payload. Answered by 'S' with the counters of
+//       link_stat_t, then corrected frames and dropped log messages,
+//       16 bits little endian each.
+// Any other frame, or one with a bad CRC, is answered by an empty 'E'.
+// Log messages are ASCII text, so the host finds frames between them.
+//
+// The card still runs on the clock and supply of the RF carrier, so it
+// must sit in the field of a reader while the channel is used, and the
+// reader may send frames at any time. Frames are received into the
+// command buffer while no RF frame arrives, and processed between RF
+// frames. During an RF frame the USART interrupts are masked, see
+// serial_pause(), and the RF frame overwrites the buffer, so a serial
+// frame received or being received then is discarded, as is one that
+// lost bytes to a receiver overflow. The host retries a frame that is
+// not answered.
+static constexpr uint8_t SERIAL_FRAME_START = 0xA5;
+static constexpr uint8_t SERIAL_COMMAND = 'C';
+static constexpr uint8_t SERIAL_RESPONSE = 'R';
+static constexpr uint8_t SERIAL_UNSUPPORTED = 'N';
+static constexpr uint8_t SERIAL_STATS = 'S';
+static constexpr uint8_t SERIAL_ERROR = 'E';
+
+// a complete frame is in the command buffer, set by the interrupt
+// further bytes are ignored until it is processed
+static volatile bool serial_frame_ready = false;
+static uint8_t serial_frame_type;
+static uint8_t serial_frame_length;
+
+// -3 waits for the start byte, -2 and -1 for type and length,
+// then the number of payload and CRC bytes in the command buffer
+static int16_t serial_rx_index = -3;
+
+ISR(USART0_RXC_vect)
+{
+    // the overflow flag belongs to the byte before the lost ones
+    bool overflow = USART0.RXDATAH & USART_BUFOVF_bm;
+    uint8_t data = USART0.RXDATAL;
+    if (serial_frame_ready)
+        return;
+
+    int16_t i = serial_rx_index;
+    if (overflow && i != -3)
+    {
+        // bytes were lost while the interrupts were masked
+        LINK_COUNT(LINK_SERIAL_ERRORS, 1);
+        i = -3;
+    }
+    else if (i == -3)
+    {
+        if (data == SERIAL_FRAME_START)
+            i = -2;
+    }
+    else if (i == -2)
+    {
+        serial_frame_type = data;
+        i = -1;
+    }
+    else if (i == -1)
+    {
+        serial_frame_length = data;
+        i = 0;
+    }
+    else
+    {
+        command[i++] = data;
+        if (i == serial_frame_length + 2)
+        {
+            serial_frame_ready = true;
+            i = -3;
+        }
+    }
+    serial_rx_index = i;
+}
+#endif
+
+// check room for a message of len bytes in the serial buffer
+// count the message as dropped if it does not fit
+static bool serial_reserve(int len)
+{
+#if SILICA_LOG_LEVEL > 0
+    uint8_t space = (serial_tail - serial_head - 1) & (SERIAL_BUFFER_SIZE - 1);
+    if (len <= space)
+        return true;
+
+    if (serial_dropped != 0xFFFF)
+        serial_dropped++;
+#else
+    (void)len;
+#endif
+    return false;
+}
+
+// append one byte to the serial buffer, room must be reserved
+static inline void serial_put(uint8_t data)
+{
+#if SILICA_LOG_LEVEL > 0
+    uint8_t head = serial_head;
+    serial_buffer[head] = data;
+    serial_head = (head + 1) & (SERIAL_BUFFER_SIZE - 1);
+#else
+    (void)data;
+#endif
+}
+
+// start draining the serial buffer
+static inline void serial_start()
+{
+#if SILICA_LOG_LEVEL > 0
+    USART0.CTRLA |= USART_DREIE_bm;
+#endif
+}
+
+// mask the USART interrupts while an RF frame is received
+// at 230400bps they would take up to half of the cycles of each SPI byte
+static inline void serial_pause()
+{
+#if SILICA_LOG_LEVEL > 0
+    USART0.CTRLA = 0;
+#endif
+}
+
+// unmask the USART interrupts after an RF frame or noise
+// output written meanwhile is sent now; the receiver only holds 2 bytes,
+// so bytes of a serial frame may have been lost, which the interrupt
+// finds from the overflow flag
+static void serial_resume()
+{
+#ifdef SILICA_UART_COMMANDS
+    USART0.CTRLA = USART_RXCIE_bm;
+#endif
+#if SILICA_LOG_LEVEL > 0
+    if (serial_tail != serial_head)
+        serial_start();
+#endif
+}
+
+// drop the serial frame in the command buffer, which an RF frame has
+// overwritten; the rest of it is skipped up to the next start byte
+static inline void serial_discard()
+{
+#ifdef SILICA_UART_COMMANDS
+    if (serial_frame_ready || serial_rx_index != -3)
+    {
+        serial_frame_ready = false;
+        serial_rx_index = -3;
+        LINK_COUNT(LINK_SERIAL_ERRORS, 1);
+    }
+#endif
+}
+
+// format one byte as 2 hex digits
+// return pointer past the last digit
+static char *format_hex(char *dst, uint8_t data)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    dst[0] = digits[data >> 4];
+    dst[1] = digits[data & 0xF];
+    return dst + 2;
+}
+
+// report dropped messages once there is room again
+static void serial_report_dropped()
+{
+#if SILICA_LOG_LEVEL > 0
+    if (serial_dropped == 0 || !serial_reserve(15))
+        return;
+
+    char str[16] = "(dropped XXXX)";
+    format_hex(format_hex(str + 9, serial_dropped >> 8), serial_dropped & 0xFF);
+    serial_dropped = 0;
+
+    for (const char *p = str; *p; p++)
+        serial_put(*p);
+    serial_put('\r');
+    serial_put('\n');
+    serial_start();
+#endif
+}
 
 // Functions for serial output.
-// These functions perform blocking writes.
+// These functions never block; output is sent by the USART interrupt.
 void Serial_write(uint8_t data)
 {
-    while (!(USART0.STATUS & USART_DREIF_bm))
+    if (!serial_reserve(1))
+        return;
+    serial_put(data);
+    serial_start();
+}
+
+void Serial_print(const char *str)
+{
+    if (!serial_reserve(strlen(str)))
+        return;
+    while (*str)
+        serial_put(*str++);
+    serial_start();
+}
+
+void Serial_println(const char *str)
+{
+    serial_report_dropped();
+
+    if (!serial_reserve(strlen(str) + 2))
+        return;
+    while (*str)
+        serial_put(*str++);
+    serial_put('\r');
+    serial_put('\n');
+    serial_start();
+}
+
+// print bytes in hex separated by spaces, followed by a line break
+void Serial_println_hex(const uint8_t *buf, int len)
+{
+    serial_report_dropped();
+
+    if (!serial_reserve(3 * len + 2))
+        return;
+    for (int i = 0; i < len; i++)
+    {
+        char hex_str[2];
+        format_hex(hex_str, buf[i]);
+        serial_put(hex_str[0]);
+        serial_put(hex_str[1]);
+        if (i != len - 1)
+            serial_put(' ');
+    }
+    serial_put('\r');
+    serial_put('\n');
+    serial_start();
+}
+
+// wait until all buffered output has been sent
+// only for on-demand output outside the command loop timing
+void Serial_flush()
+{
+#if SILICA_LOG_LEVEL > 0
+    while (serial_tail != serial_head)
+    {
+        // do nothing
+    }
+#endif
+}
+
+// transfer one byte via SPI
+// Arduino SPI.transfer() equivalent
+//
+// SCK runs at fclk/8, so a byte is transferred every 64 CPU cycles, and
+// all per-byte work while receiving must fit in that budget on average:
+//   capture_sync()           1 byte: end of frame check, 4 table lookups
+//   receive_packet_fixed()   2 bytes per decoded byte: 2 table lookups,
+//                            EDC update and, with SILICA_RESYNC, the
+//                            Manchester check and a copy of the samples
+//                            of a byte that fails it
+//   receive_raw_fixed()      1 byte per decoded byte at 424kbps: shifts
+//                            only, the EDC is calculated after the frame
+// The receive buffer holds 2 bytes, so a single step may run late by up
+// to 128 cycles. Beyond that bytes are lost and SPI_BUFOVF is set.
+// The USART interrupts are masked from the first byte of a frame or of
+// noise to its end, see serial_pause(), and the VLM interrupt only runs
+// on power loss.
+uint8_t SPI_transfer(uint8_t data = 0)
+{
+    while (!(SPI0.INTFLAGS & SPI_DREIF_bm))
     {
         // do nothing
     }
-    USART0.TXDATAL = data;
-}
+    SPI0.DATA = data;
+    return SPI0.DATA;
+}
+
+// receive one byte of a frame via SPI
+// With SILICA_LATENCY_STATS, the fewest polls of the flags before a byte
+// arrived is recorded as the remaining headroom, about 6 cycles per poll.
+static inline uint8_t SPI_receive()
+{
+#ifdef SILICA_LATENCY_STATS
+    uint8_t polls = 0;
+    while (!(SPI0.INTFLAGS & SPI_DREIF_bm))
+    {
+        polls++;
+    }
+    if (polls < spi_min_polls)
+        spi_min_polls = polls;
+
+    SPI0.DATA = 0;
+    return SPI0.DATA;
+#else
+    return SPI_transfer();
+#endif
+}
+
+#ifdef SILICA_CRC_TABLE
+// lookup table for CRC16-CCITT (polynomial 0x1021)
+struct crc16_table_t
+{
+    uint16_t value[256];
+};
+
+static constexpr crc16_table_t make_crc16_table()
+{
+    crc16_table_t table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t crc = i << 8;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        table.value[i] = crc;
+    }
+    return table;
+}
+
+static constexpr crc16_table_t crc16_table = make_crc16_table();
+#endif
+
+// update CRC16-CCITT with one byte
+// define SILICA_CRC_TABLE to use a 512-byte table in flash
+// instead of the bitwise avr-libc implementation
+static inline uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+#ifdef SILICA_CRC_TABLE
+    return (crc << 8) ^ crc16_table.value[(crc >> 8) ^ data];
+#else
+    return _crc_xmodem_update(crc, data);
+#endif
+}
+
+#ifdef SILICA_EDC_CORRECTION
+// lookup table to divide a CRC16-CCITT syndrome by x^8
+// value[i] is i * x^-8 modulo the polynomial
+struct syndrome_table_t
+{
+    uint16_t value[256];
+};
+
+static constexpr syndrome_table_t make_syndrome_table()
+{
+    syndrome_table_t table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t r = i;
+        for (int j = 0; j < 8; j++)
+            r = (r & 1) ? ((r ^ 0x1021) >> 1) | 0x8000 : r >> 1;
+        table.value[i] = r;
+    }
+    return table;
+}
+
+static constexpr syndrome_table_t syndrome_table = make_syndrome_table();
+
+// number of received frames with a corrected bit error
+static uint16_t corrected_frames = 0;
+
+// locate and flip a single bit error in a packet followed by its EDC
+// syndrome is the calculated EDC XOR the received EDC
+// return true if corrected
+//
+// The syndrome of an error in byte i is the error bit times x^(8 * k)
+// modulo the polynomial, where k is the number of bytes after byte i.
+// Dividing by x^8 once per byte from the end finds the byte whose
+// syndrome is a single bit, in at most len + 1 table lookups.
+// Positions are unique for frames of up to 4095 bytes.
+// The length byte can't be corrected, as it decides where the EDC is.
+static bool correct_bit_error(uint8_t *packet, int len, uint16_t syndrome)
+{
+    for (int i = len + 1; i > 0; i--)
+    {
+        if (syndrome < 0x100 && (syndrome & (syndrome - 1)) == 0)
+        {
+            packet[i] ^= syndrome;
+            return true;
+        }
+        syndrome = (syndrome >> 8) ^ syndrome_table.value[syndrome & 0xFF];
+    }
+    return false;
+}
+#endif
+
+// check if received data marks the end of frame
+static inline bool is_end_of_frame(uint8_t data)
+{
+    return data == 0x00 || data == 0xFF;
+}
+
+// sync pattern B2 4D as received at each bit shift
+// only the data bits selected by the mask are compared
+struct sync_pattern_t
+{
+    uint8_t mask;
+    uint8_t sync1;
+    uint8_t sync2;
+};
+
+static constexpr sync_pattern_t sync_patterns[8] = {
+    {0xAA, 0x8A, 0x08},
+    {0x55, 0x45, 0x04},
+    {0xAA, 0x22, 0x82},
+    {0x55, 0x11, 0x41},
+    {0xAA, 0x08, 0xA0},
+    {0x55, 0x04, 0x50},
+    {0xAA, 0x02, 0x28},
+    {0x55, 0x01, 0x14},
+};
+
+// lookup tables for the sync pattern
+// bit s of first[x] and second[x] is set if x matches the first or
+// second byte of the sync pattern at bit shift s
+// lowest[m] is the lowest bit set in m, or -1 if none
+struct sync_table_t
+{
+    uint8_t first[256];
+    uint8_t second[256];
+    int8_t lowest[256];
+};
+
+static constexpr sync_table_t make_sync_table()
+{
+    sync_table_t table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        for (int s = 0; s < 8; s++)
+        {
+            const sync_pattern_t &p = sync_patterns[s];
+            if ((i & p.mask) == p.sync1)
+                table.first[i] |= 1 << s;
+            if ((i & p.mask) == p.sync2)
+                table.second[i] |= 1 << s;
+        }
+
+        table.lowest[i] = -1;
+        for (int s = 7; s >= 0; s--)
+        {
+            if (i & (1 << s))
+                table.lowest[i] = s;
+        }
+    }
+    return table;
+}
+
+static constexpr sync_table_t sync_table = make_sync_table();
+
+// bit shifts at which a byte matches the first byte of the sync pattern
+// normal polarity in the low byte, inverted in the high byte
+static inline uint16_t sync_candidates(uint8_t sync1)
+{
+    return sync_table.first[sync1] | (sync_table.first[(uint8_t)~sync1] << 8);
+}
+
+// check whether a received byte completes the sync pattern
+// candidates are sync_candidates() of the previous byte, so each byte is
+// looked up once as it arrives
+// set bit shift and polarity if found
+// the lowest shift of each polarity is taken, and the higher of the two
+// wins; equal shifts are rejected
+bool match_sync(uint16_t candidates, uint8_t sync2, int &shift, bool &invert)
+{
+    int shift1 = sync_table.lowest[(candidates & 0xFF) & sync_table.second[sync2]];
+    int shift2 = sync_table.lowest[(candidates >> 8) & sync_table.second[(uint8_t)~sync2]];
+    if (shift1 != -1 && shift1 > shift2)
+    {
+        shift = shift1;
+        invert = false;
+        return true;
+    }
+    if (shift2 != -1 && shift2 > shift1)
+    {
+        shift = shift2;
+        invert = true;
+        return true;
+    }
+    return false;
+}
+
+#ifdef SILICA_424K
+// At 424kbps, SCK samples every bit once, in either half of the bit.
+// The preamble can't be told from no frame then, and the sync pattern
+// arrives without Manchester code, inverted if the second half is sampled.
+
+// number of bits of the preamble in the first byte of a 424kbps frame,
+// which ends with the start of the sync pattern, or -1 if it doesn't fit
+// mask is the byte received before the frame
+static int raw_sync_shift(uint8_t data, uint8_t mask)
+{
+    for (int k = 0; k < 8; k++)
+    {
+        if ((data ^ mask) == (header[6] >> k))
+            return k;
+    }
+    return -1;
+}
+
+// second byte of a 424kbps frame for a shift by raw_sync_shift()
+static inline uint8_t raw_sync_second(int k, uint8_t mask)
+{
+    uint16_t sync = (header[6] << 8) | header[7];
+    return ((sync << (8 - k)) >> 8) ^ mask;
+}
+#endif
+
+// capture frame from SPI until the sync pattern arrives
+// return 1 if found, 0 if frame too long, -1 if frame ended without sync
+// with SILICA_424K, frames at 424kbps are recognized by the sync pattern
+int capture_sync(int &shift, bool &invert)
+{
+    uint16_t candidates = sync_candidates(0x00);
+#ifdef SILICA_424K
+    uint8_t idle = 0x00;
+    int raw_shift = -1;
+#endif
+    for (int i = 0; i < FRAME_MAX; i++)
+    {
+        uint8_t data = SPI_transfer();
+
+        if (is_end_of_frame(data))
+        {
+            // ignore short noise before the frame
+            if (i < sizeof(header) * 2)
+            {
+#ifdef SILICA_UART_COMMANDS
+                // leave the idle loop for a frame received over serial
+                if (serial_frame_ready)
+                    return -2;
+#endif
+                // noise paused the USART, see below
+                if (i > 0)
+                    serial_resume();
+
+                i = -1;
+                candidates = sync_candidates(data);
+#ifdef SILICA_424K
+                idle = data;
+#endif
+                continue;
+            }
+            else
+            {
+                return -1;
+            }
+        }
+
+        // the frame starts, keep the USART from taking its cycles
+        if (i == 0)
+            serial_pause();
+
+#ifdef SILICA_424K
+        // the sync pattern of a 424kbps frame follows the first two bytes
+        if (i == 0)
+        {
+            raw_shift = raw_sync_shift(data, idle);
+        }
+        else if (i == 1 && raw_shift >= 0 && data == raw_sync_second(raw_shift, idle))
+        {
+            shift = raw_shift;
+            invert = idle == 0xFF;
+            fast_rate = true;
+            LATENCY_MARK(LATENCY_FRAME);
+            return 1;
+        }
+#endif
+
+        if (match_sync(candidates, data, shift, invert))
+        {
+#ifdef SILICA_424K
+            fast_rate = false;
+#endif
+            LATENCY_MARK(LATENCY_FRAME);
+            return 1;
+        }
+
+        candidates = sync_candidates(data);
+    }
+    // frame too long
+    return 0;
+}
+
+// lookup table for Manchester decoding
+// gathers bits 7, 5, 3 and 1 of a byte into a nibble;
+// the first half of each bit pair carries the data bit
+struct decode_table_t
+{
+    uint8_t nibble[256];
+};
+
+static constexpr decode_table_t make_decode_table()
+{
+    decode_table_t table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        uint8_t x = 0;
+        for (int j = 0; j < 4; j++)
+        {
+            if (i & (0x80 >> (2 * j)))
+                x |= 0x08 >> j;
+        }
+        table.nibble[i] = x;
+    }
+    return table;
+}
+
+// constant data is placed in flash, which is memory-mapped on tinyAVR
+static constexpr decode_table_t decode_table = make_decode_table();
+
+// 8 received bits starting at bit SHIFT of data1
+template <int SHIFT>
+static inline uint8_t window_bits(uint8_t data1, uint8_t data2)
+{
+    return (data1 << SHIFT) | (data2 >> (8 - SHIFT));
+}
+
+// decode the byte held by 16 received bits
+static inline uint8_t decode_bits(uint8_t hi, uint8_t lo)
+{
+    return (decode_table.nibble[hi] << 4) | decode_table.nibble[lo];
+}
+
+#ifdef SILICA_RESYNC
+// bytes with invalid Manchester code and bit slips followed in the last frame
+static uint8_t frame_slips = 0;
+static uint8_t frame_relocks = 0;
+
+// bytes with invalid Manchester code that are followed in one frame
+static constexpr int SLIP_MAX = 4;
+
+// samples around a byte with invalid Manchester code, kept by the
+// decoder and resolved after the frame by resolve_slips()
+struct slip_t
+{
+    uint8_t index;
+    uint8_t shift;
+    uint8_t samples[4];
+
+    // 1: one bit later, -1: earlier, 0: no slip
+    int8_t direction;
+};
+#endif
+
+// decoder state, carried over when the bit shift changes mid-frame
+struct decoder_t
+{
+    uint8_t *dst;
+    uint8_t mask;
+    int index;
+    int len;
+    uint16_t edc;
+
+    // data1 is the first byte of the next window and data0 the byte before
+    uint8_t data0;
+    uint8_t data1;
+
+    // data2 of the next window if it has been received already
+    bool pending;
+    uint8_t data2;
+
+#ifdef SILICA_RESYNC
+    // number of bytes with invalid Manchester code, the first SLIP_MAX
+    // of them with their samples, which are not cleared for a new frame
+    uint8_t slips;
+    slip_t *slip;
+#endif
+};
+
+#ifdef SILICA_RESYNC
+// check that every bit pair of 8 received bits is a transition
+static inline bool is_manchester(uint8_t data)
+{
+    return ((data ^ (data << 1)) & 0xAA) == 0xAA;
+}
+
+// bit pairs of a 16-bit window that are transitions, one bit per pair
+static inline uint16_t manchester_pairs(uint16_t window)
+{
+    return (window ^ (window >> 1)) & 0x5555;
+}
+
+// 4 received bytes as one word, first byte in the high bits
+// every byte is widened before it is shifted: int has 16 bits on the AVR,
+// so data << 8 would be negative from 0x80 on and sign-extend into the
+// bytes above it
+static inline uint32_t join_samples(uint8_t data0, uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    return ((uint32_t)data0 << 24) | ((uint32_t)data1 << 16) | ((uint32_t)data2 << 8) | data3;
+}
+
+// decode a 16-bit window of received data
+static inline uint8_t decode_window(uint16_t window)
+{
+    return decode_bits(window >> 8, window & 0xFF);
+}
+
+// decode the byte of a slip again with the bit shift moved by one in the
+// given direction from its first invalid bit pair on, into x, which holds
+// the byte as decoded
+// return true if the bits after that pair are valid with the new shift
+static bool relock(const slip_t &s, int direction, uint8_t mask, uint8_t &x)
+{
+    uint32_t samples = join_samples(s.samples[0], s.samples[1], s.samples[2], s.samples[3]);
+
+    uint16_t window = samples >> (8 - s.shift);
+    uint16_t valid = manchester_pairs(window);
+
+    // first invalid pair counted from the first bit
+    int first = 0;
+    while (valid & (0x4000 >> (2 * first)))
+        first++;
+
+    // pairs after the first invalid one, which may hold the slip itself
+    uint16_t tail = 0x5555 >> (2 * (first + 1));
+
+    // bits before the first invalid pair are kept
+    uint8_t keep = 0xFF << (8 - first);
+
+    uint16_t w = samples >> (8 - (s.shift + direction));
+    x = (x & keep) | ((decode_window(w) ^ mask) & ~keep);
+    return (manchester_pairs(w) & tail) == tail;
+}
+
+// first bit of the byte after a slip that moved the bits one earlier
+// it was sampled as the last bit of the window of the slip
+static inline uint8_t slip_next_bit(const slip_t &s, uint8_t mask)
+{
+    uint32_t samples = join_samples(s.samples[0], s.samples[1], s.samples[2], s.samples[3]);
+    return ((samples >> (8 - s.shift)) ^ mask) & 1;
+}
+
+// rebuild the packet from the decoded bytes and the resolved slips
+// The decoder moved one bit later at every slip. Where the slip went
+// the other way, the decoder is a data bit ahead from then on, and the
+// bit it skipped is taken from the samples of the slip. Where there was
+// none, it samples the second half of every bit pair, the complemented
+// bits, up to the next slip, which is taken to move it back in step.
+// With write, the packet is replaced; output never runs ahead of input.
+// return true if the EDC matches, the calculated EDC in edc
+static bool rebuild_packet(const decoder_t &d, bool write, uint16_t &edc)
+{
+    uint8_t *packet = d.dst;
+    int count = d.index;
+    int len = count;
+    uint16_t received = 0;
+    edc = 0;
+
+    uint16_t bits = 0;
+    int bit_count = 0;
+    int out = 0;
+    int next = 0;
+    bool odd = false;
+    for (int i = 0; i < count; i++)
+    {
+        uint8_t x = packet[i];
+        bool skipped = false;
+        if (next < d.slips && next < SLIP_MAX && d.slip[next].index == i)
+        {
+            const slip_t &s = d.slip[next++];
+            if (odd)
+            {
+                x ^= 0xFF;
+                odd = false;
+                skipped = true;
+            }
+            else if (s.direction != 0)
+            {
+                relock(s, s.direction, d.mask, x);
+                skipped = s.direction < 0;
+            }
+            else
+            {
+                odd = true;
+            }
+
+            bits = (bits << 8) | x;
+            bit_count += 8;
+            if (skipped)
+            {
+                bits = (bits << 1) | slip_next_bit(s, d.mask);
+                bit_count++;
+            }
+        }
+        else
+        {
+            bits = (bits << 8) | (odd ? x ^ 0xFF : x);
+            bit_count += 8;
+        }
+
+        while (bit_count >= 8 && out < count)
+        {
+            bit_count -= 8;
+            uint8_t y = bits >> bit_count;
+
+            if (out == 0)
+                len = y + 2;
+            if (out < len - 2)
+                edc = crc16_update(edc, y);
+            else if (out < len)
+                received = (received << 8) | y;
+
+            if (write)
+                packet[out] = y;
+            out++;
+        }
+    }
+
+    // the last bit may be missing, see verify_edc()
+    return len <= count && (edc ^ received) <= 1;
+}
+
+// resolve the slips of a frame and rebuild the packet
+// A slip by one bit in either direction is tried, and the bits after the
+// first invalid pair must be valid with the new shift. An extra bit can't
+// be told from a missing one inside a run of equal data bits, so often
+// both directions fit. The direction of the previous slip is taken then,
+// and the other one if the EDC fails that way and the slip is the last.
+// return the EDC calculated over the packet
+static uint16_t resolve_slips(decoder_t &d)
+{
+    bool odd = false;
+    int8_t direction = 1;
+    int ambiguous = -1;
+    for (int i = 0; i < d.slips; i++)
+    {
+        slip_t &s = d.slip[i];
+        ambiguous = -1;
+        if (odd)
+        {
+            // the decoder was a half bit off, the byte is no slip
+            s.direction = 0;
+            odd = false;
+            continue;
+        }
+
+        uint8_t x = 0;
+        bool later = relock(s, 1, d.mask, x);
+        bool earlier = relock(s, -1, d.mask, x);
+        if (later && earlier)
+        {
+            s.direction = direction;
+            ambiguous = i;
+        }
+        else if (later || earlier)
+        {
+            s.direction = later ? 1 : -1;
+        }
+        else
+        {
+            s.direction = 0;
+            odd = true;
+        }
+
+        if (s.direction != 0)
+        {
+            direction = s.direction;
+            frame_relocks++;
+        }
+    }
+
+    uint16_t edc;
+    if (!rebuild_packet(d, false, edc) && ambiguous >= 0)
+    {
+        d.slip[ambiguous].direction = -d.slip[ambiguous].direction;
+        if (!rebuild_packet(d, false, edc))
+            d.slip[ambiguous].direction = -d.slip[ambiguous].direction;
+    }
+    rebuild_packet(d, true, edc);
+    return edc;
+}
+#endif
+
+// receive and decode a packet with the bit shift fixed at compile time
+// mask is XORed into every byte to undo an inverted polarity
+// EDC of the packet is calculated while receiving
+// return the new bit shift if the decoder stopped for it, with the next
+// window in d.data1, or SHIFT at the end of the frame with the number of
+// bytes in d.index
+//
+// With SILICA_RESYNC, every byte is checked for valid Manchester code.
+// An invalid byte means the sampling phase slipped by one bit. Finding
+// the direction takes too long between two SPI bytes, so its samples are
+// kept for resolve_slips() and the decoder moves one bit later, which
+// keeps it in step with an extra bit and a data bit ahead otherwise.
+template <int SHIFT>
+static int receive_packet_fixed(decoder_t &d)
+{
+    uint8_t *dst = d.dst;
+    const uint8_t mask = d.mask;
+    int len = d.len;
+    int index = d.index;
+    uint16_t edc = d.edc;
+    uint8_t data1 = d.data1;
+    bool pending = d.pending;
+#ifdef SILICA_RESYNC
+    uint8_t data0 = d.data0;
+#endif
+
+    int new_shift = SHIFT;
+    while (index < len)
+    {
+        uint8_t data2;
+        if (pending)
+        {
+            data2 = d.data2;
+            pending = false;
+        }
+        else
+        {
+            data2 = SPI_receive();
+            if (is_end_of_frame(data2))
+                break;
+        }
+
+        // the last byte of a frame may overlap the end of frame
+        bool last = index + 1 == len;
+
+        // the third byte is not needed for small shifts,
+        // so stop right after the last bit of the packet
+        uint8_t data3 = 0x00;
+        if (SHIFT >= 2 || !last)
+            data3 = SPI_receive();
+
+        uint8_t hi = window_bits<SHIFT>(data1, data2);
+        uint8_t lo = window_bits<SHIFT>(data2, data3);
+        uint8_t x = decode_bits(hi, lo) ^ mask;
+
+#ifdef SILICA_RESYNC
+        if (!last && !(is_manchester(hi) && is_manchester(lo)))
+        {
+            if (d.slips < SLIP_MAX)
+            {
+                slip_t &s = d.slip[d.slips];
+                s.index = index;
+                s.shift = SHIFT;
+                s.samples[0] = data0;
+                s.samples[1] = data1;
+                s.samples[2] = data2;
+                s.samples[3] = data3;
+            }
+            d.slips++;
+            new_shift = SHIFT + 1;
+        }
+        data0 = data2;
+#endif
+
+        dst[index++] = x;
+
+        // read the length byte early to stop at the end of the packet
+        if (index == 1)
+            len = x + 2;
+
+        // the last 2 bytes are the received EDC itself
+        if (index <= len - 2)
+            edc = crc16_update(edc, x);
+
+        if (!last && is_end_of_frame(data3))
+            break;
+
+        data1 = data3;
+
+        if (new_shift != SHIFT)
+        {
+            d.data0 = data2;
+            break;
+        }
+    }
+
+    d.index = index;
+    d.len = len;
+    d.edc = edc;
+    d.data1 = data1;
+    d.pending = pending;
+    return index < len ? new_shift : SHIFT;
+}
+
+// receive and decode a packet following the first half of the sync pattern
+// return number of decoded bytes and the calculated EDC
+int receive_packet(int shift, bool invert, uint8_t *dst, uint16_t &edc)
+{
+    edc = 0;
+
+    // skip the second half of the sync pattern
+    uint8_t sync1 = SPI_receive();
+    uint8_t sync2 = SPI_receive();
+    if (is_end_of_frame(sync1) || is_end_of_frame(sync2))
+        return 0;
+
+    decoder_t d = {};
+#ifdef SILICA_RESYNC
+    slip_t slips[SLIP_MAX];
+    d.slip = slips;
+#endif
+    d.dst = dst;
+    d.mask = invert ? 0xFF : 0x00;
+    // length byte and EDC, updated once the length byte is decoded
+    d.len = 3;
+    d.data0 = sync2;
+    d.data1 = SPI_receive();
+    if (is_end_of_frame(d.data1))
+        return 0;
+
+#ifdef SILICA_RESYNC
+    // a shift with inverted polarity decodes the same bits as the shift
+    // one bit earlier, but only one of them sees Manchester bit pairs
+    // choose the one where the second half of the sync pattern is valid
+    uint32_t samples = join_samples(0, sync1, sync2, d.data1);
+    if (manchester_pairs(samples >> (8 - shift)) != 0x5555)
+    {
+        d.mask ^= 0xFF;
+        if (shift > 0)
+        {
+            shift--;
+        }
+        else
+        {
+            // the window starts one byte earlier
+            shift = 7;
+            d.pending = true;
+            d.data2 = d.data1;
+            d.data1 = sync2;
+            d.data0 = sync1;
+        }
+    }
+#endif
+
+    // select the decoder once per frame instead of once per bit,
+    // and again whenever the bit shift changes
+    while (true)
+    {
+        int new_shift = shift;
+        switch (shift)
+        {
+        case 0:
+            new_shift = receive_packet_fixed<0>(d);
+            break;
+        case 1:
+            new_shift = receive_packet_fixed<1>(d);
+            break;
+        case 2:
+            new_shift = receive_packet_fixed<2>(d);
+            break;
+        case 3:
+            new_shift = receive_packet_fixed<3>(d);
+            break;
+        case 4:
+            new_shift = receive_packet_fixed<4>(d);
+            break;
+        case 5:
+            new_shift = receive_packet_fixed<5>(d);
+            break;
+        case 6:
+            new_shift = receive_packet_fixed<6>(d);
+            break;
+        case 7:
+            new_shift = receive_packet_fixed<7>(d);
+            break;
+        }
+
+        if (new_shift == shift)
+            break;
+
+        // the next byte starts at bit new_shift + 16 of the old data1;
+        // data1 now holds data3 of the old window, data0 its data2
+        if (new_shift == 8)
+        {
+            // one bit later: the next window starts with a new byte
+            d.data0 = d.data1;
+            d.data1 = SPI_receive();
+            if (is_end_of_frame(d.data1))
+                break;
+            shift = 0;
+        }
+        else
+        {
+            shift = new_shift;
+        }
+    }
 
-void Serial_print(const char *str)
-{
-    while (*str)
-        Serial_write(*str++);
-}
+    edc = d.edc;
 
-void Serial_println(const char *str)
-{
-    Serial_print(str);
-    Serial_print("\r\n");
+#ifdef SILICA_RESYNC
+    frame_slips = d.slips;
+    frame_relocks = 0;
+    if (d.slips != 0 && d.slips <= SLIP_MAX)
+        edc = resolve_slips(d);
+#endif
+
+    return d.index;
 }
 
-// transfer one byte via SPI
-// Arduino SPI.transfer() equivalent
-uint8_t SPI_transfer(uint8_t data = 0)
+#ifdef SILICA_424K
+// receive a 424kbps packet with the bit shift fixed at compile time
+// data1 is the byte following the sync pattern, which holds its last
+// SHIFT bits and the first bits of the packet
+// the frame can't be told from no frame, so the length byte decides
+// where it ends
+template <int SHIFT>
+static int receive_raw_fixed(uint8_t *dst, uint8_t mask, uint8_t data1)
 {
-    while (!(SPI0.INTFLAGS & SPI_DREIF_bm))
+    int len = 3;
+    int index = 0;
+    while (index < len)
     {
-        // do nothing
+        uint8_t data2 = SPI_receive();
+        uint8_t x = window_bits<SHIFT>(data1, data2) ^ mask;
+        dst[index++] = x;
+
+        if (index == 1)
+            len = x + 2;
+
+        data1 = data2;
     }
-    SPI0.DATA = data;
-    return SPI0.DATA;
+    return index;
 }
 
-// calculate CRC16-CCITT
-uint16_t crc16(const uint8_t *buf, int len)
+// receive a packet following the first byte of the sync pattern at 424kbps
+// return number of received bytes
+static int receive_raw_packet(int shift, bool invert, uint8_t *dst)
 {
-    uint16_t crc = 0;
-    for (int i = 0; i < len; i++)
-        crc = _crc_xmodem_update(crc, buf[i]);
-    return crc;
-}
+    uint8_t mask = invert ? 0xFF : 0x00;
+    uint8_t data1 = SPI_receive();
 
-// capture frame from SPI
-// return length of captured data
-int capture_frame()
-{
-    // wait for start of frame
-    for (int i = 0; i < sizeof(rx_buf); i++)
-    {
-        uint8_t data = SPI_transfer();
-        rx_buf[i] = data;
+#ifdef SILICA_RESYNC
+    // bit slips are not followed at 424kbps
+    frame_slips = 0;
+    frame_relocks = 0;
+#endif
 
-        // end of frame
-        if (data == 0x00 || data == 0xFF)
-        {
-            // frame too short
-            if (i < sizeof(header) * 2)
-            {
-                i = -1;
-                continue;
-            }
-            else
-            {
-                return i + 1;
-            }
-        }
+    switch (shift)
+    {
+    case 0:
+        return receive_raw_fixed<0>(dst, mask, data1);
+    case 1:
+        return receive_raw_fixed<1>(dst, mask, data1);
+    case 2:
+        return receive_raw_fixed<2>(dst, mask, data1);
+    case 3:
+        return receive_raw_fixed<3>(dst, mask, data1);
+    case 4:
+        return receive_raw_fixed<4>(dst, mask, data1);
+    case 5:
+        return receive_raw_fixed<5>(dst, mask, data1);
+    case 6:
+        return receive_raw_fixed<6>(dst, mask, data1);
+    case 7:
+        return receive_raw_fixed<7>(dst, mask, data1);
     }
-    // frame too long
     return 0;
 }
+#endif
 
-// Debug: print captured frame to serial
-void print_frame(int rx_len)
+// mark the end of the received frame as the origin of response timing
+// the time since the previous frame is mixed into the random state
+void mark_end_of_frame()
 {
-    for (int i = 0; i < rx_len; i++)
-    {
-        char hex_str[5];
-        sprintf(hex_str, "%02X", rx_buf[i]);
-        Serial_print(hex_str);
-        if (i != rx_len - 1)
-            Serial_print(" ");
-    }
-    Serial_println("");
+    uint16_t now = TCB0.CNT;
+    TCB0.CNT = 0;
+
+    random_state ^= now;
+    if (random_state == 0)
+        random_state = 1;
+
+#ifdef SILICA_LATENCY_STATS
+    latency[LATENCY_FRAME] = now - latency[LATENCY_FRAME];
+#endif
 }
 
-// determine bit shift from sync pattern
-// return -1 if not a valid sync pattern
-int get_shift_from_sync(uint8_t sync1, uint8_t sync2)
+// generate a pseudo random number (xorshift)
+uint16_t random_number()
 {
-    uint8_t a1 = sync1 & 0xAA;
-    uint8_t b1 = sync1 & 0x55;
+    random_state ^= random_state << 7;
+    random_state ^= random_state >> 9;
+    random_state ^= random_state << 8;
+    return random_state;
+}
 
-    uint8_t a2 = sync2 & 0xAA;
-    uint8_t b2 = sync2 & 0x55;
+// wait for a randomly chosen time slot out of 0 to n
+// processing time since the end of the frame is included in the wait
+void wait_for_time_slot(int n)
+{
+    // at most 16 time slots are defined
+    if (n > 0x0F)
+        n = 0x0F;
 
-    if (a1 == 0x8A && a2 == 0x08)
-        return 0;
-    if (b1 == 0x45 && b2 == 0x04)
-        return 1;
-    if (a1 == 0x22 && a2 == 0x82)
-        return 2;
-    if (b1 == 0x11 && b2 == 0x41)
-        return 3;
-    if (a1 == 0x08 && a2 == 0xA0)
-        return 4;
-    if (b1 == 0x04 && b2 == 0x50)
-        return 5;
-    if (a1 == 0x02 && a2 == 0x28)
-        return 6;
-    if (b1 == 0x01 && b2 == 0x14)
-        return 7;
+    uint16_t latency = TRANSMIT_LATENCY;
+#ifdef SILICA_424K
+    // flush bytes take half the time at 424kbps
+    if (fast_rate)
+        latency /= 2;
+#endif
 
-    return -1;
+    int slot = random_number() % (n + 1);
+    uint16_t start = POLLING_DELAY + slot * TIME_SLOT - latency;
+
+    while (TCB0.CNT < start)
+    {
+        // do nothing
+    }
+}
+
+#ifdef SILICA_424K
+// calculate EDC of a packet
+static uint16_t calculate_edc(const uint8_t *packet, int len)
+{
+    uint16_t edc = 0;
+    for (int i = 0; i < len; i++)
+        edc = crc16_update(edc, packet[i]);
+    return edc;
 }
+#endif
 
-// find sync pattern in received data
-// return index of first sync byte
-int find_sync_index(int rx_len, int &shift, bool &invert)
+// compare the calculated EDC with the one following the packet
+// return true if it matches, possibly after correcting a bit error
+static bool verify_edc(uint8_t *packet, int len, uint16_t calculated_edc)
 {
-    for (int i = 0; i < rx_len - 1; i++)
+    uint16_t received_edc = (packet[len] << 8) | packet[len + 1];
+    uint16_t syndrome = calculated_edc ^ received_edc;
+
+    // allow last 1-bit error
+    if (syndrome <= 1)
+        return true;
+
+#ifdef SILICA_EDC_CORRECTION
+    // correct a 1-bit error anywhere after the length byte
+    if (correct_bit_error(packet, len, syndrome))
     {
-        int shift1 = get_shift_from_sync(rx_buf[i], rx_buf[i + 1]);
-        int shift2 = get_shift_from_sync(~rx_buf[i], ~rx_buf[i + 1]);
-        if (shift1 != -1 && shift1 > shift2)
-        {
-            shift = shift1;
-            invert = false;
-            return i;
-        }
-        if (shift2 != -1 && shift2 > shift1)
-        {
-            shift = shift2;
-            invert = true;
-            return i;
-        }
+        corrected_frames++;
+        LOG_INFO("EDC corrected");
+        return true;
     }
-    return -1;
-}
+#endif
 
-// extract one byte from 3 bytes of received data
-// according to the specified bit shift
-uint8_t extract_byte(int shift, uint8_t data1, uint8_t data2, uint8_t data3)
-{
-    uint8_t x = 0;
-
-    if (shift == 0)
-    {
-        if (data1 & 0x80)
-            x |= 0x80;
-        if (data1 & 0x20)
-            x |= 0x40;
-        if (data1 & 0x08)
-            x |= 0x20;
-        if (data1 & 0x02)
-            x |= 0x10;
-        if (data2 & 0x80)
-            x |= 0x08;
-        if (data2 & 0x20)
-            x |= 0x04;
-        if (data2 & 0x08)
-            x |= 0x02;
-        if (data2 & 0x02)
-            x |= 0x01;
-    }
-    if (shift == 1)
-    {
-        if (data1 & 0x40)
-            x |= 0x80;
-        if (data1 & 0x10)
-            x |= 0x40;
-        if (data1 & 0x04)
-            x |= 0x20;
-        if (data1 & 0x01)
-            x |= 0x10;
-        if (data2 & 0x40)
-            x |= 0x08;
-        if (data2 & 0x10)
-            x |= 0x04;
-        if (data2 & 0x04)
-            x |= 0x02;
-        if (data2 & 0x01)
-            x |= 0x01;
-    }
-    if (shift == 2)
-    {
-        if (data1 & 0x20)
-            x |= 0x80;
-        if (data1 & 0x08)
-            x |= 0x40;
-        if (data1 & 0x02)
-            x |= 0x20;
-        if (data2 & 0x80)
-            x |= 0x10;
-        if (data2 & 0x20)
-            x |= 0x08;
-        if (data2 & 0x08)
-            x |= 0x04;
-        if (data2 & 0x02)
-            x |= 0x02;
-        if (data3 & 0x80)
-            x |= 0x01;
-    }
-    if (shift == 3)
-    {
-        if (data1 & 0x10)
-            x |= 0x80;
-        if (data1 & 0x04)
-            x |= 0x40;
-        if (data1 & 0x01)
-            x |= 0x20;
-        if (data2 & 0x40)
-            x |= 0x10;
-        if (data2 & 0x10)
-            x |= 0x08;
-        if (data2 & 0x04)
-            x |= 0x04;
-        if (data2 & 0x01)
-            x |= 0x02;
-        if (data3 & 0x40)
-            x |= 0x01;
-    }
-    if (shift == 4)
-    {
-        if (data1 & 0x08)
-            x |= 0x80;
-        if (data1 & 0x02)
-            x |= 0x40;
-        if (data2 & 0x80)
-            x |= 0x20;
-        if (data2 & 0x20)
-            x |= 0x10;
-        if (data2 & 0x08)
-            x |= 0x08;
-        if (data2 & 0x02)
-            x |= 0x04;
-        if (data3 & 0x80)
-            x |= 0x02;
-        if (data3 & 0x20)
-            x |= 0x01;
-    }
-    if (shift == 5)
-    {
-        if (data1 & 0x04)
-            x |= 0x80;
-        if (data1 & 0x01)
-            x |= 0x40;
-        if (data2 & 0x40)
-            x |= 0x20;
-        if (data2 & 0x10)
-            x |= 0x10;
-        if (data2 & 0x04)
-            x |= 0x08;
-        if (data2 & 0x01)
-            x |= 0x04;
-        if (data3 & 0x40)
-            x |= 0x02;
-        if (data3 & 0x10)
-            x |= 0x01;
-    }
-    if (shift == 6)
-    {
-        if (data1 & 0x02)
-            x |= 0x80;
-        if (data2 & 0x80)
-            x |= 0x40;
-        if (data2 & 0x20)
-            x |= 0x20;
-        if (data2 & 0x08)
-            x |= 0x10;
-        if (data2 & 0x02)
-            x |= 0x08;
-        if (data3 & 0x80)
-            x |= 0x04;
-        if (data3 & 0x20)
-            x |= 0x02;
-        if (data3 & 0x08)
-            x |= 0x01;
-    }
-    if (shift == 7)
-    {
-        if (data1 & 0x01)
-            x |= 0x80;
-        if (data2 & 0x40)
-            x |= 0x40;
-        if (data2 & 0x10)
-            x |= 0x20;
-        if (data2 & 0x04)
-            x |= 0x10;
-        if (data2 & 0x01)
-            x |= 0x08;
-        if (data3 & 0x40)
-            x |= 0x04;
-        if (data3 & 0x10)
-            x |= 0x02;
-        if (data3 & 0x04)
-            x |= 0x01;
-    }
-
-    return x;
+    return false;
 }
 
 // receive command packet from the reader
 // return null if error
-packet_t receive_command()
+uint8_t *receive_command()
 {
-    // capture frame
-    int rx_len = capture_frame();
-    if (rx_len == 0)
-    {
-        Serial_println("Frame capture error");
-        return nullptr;
-    }
+    // the receive buffer overflows while no frame is read,
+    // only an overflow during the frame is an error
+    SPI0.INTFLAGS = SPI_BUFOVF_bm;
 
-    // find sync pattern
+    // capture frame up to the sync pattern
     int shift = -1;
     bool invert;
-    int rx_index = find_sync_index(rx_len, shift, invert);
-    if (rx_index == -1)
+    int result = capture_sync(shift, invert);
+#ifdef SILICA_UART_COMMANDS
+    if (result == -2)
+        return nullptr;
+#endif
+    if (result != 1 && (SPI0.INTFLAGS & SPI_BUFOVF_bm))
     {
-        Serial_println("Sync error");
+        LOG_ERROR("SPI overflow");
+        LINK_COUNT(LINK_OVERFLOWS, 1);
         return nullptr;
     }
-
-    // skip sync pattern
-    rx_index += 4;
-
-    // decode data
-    int index = 0;
-    for (int i = rx_index; i < rx_len - 2; i += 2)
+    if (result == 0)
     {
-        uint8_t x = extract_byte(shift, rx_buf[i], rx_buf[i + 1], rx_buf[i + 2]);
+        LOG_ERROR("Frame capture error");
+        LINK_COUNT(LINK_SYNC_ERRORS, 1);
+        return nullptr;
+    }
+    if (result == -1)
+    {
+        LOG_ERROR("Sync error");
+        LINK_COUNT(LINK_SYNC_ERRORS, 1);
+        return nullptr;
+    }
 
-        if (invert)
-            x = ~x;
+    // decode data and calculate EDC while receiving
+    uint16_t calculated_edc = 0;
+    int index;
+#ifdef SILICA_424K
+    if (fast_rate)
+        index = receive_raw_packet(shift, invert, command);
+    else
+#endif
+        index = receive_packet(shift, invert, command, calculated_edc);
+    mark_end_of_frame();
+    serial_discard();
 
-        command[index++] = x;
+    // bytes were lost, the CPU fell behind the SPI
+    if (SPI0.INTFLAGS & SPI_BUFOVF_bm)
+    {
+        LOG_ERROR("SPI overflow");
+        LINK_COUNT(LINK_OVERFLOWS, 1);
+        return nullptr;
     }
 
+#ifdef SILICA_RESYNC
+    LINK_COUNT(LINK_SLIPS, frame_slips);
+    LINK_COUNT(LINK_RELOCKS, frame_relocks);
+    if (frame_relocks != 0)
+        LOG_INFO("Resync");
+#endif
+
     // verify length
     int len = command[0];
-    if (len + 2 > index)
+    if (index == 0 || len + 2 > index)
     {
-        Serial_println("Length error");
+        LOG_ERROR("Length error");
+        LINK_COUNT(LINK_LENGTH_ERRORS, 1);
         return nullptr;
     }
 
+#ifdef SILICA_424K
+    // there is no time to calculate the EDC while receiving at 424kbps
+    if (fast_rate)
+        calculated_edc = calculate_edc(command, len);
+#endif
+
     // verify EDC (Error Detection Code)
-    uint16_t calculated_edc = crc16(command, len);
-    uint16_t received_edc = (command[len] << 8) | command[len + 1];
+    bool valid = verify_edc(command, len, calculated_edc);
 
-    if ((calculated_edc ^ received_edc) <= 1)
-    {
-        // allow last 1-bit error
-    }
-    else
+    if (!valid)
     {
-        Serial_println("EDC error");
+        LOG_ERROR("EDC error");
+        LINK_COUNT(LINK_EDC_ERRORS, 1);
         return nullptr;
     }
 
+    LATENCY_MARK(LATENCY_EDC);
+    LINK_COUNT(LINK_FRAMES, 1);
+
     return command;
 }
 
+#ifdef SILICA_424K
+// switch the modulation between 212kbps and 424kbps
+// the CCL must be disabled
+//
+// A Manchester half-bit at 424kbps lasts 4 cycles, but the SPI slave
+// needs SCK high and low for more than 2 cycles each, so SCK can't run at
+// fclk/4. Instead SCK stays at fclk/8, the SPI sends the plain bits of the
+// response and LUT0 XORs them with SCK from WO0. MISO changes at the
+// falling edge of SCK, so a bit is sent as is while SCK is low and
+// inverted while it is high: 1 becomes 10 and 0 becomes 01. SCK is high
+// for 4 of 8 cycles so that both halves are equally long.
+// The filter of LUT1 is clocked by WO2 once per SCK period, too slow for
+// two half-bits, so at 424kbps it runs from the CPU clock.
+static void set_transmit_rate(bool fast)
+{
+    TCA0.SINGLE.CTRLA = 0;
+    TCA0.SINGLE.CNT = 0;
+    TCA0.SINGLE.CMP0 = fast ? 4 : 3;
+    TCA0.SINGLE.CTRLA = TCA_SINGLE_ENABLE_bm;
+
+    CCL.LUT0CTRLA = 0;
+    CCL.LUT0CTRLB = CCL_INSEL1_MASK_gc | (fast ? CCL_INSEL0_TCA0_gc : CCL_INSEL0_MASK_gc);
+    CCL.TRUTH0 = fast ? 0x5A : 0xF0;
+    CCL.LUT0CTRLA = CCL_ENABLE_bm;
+    CCL.LUT1CTRLA = 0;
+    if (fast)
+        CCL.LUT1CTRLA = CCL_FILTSEL_FILTER_gc | CCL_OUTEN_bm | CCL_ENABLE_bm;
+    else
+        CCL.LUT1CTRLA = CCL_CLKSRC_bm | CCL_FILTSEL0_bm | CCL_OUTEN_bm | CCL_ENABLE_bm;
+}
+#endif
+
 // enable or disable transmission
 void enable_transmit(bool enable)
 {
+#ifdef SILICA_424K
+    // at 424kbps the flush below would be modulated as well, so stop right
+    // after the last byte has been shifted out
+    if (!enable && fast_rate)
+    {
+        while (!(SPI0.INTFLAGS & SPI_TXCIF_bm))
+        {
+            // do nothing
+        }
+        CCL.CTRLA = 0;
+    }
+#endif
+
     // flash buffer
     SPI_transfer(0x00);
     SPI_transfer(0x00);
@@ -394,47 +1524,405 @@ void enable_transmit(bool enable)
         CCL.CTRLA = 0;
 }
 
+// Manchester encoding of one nibble
+static const uint8_t manchester_table[16] = {0x55, 0x56, 0x59, 0x5A, 0x65, 0x66, 0x69, 0x6A, 0x95, 0x96, 0x99, 0x9A, 0xA5, 0xA6, 0xA9, 0xAA};
+
+// data link layer header with manchester encoding applied
+struct encoded_header_t
+{
+    uint8_t data[2 * sizeof(header)];
+};
+
+static constexpr encoded_header_t make_encoded_header()
+{
+    encoded_header_t encoded = {};
+    for (int i = 0; i < (int)sizeof(header); i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            uint8_t nibble = j == 0 ? header[i] >> 4 : header[i] & 0xF;
+            uint8_t x = 0;
+            for (int k = 3; k >= 0; k--)
+                x = (x << 2) | ((nibble >> k) & 1 ? 0x2 : 0x1);
+            encoded.data[2 * i + j] = x;
+        }
+    }
+    return encoded;
+}
+
+static constexpr encoded_header_t encoded_header = make_encoded_header();
+
+// write one byte to the SPI transmit buffer as soon as it has room
+// unlike SPI_transfer(), received data is left in the buffer
+static inline void SPI_write(uint8_t data)
+{
+    while (!(SPI0.INTFLAGS & SPI_DREIF_bm))
+    {
+        // do nothing
+    }
+    SPI0.DATA = data;
+}
+
 // transmit one byte with manchester encoding
-void transmit_byte(uint8_t data)
+// at 424kbps the CCL encodes the plain byte, see set_transmit_rate()
+static inline void transmit_byte(uint8_t data)
 {
-    static const uint8_t table[16] = {0x55, 0x56, 0x59, 0x5A, 0x65, 0x66, 0x69, 0x6A, 0x95, 0x96, 0x99, 0x9A, 0xA5, 0xA6, 0xA9, 0xAA};
+#ifdef SILICA_424K
+    if (fast_rate)
+    {
+        SPI_write(data);
+        return;
+    }
+#endif
 
-    SPI_transfer(table[data >> 4]);
-    SPI_transfer(table[data & 0xF]);
+    uint8_t lo = manchester_table[data & 0xF];
+    SPI_write(manchester_table[data >> 4]);
+    SPI_write(lo);
 }
 
+#ifdef SILICA_424K
+// calculate EDC of a response
+static uint16_t calculate_response_edc(const response_t *response, int packet_len)
+{
+    uint16_t edc = calculate_edc(response->packet, packet_len);
+    for (int block = 0; block < response->block_count; block++)
+    {
+        const uint8_t *src = response->blocks[block];
+        for (int i = 0; i < 16; i++)
+            edc = crc16_update(edc, src[i]);
+    }
+    return edc;
+}
+#endif
+
 // send response packet to the reader
 // null response means no response
-void send_response(packet_t response)
+//
+// The SPI transmit buffer holds one byte besides the shift register,
+// so there are 64 cycles per written byte at SCK = fclk/8.
+// Every byte is encoded and added to the EDC while the previous one
+// is shifted out, which keeps the buffer full for the whole frame.
+// At 424kbps every byte is written as it is, so there are 64 cycles per
+// byte, and the EDC is calculated beforehand.
+// A byte written late leaves a gap in the modulation, which sets TXCIF
+// and is logged as a transmit underrun.
+void send_response(const response_t *response)
 {
     if (response == nullptr)
         return;
 
-    int len = response[0];
+    packet_t packet = response->packet;
+    int len = packet[0];
+    int packet_len = len - 16 * response->block_count;
+
+    uint16_t edc = 0;
+    bool edc_ready = false;
+#ifdef SILICA_424K
+    if (fast_rate)
+    {
+        edc = calculate_response_edc(response, packet_len);
+        edc_ready = true;
+    }
+#endif
+
+    // keep interrupts from delaying the SPI stream
+    uint8_t sreg = SREG;
+    cli();
 
-    // calculate EDC (Error Detection Code) in advance
-    uint16_t edc = crc16(response, len);
+    const uint8_t *header_data = encoded_header.data;
+    int header_len = sizeof(encoded_header.data);
+#ifdef SILICA_424K
+    if (fast_rate)
+    {
+        set_transmit_rate(true);
+        header_data = header;
+        header_len = sizeof(header);
+    }
+#endif
 
     enable_transmit(true);
 
-    // send header
-    for (int i = 0; i < sizeof(header); i++)
-        transmit_byte(header[i]);
+    // send pre-encoded header
+    SPI_write(header_data[0]);
+    LATENCY_MARK(LATENCY_TRANSMIT);
+
+    // any gap in the SPI stream from here on sets the transfer complete flag
+    SPI0.INTFLAGS = SPI_TXCIF_bm;
+
+    for (int i = 1; i < header_len; i++)
+        SPI_write(header_data[i]);
 
     // send body
-    for (int i = 0; i < len; i++)
-        transmit_byte(response[i]);
+    // calculate EDC (Error Detection Code) while the SPI buffer drains
+    for (int i = 0; i < packet_len; i++)
+    {
+        uint8_t data = packet[i];
+        transmit_byte(data);
+        if (!edc_ready)
+            edc = crc16_update(edc, data);
+    }
+
+    // send block data straight from where it is stored
+    for (int block = 0; block < response->block_count; block++)
+    {
+        const uint8_t *src = response->blocks[block];
+        for (int i = 0; i < 16; i++)
+        {
+            uint8_t data = src[i];
+            transmit_byte(data);
+            if (!edc_ready)
+                edc = crc16_update(edc, data);
+        }
+    }
 
     // send footer (EDC)
     transmit_byte(edc >> 8);
     transmit_byte(edc & 0xFF);
 
+    bool underrun = SPI0.INTFLAGS & SPI_TXCIF_bm;
+
     enable_transmit(false);
+
+#ifdef SILICA_424K
+    if (fast_rate)
+        set_transmit_rate(false);
+#endif
+
+    SREG = sreg;
+
+    if (underrun)
+        LOG_ERROR("Transmit underrun");
+}
+
+#ifdef SILICA_LATENCY_STATS
+// add the latency of the last command to the statistics
+void record_latency(uint8_t command_code)
+{
+    int index = command_code >> 1;
+    if (index >= LATENCY_COMMANDS)
+        return;
+
+    for (int i = 0; i < LATENCY_STAGES; i++)
+    {
+        if (latency[i] < latency_min[index][i])
+            latency_min[index][i] = latency[i];
+        if (latency[i] > latency_max[index][i])
+            latency_max[index][i] = latency[i];
+
+        int bucket = 0;
+        for (uint16_t t = latency[i] >> LATENCY_SCALE[i]; t != 0 && bucket < LATENCY_BUCKETS - 1; t >>= 1)
+            bucket++;
+
+        if (latency_histogram[i][bucket] != 0xFFFF)
+            latency_histogram[i][bucket]++;
+    }
+}
+
+// copy one 16-byte block of latency statistics
+// blocks 0-7: min and max of each stage for command codes 0x00 to 0x0E
+// blocks 8-11: histogram of each stage
+// reading block 0 also dumps all statistics to serial
+void read_latency_stats(int index, uint8_t *dst)
+{
+    if (index == 0)
+        latency_dump_requested = true;
+
+    if (index < LATENCY_COMMANDS)
+    {
+        for (int i = 0; i < LATENCY_STAGES; i++)
+        {
+            uint16_t min = latency_min[index][i];
+            uint16_t max = latency_max[index][i];
+            dst[4 * i] = min & 0xFF;
+            dst[4 * i + 1] = min >> 8;
+            dst[4 * i + 2] = max & 0xFF;
+            dst[4 * i + 3] = max >> 8;
+        }
+        return;
+    }
+
+    const uint16_t *src = latency_histogram[index - LATENCY_COMMANDS];
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        dst[2 * i] = src[i] & 0xFF;
+        dst[2 * i + 1] = src[i] >> 8;
+    }
+}
+
+// Debug: print latency statistics to serial
+// one line per command code with min-max of each stage, then one line
+// per stage with its histogram
+void print_latency_stats()
+{
+    for (int index = 0; index < LATENCY_COMMANDS; index++)
+    {
+        char str[4 + 10 * LATENCY_STAGES + 1];
+        char *p = format_hex(str, index << 1);
+        *p++ = ':';
+
+        for (int i = 0; i < LATENCY_STAGES; i++)
+        {
+            *p++ = ' ';
+            p = format_hex(p, latency_min[index][i] >> 8);
+            p = format_hex(p, latency_min[index][i] & 0xFF);
+            *p++ = '-';
+            p = format_hex(p, latency_max[index][i] >> 8);
+            p = format_hex(p, latency_max[index][i] & 0xFF);
+        }
+        *p = '\0';
+
+        // the whole dump does not fit in the buffer at once
+        Serial_flush();
+        Serial_println(str);
+    }
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        char str[3 + 5 * LATENCY_BUCKETS + 1] = "S0:";
+        char *p = str + 3;
+        str[1] += stage;
+
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            *p++ = ' ';
+            p = format_hex(p, latency_histogram[stage][i] >> 8);
+            p = format_hex(p, latency_histogram[stage][i] & 0xFF);
+        }
+        *p = '\0';
+
+        Serial_flush();
+        Serial_println(str);
+    }
+
+    // fewest polls before a byte arrived while decoding, 0 means none left
+    char str[] = "SPI headroom XX";
+    format_hex(str + 13, spi_min_polls);
+    Serial_flush();
+    Serial_println(str);
+}
+#endif
+
+#ifdef SILICA_UART_COMMANDS
+// append one byte of a frame to the serial buffer
+// unlike log messages, frames wait for room instead of being dropped
+static void serial_send(uint8_t data)
+{
+    while (((serial_tail - serial_head - 1) & (SERIAL_BUFFER_SIZE - 1)) == 0)
+    {
+        serial_start();
+    }
+    serial_put(data);
+}
+
+// send part of the payload of a frame and update its CRC
+static void serial_send_payload(const uint8_t *data, int len, uint16_t &crc)
+{
+    for (int i = 0; i < len; i++)
+    {
+        serial_send(data[i]);
+        crc = crc16_update(crc, data[i]);
+    }
+}
+
+// send the start of a frame, return the CRC so far
+static uint16_t serial_begin_frame(uint8_t type, uint8_t len)
+{
+    serial_send(SERIAL_FRAME_START);
+
+    uint8_t header[2] = {type, len};
+    uint16_t crc = 0;
+    serial_send_payload(header, 2, crc);
+    return crc;
+}
+
+static void serial_end_frame(uint16_t crc)
+{
+    serial_send(crc >> 8);
+    serial_send(crc & 0xFF);
+    serial_start();
+}
+
+static void serial_send_empty_frame(uint8_t type)
+{
+    serial_end_frame(serial_begin_frame(type, 0));
+}
+
+// send a response packet with its blocks
+static void serial_send_response(const response_t *response)
+{
+    int len = response->packet[0];
+    uint16_t crc = serial_begin_frame(SERIAL_RESPONSE, len);
+
+    serial_send_payload(response->packet, len - 16 * response->block_count, crc);
+    for (int i = 0; i < response->block_count; i++)
+        serial_send_payload(response->blocks[i], 16, crc);
+
+    serial_end_frame(crc);
+}
+
+static void serial_send_stats()
+{
+    uint16_t counters[LINK_STATS + 2];
+    memcpy(counters, link_stats, sizeof(link_stats));
+#ifdef SILICA_EDC_CORRECTION
+    counters[LINK_STATS] = corrected_frames;
+#else
+    counters[LINK_STATS] = 0;
+#endif
+    counters[LINK_STATS + 1] = serial_dropped;
+
+    // little endian, like the AVR
+    uint16_t crc = serial_begin_frame(SERIAL_STATS, sizeof(counters));
+    serial_send_payload((const uint8_t *)counters, sizeof(counters), crc);
+    serial_end_frame(crc);
+}
+
+// answer the frame received over serial
+// commands are processed like those received over RF
+static void process_serial_frame()
+{
+    uint8_t type = serial_frame_type;
+    int len = serial_frame_length;
+
+    uint16_t crc = crc16_update(crc16_update(0, type), len);
+    for (int i = 0; i < len; i++)
+        crc = crc16_update(crc, command[i]);
+    bool valid = crc == (((uint16_t)command[len] << 8) | command[len + 1]);
+
+    if (valid && type == SERIAL_COMMAND && len > 0 && command[0] == len)
+    {
+        const response_t *response = process(command);
+        if (response == nullptr)
+        {
+            serial_send_empty_frame(SERIAL_UNSUPPORTED);
+        }
+        else
+        {
+            serial_send_response(response);
+            storage_commit();
+        }
+    }
+    else if (valid && type == SERIAL_STATS && len == 0)
+    {
+        serial_send_stats();
+    }
+    else
+    {
+        LINK_COUNT(LINK_SERIAL_ERRORS, 1);
+        serial_send_empty_frame(SERIAL_ERROR);
+    }
+
+    // the host sends the next frame once it has the answer
+    serial_frame_ready = false;
 }
+#endif
 
 // system initialization
 void setup()
 {
+    // the program runs in the boot section, see BOOTEND in fuses.c
+    _PROTECTED_WRITE(CPUINT.CTRLA, CPUINT_IVSEL_bm);
+
     // configure system clock: set fclk to fc/4 (3.39MHz) using an external clock source
     _PROTECTED_WRITE(CLKCTRL.MCLKCTRLA, CLKCTRL_CLKSEL_EXTCLK_gc);
     _PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, CLKCTRL_PDIV_4X_gc | CLKCTRL_ENABLE_bm);
@@ -464,6 +1952,12 @@ void setup()
     TCA0.SINGLE.CMP2 = 5; // adjust phase shift
     TCA0.SINGLE.CTRLA = TCA_SINGLE_ENABLE_bm;
 
+    // run TCB0 at fclk/2 to time responses from the end of each frame
+    // the 16-bit counter covers up to 38.6ms, enough for 16 time slots
+    TCB0.CTRLB = TCB_CNTMODE_INT_gc;
+    TCB0.CCMP = 0xFFFF;
+    TCB0.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+
     // adjust CCL (Configurable Custom Logic) for modulation
     PORTMUX.CTRLA |= PORTMUX_LUT1_ALTERNATE_gc;
 
@@ -484,20 +1978,38 @@ void setup()
     CCL.TRUTH1 = 0xAA;
     CCL.LUT1CTRLA = CCL_CLKSRC_bm | CCL_FILTSEL0_bm | CCL_OUTEN_bm | CCL_ENABLE_bm;
 
+#if SILICA_LOG_LEVEL > 0
     // set up USART for serial output
     PORTMUX.CTRLB |= PORTMUX_USART0_ALTERNATE_gc;
     PORTA.OUTSET = PIN1_bm;
     PORTA.DIRSET = PIN1_bm;
+#ifdef SILICA_UART_COMMANDS
+    // receive commands on PA2, pulled up while nothing is connected
+    PORTA.PIN2CTRL = PORT_PULLUPEN_bm;
+    USART0.BAUD = 59; // 230400bps
+    USART0.CTRLA = USART_RXCIE_bm;
+    USART0.CTRLB = USART_TXEN_bm | USART_RXEN_bm;
+#else
     USART0.BAUD = 118; // 115200bps
     USART0.CTRLB = USART_TXEN_bm;
+#endif
+#endif
+
+#ifdef SILICA_LATENCY_STATS
+    memset(latency_min, 0xFF, sizeof(latency_min));
+#endif
 
-    // application layer initialization
+    // application layer initialization, which arms the VLM interrupt
     initialize();
 
+    // the VLM interrupt writes back the EEPROM cache on power loss, and
+    // serial output is sent by interrupt; both need interrupts enabled
+    // whatever the log level
+    sei();
+
     // print version info
-    Serial_println("SiliCa v1.1");
-    Serial_print("Build on: ");
-    Serial_println(__DATE__);
+    LOG_INFO("SiliCa v1.1");
+    LOG_INFO("Build on: " __DATE__);
 }
 
 // test response for debugging
@@ -505,9 +2017,10 @@ void setup()
 void test_response()
 {
     static const uint8_t polling[20] = {20, 0x01, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xAB, 0xCD};
+    static const response_t response = {polling, 0, {}};
     while (true)
     {
-        send_response(polling);
+        send_response(&response);
         _delay_us(1000);
     }
 }
@@ -516,28 +2029,62 @@ void test_response()
 // process commands continuously
 void loop()
 {
-    packet_t command = receive_command();
+#ifdef SILICA_UART_COMMANDS
+    if (serial_frame_ready)
+    {
+        process_serial_frame();
+        return;
+    }
+#endif
+
+    uint8_t *command = receive_command();
+    serial_resume();
     if (command == nullptr)
         return;
 
-    packet_t response = process(command);
+    // the response overwrites the command
+    uint8_t command_code = command[1];
+    uint8_t time_slots = command[5];
+
+    const response_t *response = process(command);
+    LATENCY_MARK(LATENCY_PROCESS);
+
     if (response == nullptr)
     {
-        Serial_println("Unsupported command");
+        LOG_ERROR("Unsupported command");
         save_error(command);
-        print_packet(command);
+        LOG_PACKET(command);
         return;
     }
 
-    // delay for Polling command
-    // 1000us + 1500us = 2.5ms
-    if (command[1] == 0x00)
-        _delay_us(1500);
+    // respond in a time slot for Polling command
+    if (command_code == 0x00)
+        wait_for_time_slot(time_slots);
 
     send_response(response);
+
+    // write back cached data once the reader has the response and is
+    // turning around for the next command, never while a frame may be
+    // arriving: at most one page per response, so the card is busy for
+    // at most one page and a command cut short is retried by the reader
+    // the flash page halts the CPU for its erase/write, the EEPROM is
+    // written in background, the rest is flushed when the supply drops
+    storage_commit();
+
+#ifdef SILICA_LATENCY_STATS
+    record_latency(command_code);
+
+    if (latency_dump_requested)
+    {
+        latency_dump_requested = false;
+        print_latency_stats();
+    }
+#endif
 }
 
 // Arduino-style main function
+// host tests call setup() and loop() themselves, see test/README
+#ifndef PIO_UNIT_TESTING
 int main()
 {
     setup();
@@ -547,3 +2094,4 @@ int main()
         loop();
     }
 }
+#endif
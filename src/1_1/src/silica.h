@@ -5,16 +5,93 @@
 // The first element indicates the total length of the packet.
 typedef const uint8_t *packet_t;
 
+// maximum length of a packet, limited by the length byte
+static constexpr int PACKET_MAX = 0xFF;
+
+// Application layer response.
+// The total length in packet[0] includes block_count blocks of 16 bytes
+// that follow the packet. They are sent from where the data is stored
+// instead of being copied into the packet.
+static constexpr int RESPONSE_BLOCK_MAX = 12;
+struct response_t
+{
+    packet_t packet;
+    uint8_t block_count;
+    const uint8_t *blocks[RESPONSE_BLOCK_MAX];
+};
+
 // Functions for serial output
 // Similar to Arduino interface
+// Output is buffered and never blocks; messages are dropped when full.
 void Serial_write(uint8_t);
 void Serial_print(const char *);
 void Serial_println(const char *);
+void Serial_println_hex(const uint8_t *, int);
+void Serial_flush();
+
+// compile-time log level, override with -D SILICA_LOG_LEVEL=n
+// 0: none, 1: errors, 2: errors and info, 3: all including packet dumps
+#ifndef SILICA_LOG_LEVEL
+#define SILICA_LOG_LEVEL 3
+#endif
+
+#define LOG_ERROR(str)             \
+    do                             \
+    {                              \
+        if (SILICA_LOG_LEVEL >= 1) \
+            Serial_println(str);   \
+    } while (0)
+
+#define LOG_INFO(str)              \
+    do                             \
+    {                              \
+        if (SILICA_LOG_LEVEL >= 2) \
+            Serial_println(str);   \
+    } while (0)
+
+#define LOG_PACKET(packet)         \
+    do                             \
+    {                              \
+        if (SILICA_LOG_LEVEL >= 3) \
+            print_packet(packet);  \
+    } while (0)
 
 // application layer functions
 void initialize();
-packet_t process(packet_t);
+const response_t *process(uint8_t *);
 void save_error(packet_t);
 
+// storage functions
+// EEPROM access through a RAM write-back cache
+// and block data area at the end of flash
+static constexpr int FLASH_DATA_SIZE = 256;
+void storage_initialize();
+const uint8_t *storage_data(const void *);
+void storage_read(void *, const void *, int);
+void storage_write(const void *, void *, int);
+void storage_write_deferred(const void *, void *, int);
+const uint8_t *storage_flash_data(uint16_t);
+void storage_read_flash(void *, uint16_t, int);
+void storage_write_flash(const void *, uint16_t, int);
+bool storage_commit();
+void storage_flush();
+uint32_t storage_read_counter();
+void storage_write_counter(uint32_t);
+
 // debug functions
 void print_packet(packet_t);
+
+#ifdef SILICA_MAC_A
+// MAC_A of FeliCa Lite-S
+// data is in 8-byte units in card byte order
+void mac_start_session(const uint8_t *, const uint8_t *);
+void mac_begin(bool);
+void mac_update(const uint8_t *);
+void mac_end(uint8_t *);
+#endif
+
+#ifdef SILICA_LATENCY_STATS
+// latency statistics, 12 blocks of 16 bytes
+static constexpr int LATENCY_STATS_BLOCKS = 12;
+void read_latency_stats(int, uint8_t *);
+#endif
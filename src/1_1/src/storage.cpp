@@ -0,0 +1,557 @@
+// Write-back cache of the EEPROM for
+// JIS X 6319-4 compatible card "SiliCa"
+//
+// The whole EEPROM is mirrored in RAM. Reads are served from RAM and
+// writes only update RAM and mark the EEPROM page dirty, so commands are
+// acknowledged without waiting for EEPROM erase/write. Dirty pages are
+// written back one at a time after responses, and all at once when the
+// supply voltage starts to drop. Deferred writes, such as the error log,
+// are only written back when the supply drops, so they cost at most one
+// EEPROM write per power cycle however often they change.
+//
+// Block data that does not fit in the EEPROM, and IDm, PMm and the code
+// tables, which are written once when the card is issued, are kept in
+// the last FLASH_DATA_SIZE bytes of flash. The BOOTEND fuse ends the boot section,
+// which holds the program, right before this area so that the program
+// can write to it. Reads are served from memory-mapped flash.
+// Writes are collected in a RAM copy of one flash page, so a command
+// writing several blocks of a page costs a single erase/write.
+// Note that flash is erased on every firmware upload, unlike the EEPROM.
+//
+// Small changes go to a journal instead of their home bytes. One EEPROM
+// page holds 8 records of 4 bytes: the EEPROM offset of a byte, its
+// value, a sequence number and a CRC-8 of the three, which an erased or
+// torn record fails. A page with at most JOURNAL_BYTES_MAX changed bytes
+// is written as records to the next slots in turn, so a counter rewritten
+// on every tap spreads its wear over the 8 slots instead of one cell.
+// Larger changes are written in place. When a slot is reused, its record
+// is copied to the home byte first unless a newer record supersedes it.
+// At power-up the records are applied to the RAM copy, oldest first.
+// test/test_endurance projects the lifetime for a write mix.
+//
+// A counter that must never go back, the write count of FeliCa Lite-S,
+// is kept in a journal in the user row. Each value is written with a
+// CRC to the next of 8 records in turn, so a cell is written once every
+// 8 values, and a write cut short by power loss leaves the previous
+// record intact. The counter only grows, so the valid record with the
+// highest value is the current one.
+
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "silica.h"
+
+static constexpr int PAGE_COUNT = EEPROM_SIZE / EEPROM_PAGE_SIZE;
+static_assert(PAGE_COUNT <= 8, "dirty pages must fit in one byte");
+static_assert(EEPROM_SIZE <= 256 && EEPROM_PAGE_SIZE <= 32, "journal offsets and masks are too small");
+
+// RAM copy of the EEPROM, indexed by EEMEM address
+static uint8_t shadow[EEPROM_SIZE];
+
+// bit i is set if page i of the shadow differs from the EEPROM
+static volatile uint8_t dirty_pages = 0;
+
+// bit i is set if page i has deferred changes
+static volatile uint8_t deferred_pages = 0;
+
+// block data area in flash
+static constexpr uint16_t FLASH_DATA_START = PROGMEM_SIZE - FLASH_DATA_SIZE;
+static_assert(FLASH_DATA_START % PROGMEM_PAGE_SIZE == 0, "flash data must be page aligned");
+
+// RAM copy of the flash page being modified
+static uint8_t flash_page[PROGMEM_PAGE_SIZE];
+
+// index of the page in flash_page, -1 if none
+static int8_t flash_page_index = -1;
+
+// counter records in the user row: 3 bytes of value, little endian,
+// and a CRC-8 of them, which an erased record fails
+static constexpr int COUNTER_RECORD_SIZE = 4;
+static constexpr int COUNTER_RECORDS = USER_SIGNATURES_SIZE / COUNTER_RECORD_SIZE;
+
+// index of the current counter record, -1 if none
+static int8_t counter_record = -1;
+
+// journal records in EEPROM: offset, value, sequence number and CRC-8
+// the journal must have a page of its own, see write_journal()
+static constexpr int JOURNAL_RECORD_SIZE = 4;
+static constexpr int JOURNAL_RECORDS = EEPROM_PAGE_SIZE / JOURNAL_RECORD_SIZE;
+static_assert(JOURNAL_RECORD_SIZE == COUNTER_RECORD_SIZE, "records share the CRC");
+static uint8_t EEMEM journal_eep[EEPROM_PAGE_SIZE] __attribute__((aligned(EEPROM_PAGE_SIZE)));
+
+// a page with at most this many changed bytes is journaled
+static constexpr int JOURNAL_BYTES_MAX = 2;
+
+// slot of the newest journal record, -1 if none, and its sequence number
+static int8_t journal_head = -1;
+static uint8_t journal_seq = 0;
+
+// offset of an EEMEM variable from the start of the EEPROM
+// in host tests, EEMEM variables live in host memory, see test/mock
+static inline uint16_t eeprom_offset(const void *eep)
+{
+#ifdef PIO_UNIT_TESTING
+    return mock_eeprom_address(eep);
+#else
+    return (uintptr_t)eep;
+#endif
+}
+
+// CRC-8 of the first 3 bytes of a counter or journal record
+static uint8_t counter_crc(const volatile uint8_t *record)
+{
+    uint8_t crc = 0;
+    for (int i = 0; i < COUNTER_RECORD_SIZE - 1; i++)
+        crc = _crc8_ccitt_update(crc, record[i]);
+    return crc;
+}
+
+// address of a journal record in EEPROM
+static inline volatile uint8_t *journal_data(int slot)
+{
+    return (volatile uint8_t *)(EEPROM_START + eeprom_offset(journal_eep) + slot * JOURNAL_RECORD_SIZE);
+}
+
+// return true if the journal record in a slot is valid
+static bool journal_valid(int slot)
+{
+    const volatile uint8_t *record = journal_data(slot);
+    return journal_head >= 0 && counter_crc(record) == record[JOURNAL_RECORD_SIZE - 1];
+}
+
+// find the newest journal record and apply all records to the shadow,
+// oldest first, so that it holds what was last written
+static void read_journal()
+{
+    journal_head = -1;
+    for (int slot = 0; slot < JOURNAL_RECORDS; slot++)
+    {
+        const volatile uint8_t *record = journal_data(slot);
+        if (counter_crc(record) != record[JOURNAL_RECORD_SIZE - 1])
+            continue;
+
+        // valid records are at most JOURNAL_RECORDS apart in sequence
+        if (journal_head < 0 || (int8_t)(record[2] - journal_seq) > 0)
+        {
+            journal_head = slot;
+            journal_seq = record[2];
+        }
+    }
+
+    for (int i = 1; i <= JOURNAL_RECORDS; i++)
+    {
+        int slot = (journal_head + i) % JOURNAL_RECORDS;
+        if (journal_valid(slot))
+            shadow[journal_data(slot)[0]] = journal_data(slot)[1];
+    }
+}
+
+// bytes of a page as stored in EEPROM, home bytes with the journal
+// records applied, and the mask of the bytes that have a record
+static uint32_t stored_page(int page, uint8_t *data)
+{
+    const volatile uint8_t *eep = (const volatile uint8_t *)(EEPROM_START + page * EEPROM_PAGE_SIZE);
+    for (int i = 0; i < EEPROM_PAGE_SIZE; i++)
+        data[i] = eep[i];
+
+    uint32_t journaled = 0;
+    for (int i = 1; i <= JOURNAL_RECORDS; i++)
+    {
+        int slot = (journal_head + i) % JOURNAL_RECORDS;
+        const volatile uint8_t *record = journal_data(slot);
+        if (journal_valid(slot) && record[0] / EEPROM_PAGE_SIZE == page)
+        {
+            data[record[0] % EEPROM_PAGE_SIZE] = record[1];
+            journaled |= 1UL << (record[0] % EEPROM_PAGE_SIZE);
+        }
+    }
+    return journaled;
+}
+
+// return true if a newer record than the one in a slot has its offset
+static bool journal_superseded(int slot)
+{
+    uint8_t offset = journal_data(slot)[0];
+    for (int newer = slot; newer != journal_head;)
+    {
+        newer = (newer + 1) % JOURNAL_RECORDS;
+        if (journal_valid(newer) && journal_data(newer)[0] == offset)
+            return true;
+    }
+    return false;
+}
+
+// load one byte into the page buffer and start writing its page
+// only loaded bytes are erased and written, which saves wear
+// the write completes in background while the CPU keeps running
+static void write_byte(uint8_t offset, uint8_t value)
+{
+    *(volatile uint8_t *)(EEPROM_START + offset) = value;
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+}
+
+// append records of the changed bytes of a page to the journal
+// a record about to be overwritten whose value would be lost is copied
+// to its home byte first, which takes a write of its own
+// return true if a write was started
+static bool write_journal(int page, uint32_t changed)
+{
+    const uint8_t *src = shadow + page * EEPROM_PAGE_SIZE;
+
+    int count = 0;
+    for (int i = 0; i < EEPROM_PAGE_SIZE; i++)
+        count += (changed >> i) & 1;
+
+    // the slots to be overwritten are the oldest ones
+    for (int i = 1; i <= count; i++)
+    {
+        int slot = (journal_head + i) % JOURNAL_RECORDS;
+        const volatile uint8_t *record = journal_data(slot);
+        if (!journal_valid(slot) || journal_superseded(slot))
+            continue;
+
+        // the records being appended supersede it as well
+        if (record[0] / EEPROM_PAGE_SIZE == page && (changed >> (record[0] % EEPROM_PAGE_SIZE) & 1))
+            continue;
+
+        if (*(const volatile uint8_t *)(EEPROM_START + record[0]) != record[1])
+        {
+            write_byte(record[0], record[1]);
+            return true;
+        }
+    }
+
+    for (int i = 0; i < EEPROM_PAGE_SIZE; i++)
+    {
+        if (!((changed >> i) & 1))
+            continue;
+
+        journal_head = (journal_head + 1) % JOURNAL_RECORDS;
+        journal_seq++;
+
+        uint8_t data[JOURNAL_RECORD_SIZE] = {(uint8_t)(page * EEPROM_PAGE_SIZE + i), src[i], journal_seq};
+        data[JOURNAL_RECORD_SIZE - 1] = counter_crc(data);
+
+        volatile uint8_t *record = journal_data(journal_head);
+        for (int j = 0; j < JOURNAL_RECORD_SIZE; j++)
+            record[j] = data[j];
+    }
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    return true;
+}
+
+// start the next write of a page: changed bytes without a record in
+// place if there are many, otherwise records to the journal
+// return true if a write was started, false if the page is stored
+static bool write_page(int page)
+{
+    volatile uint8_t *eep = (volatile uint8_t *)(EEPROM_START + page * EEPROM_PAGE_SIZE);
+    const uint8_t *src = shadow + page * EEPROM_PAGE_SIZE;
+
+    uint8_t stored[EEPROM_PAGE_SIZE];
+    uint32_t journaled = stored_page(page, stored);
+
+    uint32_t changed = 0;
+    int count = 0;
+    for (int i = 0; i < EEPROM_PAGE_SIZE; i++)
+    {
+        if (stored[i] != src[i])
+        {
+            changed |= 1UL << i;
+            count++;
+        }
+    }
+
+    if (changed == 0)
+        return false;
+
+    // bytes with a record always go to the journal, a record would
+    // shadow a value written in place
+    if (count > JOURNAL_BYTES_MAX && (changed & ~journaled) != 0)
+    {
+        for (int i = 0; i < EEPROM_PAGE_SIZE; i++)
+        {
+            if ((changed & ~journaled) >> i & 1)
+                eep[i] = src[i];
+        }
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+        return true;
+    }
+
+    return write_journal(page, changed);
+}
+
+// memory-mapped address of the block data area in flash
+static inline volatile uint8_t *flash_data()
+{
+    return (volatile uint8_t *)(MAPPED_PROGMEM_START + FLASH_DATA_START);
+}
+
+// erase and write the buffered flash page if it differs from flash
+// the CPU halts until the write completes
+static void write_flash_page()
+{
+    if (flash_page_index < 0)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        volatile uint8_t *dst = flash_data() + flash_page_index * PROGMEM_PAGE_SIZE;
+
+        bool changed = false;
+        for (int i = 0; i < PROGMEM_PAGE_SIZE; i++)
+        {
+            if (dst[i] != flash_page[i])
+                changed = true;
+        }
+
+        if (changed)
+        {
+            // the page buffer is shared with the EEPROM
+            while (NVMCTRL.STATUS & (NVMCTRL_FBUSY_bm | NVMCTRL_EEBUSY_bm))
+            {
+                // do nothing
+            }
+
+            _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc);
+            for (int i = 0; i < PROGMEM_PAGE_SIZE; i++)
+                dst[i] = flash_page[i];
+            _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+        }
+
+        flash_page_index = -1;
+    }
+}
+
+// index of the lowest dirty page
+static int first_dirty_page()
+{
+    int page = 0;
+    while (!(dirty_pages & (1 << page)))
+        page++;
+    return page;
+}
+
+void storage_initialize()
+{
+    eeprom_read_block(shadow, (const void *)0, EEPROM_SIZE);
+    read_journal();
+
+    // request an interrupt when VDD falls to 25% above the BOD level
+    BOD.VLMCTRLA = BOD_VLMLVL_25ABOVE_gc;
+    BOD.INTCTRL = BOD_VLMCFG_BELOW_gc | BOD_VLMIE_bm;
+}
+
+// RAM address of an EEMEM variable
+// valid until the variable is written
+const uint8_t *storage_data(const void *eep)
+{
+    return shadow + eeprom_offset(eep);
+}
+
+// eeprom_read_block() equivalent served from RAM
+void storage_read(void *dst, const void *eep, int len)
+{
+    memcpy(dst, storage_data(eep), len);
+}
+
+// update the shadow and return the mask of changed pages
+static uint8_t update_shadow(const void *src, void *eep, int len)
+{
+    uint16_t offset = eeprom_offset(eep);
+    if (len <= 0 || memcmp(shadow + offset, src, len) == 0)
+        return 0;
+
+    memcpy(shadow + offset, src, len);
+
+    uint8_t pages = 0;
+    for (int page = offset / EEPROM_PAGE_SIZE; page <= (offset + len - 1) / EEPROM_PAGE_SIZE; page++)
+        pages |= 1 << page;
+    return pages;
+}
+
+// eeprom_update_block() equivalent
+// the data is written back to EEPROM later by storage_commit()
+void storage_write(const void *src, void *eep, int len)
+{
+    uint8_t pages = update_shadow(src, eep, len);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        dirty_pages |= pages;
+    }
+}
+
+// eeprom_update_block() equivalent for frequently changing data
+// the data is written back to EEPROM by storage_flush() only
+void storage_write_deferred(const void *src, void *eep, int len)
+{
+    uint8_t pages = update_shadow(src, eep, len);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        deferred_pages |= pages;
+    }
+}
+
+// address of data in the block data area in flash
+// either memory-mapped flash or the buffered page
+// valid until the next write to the area
+const uint8_t *storage_flash_data(uint16_t offset)
+{
+    if (offset / PROGMEM_PAGE_SIZE == flash_page_index)
+        return flash_page + offset % PROGMEM_PAGE_SIZE;
+    else
+        return (const uint8_t *)flash_data() + offset;
+}
+
+// read from the block data area in flash
+// the range must not cross a flash page
+void storage_read_flash(void *dst, uint16_t offset, int len)
+{
+    memcpy(dst, storage_flash_data(offset), len);
+}
+
+// write to the block data area in flash
+// the range must not cross a flash page
+// the data is written to flash later by storage_commit()
+void storage_write_flash(const void *src, uint16_t offset, int len)
+{
+    int page = offset / PROGMEM_PAGE_SIZE;
+    if (page != flash_page_index)
+    {
+        // only one page is buffered, write back the previous one
+        write_flash_page();
+
+        memcpy(flash_page, (const uint8_t *)flash_data() + page * PROGMEM_PAGE_SIZE, PROGMEM_PAGE_SIZE);
+        flash_page_index = page;
+    }
+
+    memcpy(flash_page + offset % PROGMEM_PAGE_SIZE, src, len);
+}
+
+// start the next write of the first dirty page if the EEPROM is idle
+// a page takes more than one write if journal records must be moved
+// never waits for the EEPROM, call after a response, when no frame arrives
+// the buffered flash page is written once the EEPROM is clean,
+// which halts the CPU for the flash erase/write time
+// return true if pages are still pending
+bool storage_commit()
+{
+    if (dirty_pages == 0)
+    {
+        write_flash_page();
+        return false;
+    }
+
+    if (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)
+        return true;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // the page may have been flushed by the interrupt meanwhile
+        while (dirty_pages != 0)
+        {
+            int page = first_dirty_page();
+            if (write_page(page))
+                break;
+
+            // deferred changes in the same page are written as well
+            dirty_pages &= ~(1 << page);
+            deferred_pages &= ~(1 << page);
+        }
+    }
+
+    return dirty_pages != 0;
+}
+
+// write back all dirty and deferred pages, waiting for each write
+void storage_flush()
+{
+    write_flash_page();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        dirty_pages |= deferred_pages;
+        deferred_pages = 0;
+
+        while (dirty_pages != 0)
+        {
+            while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)
+            {
+                // do nothing
+            }
+
+            int page = first_dirty_page();
+            if (!write_page(page))
+                dirty_pages &= ~(1 << page);
+        }
+    }
+}
+
+// address of a counter record in the user row
+static inline volatile uint8_t *counter_data(int record)
+{
+    return (volatile uint8_t *)(USER_SIGNATURES_START + record * COUNTER_RECORD_SIZE);
+}
+
+// find the current record of the counter journal
+// return its value, 0 if there is none
+uint32_t storage_read_counter()
+{
+    uint32_t value = 0;
+    counter_record = -1;
+    for (int i = 0; i < COUNTER_RECORDS; i++)
+    {
+        const volatile uint8_t *record = counter_data(i);
+        if (counter_crc(record) != record[COUNTER_RECORD_SIZE - 1])
+            continue;
+
+        uint32_t x = record[0] | ((uint32_t)record[1] << 8) | ((uint32_t)record[2] << 16);
+        if (counter_record < 0 || x > value)
+        {
+            value = x;
+            counter_record = i;
+        }
+    }
+    return value;
+}
+
+// append a value to the counter journal
+// the write completes in background like an EEPROM page, and EEPROM and
+// flash writes issued later wait for it
+void storage_write_counter(uint32_t value)
+{
+    int index = (counter_record + 1) % COUNTER_RECORDS;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        // the page buffer is shared with the EEPROM
+        while (NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm)
+        {
+            // do nothing
+        }
+
+        // reads return the old record until the write completes
+        uint8_t data[COUNTER_RECORD_SIZE] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16)};
+        data[COUNTER_RECORD_SIZE - 1] = counter_crc(data);
+
+        volatile uint8_t *record = counter_data(index);
+        for (int i = 0; i < COUNTER_RECORD_SIZE; i++)
+            record[i] = data[i];
+        _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    }
+
+    counter_record = index;
+}
+
+// supply voltage is dropping, e.g. the card is leaving the field
+// write back everything while there is still enough power
+ISR(BOD_VLM_vect)
+{
+    BOD.INTFLAGS = BOD_VLMIF_bm;
+    storage_flush();
+}
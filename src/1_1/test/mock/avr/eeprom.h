@@ -0,0 +1,24 @@
+// Host mock of <avr/eeprom.h>
+// EEMEM variables are collected in their own section, so that their
+// offsets from the start of the section are EEPROM addresses as on the AVR
+
+#pragma once
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+
+#define EEMEM __attribute__((section("mock_eemem"), used))
+
+extern "C" uint8_t __start_mock_eemem[];
+extern "C" uint8_t __stop_mock_eemem[];
+
+// EEPROM address of an EEMEM variable
+inline uintptr_t mock_eeprom_address(const void *eep)
+{
+    return (uintptr_t)eep < EEPROM_SIZE ? (uintptr_t)eep : (const uint8_t *)eep - __start_mock_eemem;
+}
+
+inline void eeprom_read_block(void *dst, const void *eep, size_t len)
+{
+    memcpy(dst, mock_eeprom + mock_eeprom_address(eep), len);
+}
@@ -0,0 +1,11 @@
+// Host mock of <avr/interrupt.h>
+// an ISR is a plain function, called by the simulation in mock.h
+// while the I bit of SREG is set
+
+#pragma once
+#include <avr/io.h>
+
+#define ISR(vector) extern "C" void vector()
+
+inline void cli() { SREG = SREG & ~0x80; }
+inline void sei() { SREG = SREG | 0x80; }
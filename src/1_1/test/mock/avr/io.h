@@ -0,0 +1,297 @@
+// Host mock of the ATtiny1616 peripherals used by SiliCa
+//
+// Registers without side effects are plain fields. The others are small
+// classes that forward reads and writes to the simulation in mock.h:
+//   SPI0.DATA        feeds received bytes and captures transmitted ones
+//   SPI0.INTFLAGS    DREIF is always set, flags are cleared by writing 1
+//   TCB0.CNT         counts CPU cycles / 2 of the simulated time
+//   NVMCTRL          page writes of the EEPROM, user row and flash
+//   USART0           serial output and input, interrupts run in place
+//   SREG             the I bit gates the mocked interrupts
+// Every read of a status or counter register advances the time, so busy
+// loops in the firmware terminate.
+
+#pragma once
+#include <stdint.h>
+
+#define __AVR_ATtiny1616__
+
+// memory
+#define EEPROM_SIZE 256
+#define EEPROM_PAGE_SIZE 32
+#define USER_SIGNATURES_SIZE 32
+#define PROGMEM_SIZE 16384
+#define PROGMEM_PAGE_SIZE 64
+
+extern uint8_t mock_eeprom[EEPROM_SIZE];
+extern uint8_t mock_userrow[USER_SIGNATURES_SIZE];
+extern uint8_t mock_flash[PROGMEM_SIZE];
+
+#define EEPROM_START ((uintptr_t)mock_eeprom)
+#define USER_SIGNATURES_START ((uintptr_t)mock_userrow)
+#define MAPPED_PROGMEM_START ((uintptr_t)mock_flash)
+
+// hooks implemented in mock.h
+uint8_t mock_spi_read();
+void mock_spi_write(uint8_t);
+uint8_t mock_spi_flags();
+void mock_spi_clear_flags(uint8_t);
+uint16_t mock_tcb_read();
+void mock_tcb_write(uint16_t);
+uint8_t mock_nvm_status();
+void mock_nvm_command(uint8_t);
+void mock_usart_ctrla(uint8_t);
+void mock_usart_transmit(uint8_t);
+uint8_t mock_usart_receive();
+uint8_t mock_usart_receive_status();
+uint8_t mock_sreg_read();
+void mock_sreg_write(uint8_t);
+
+// register with side effects on read and write
+template <typename T, T (*READ)(), void (*WRITE)(T)>
+struct mock_register_t
+{
+    operator T() const { return READ(); }
+    mock_register_t &operator=(T value)
+    {
+        WRITE(value);
+        return *this;
+    }
+    mock_register_t &operator|=(T value) { return *this = READ() | value; }
+    mock_register_t &operator&=(T value) { return *this = READ() & value; }
+};
+
+// register whose reads return the last written value
+template <typename T, void (*WRITE)(T)>
+struct mock_control_t
+{
+    T value;
+    operator T() const { return value; }
+    mock_control_t &operator=(T v)
+    {
+        value = v;
+        WRITE(v);
+        return *this;
+    }
+    mock_control_t &operator|=(T v) { return *this = value | v; }
+    mock_control_t &operator&=(T v) { return *this = value & v; }
+};
+
+inline void mock_ignore_write(uint8_t) {}
+inline uint8_t mock_no_read() { return 0; }
+
+struct SPI_t
+{
+    uint8_t CTRLA;
+    uint8_t CTRLB;
+    uint8_t INTCTRL;
+    mock_register_t<uint8_t, mock_spi_flags, mock_spi_clear_flags> INTFLAGS;
+    mock_register_t<uint8_t, mock_spi_read, mock_spi_write> DATA;
+};
+
+struct USART_t
+{
+    mock_register_t<uint8_t, mock_usart_receive, mock_ignore_write> RXDATAL;
+    mock_register_t<uint8_t, mock_usart_receive_status, mock_ignore_write> RXDATAH;
+    mock_register_t<uint8_t, mock_no_read, mock_usart_transmit> TXDATAL;
+    uint8_t STATUS;
+    mock_control_t<uint8_t, mock_usart_ctrla> CTRLA;
+    uint8_t CTRLB;
+    uint16_t BAUD;
+};
+
+struct CCL_t
+{
+    uint8_t CTRLA;
+    uint8_t LUT0CTRLA;
+    uint8_t LUT0CTRLB;
+    uint8_t LUT0CTRLC;
+    uint8_t TRUTH0;
+    uint8_t LUT1CTRLA;
+    uint8_t LUT1CTRLB;
+    uint8_t LUT1CTRLC;
+    uint8_t TRUTH1;
+};
+
+struct TCA_SINGLE_t
+{
+    uint8_t CTRLA;
+    uint8_t CTRLB;
+    uint16_t CNT;
+    uint16_t PER;
+    uint16_t CMP0;
+    uint16_t CMP1;
+    uint16_t CMP2;
+};
+
+struct TCA_SPLIT_t
+{
+    uint8_t CTRLA;
+};
+
+struct TCA_t
+{
+    TCA_SINGLE_t SINGLE;
+    TCA_SPLIT_t SPLIT;
+};
+
+struct TCB_t
+{
+    uint8_t CTRLA;
+    uint8_t CTRLB;
+    mock_register_t<uint16_t, mock_tcb_read, mock_tcb_write> CNT;
+    uint16_t CCMP;
+};
+
+struct NVMCTRL_t
+{
+    mock_register_t<uint8_t, mock_no_read, mock_nvm_command> CTRLA;
+    mock_register_t<uint8_t, mock_nvm_status, mock_ignore_write> STATUS;
+};
+
+struct BOD_t
+{
+    uint8_t VLMCTRLA;
+    uint8_t INTCTRL;
+    uint8_t INTFLAGS;
+};
+
+struct PORT_t
+{
+    uint8_t DIRSET;
+    uint8_t DIRCLR;
+    uint8_t OUTSET;
+    uint8_t OUTCLR;
+    uint8_t PIN2CTRL;
+};
+
+struct PORTMUX_t
+{
+    uint8_t CTRLA;
+    uint8_t CTRLB;
+};
+
+struct CPUINT_t
+{
+    uint8_t CTRLA;
+};
+
+struct CLKCTRL_t
+{
+    uint8_t MCLKCTRLA;
+    uint8_t MCLKCTRLB;
+};
+
+struct AC_t
+{
+    uint8_t CTRLA;
+};
+
+struct EVSYS_t
+{
+    uint8_t ASYNCCH0;
+    uint8_t ASYNCUSER3;
+};
+
+extern SPI_t SPI0;
+extern USART_t USART0;
+extern CCL_t CCL;
+extern TCA_t TCA0;
+extern TCB_t TCB0;
+extern NVMCTRL_t NVMCTRL;
+extern BOD_t BOD;
+extern PORT_t PORTA;
+extern PORT_t PORTB;
+extern PORTMUX_t PORTMUX;
+extern CPUINT_t CPUINT;
+extern CLKCTRL_t CLKCTRL;
+extern AC_t AC0;
+extern EVSYS_t EVSYS;
+
+extern mock_register_t<uint8_t, mock_sreg_read, mock_sreg_write> SREG;
+
+#define _PROTECTED_WRITE(reg, value) ((reg) = (value))
+#define _PROTECTED_WRITE_SPM(reg, value) ((reg) = (value))
+
+// SPI
+#define SPI_ENABLE_bm 0x01
+#define SPI_MASTER_bm 0x20
+#define SPI_BUFEN_bm 0x80
+#define SPI_BUFWR_bm 0x40
+#define SPI_RXCIF_bm 0x80
+#define SPI_TXCIF_bm 0x40
+#define SPI_DREIF_bm 0x20
+#define SPI_BUFOVF_bm 0x01
+
+// USART
+#define USART_RXCIF_bm 0x80
+#define USART_BUFOVF_bm 0x40
+#define USART_DREIF_bm 0x20
+#define USART_RXCIE_bm 0x80
+#define USART_TXCIE_bm 0x40
+#define USART_DREIE_bm 0x20
+#define USART_RXEN_bm 0x80
+#define USART_TXEN_bm 0x40
+
+// CCL
+#define CCL_ENABLE_bm 0x01
+#define CCL_OUTEN_bm 0x08
+#define CCL_FILTSEL0_bm 0x10
+#define CCL_FILTSEL1_bm 0x20
+#define CCL_FILTSEL_gm 0x30
+#define CCL_FILTSEL_DISABLE_gc 0x00
+#define CCL_FILTSEL_SYNCH_gc 0x10
+#define CCL_FILTSEL_FILTER_gc 0x20
+#define CCL_CLKSRC_bm 0x40
+#define CCL_INSEL0_MASK_gc 0x00
+#define CCL_INSEL0_EVENT0_gc 0x03
+#define CCL_INSEL0_TCA0_gc 0x08
+#define CCL_INSEL0_SPI0_gc 0x0B
+#define CCL_INSEL1_MASK_gc 0x00
+#define CCL_INSEL1_TCA0_gc 0x80
+#define CCL_INSEL1_SPI0_gc 0xB0
+#define CCL_INSEL2_MASK_gc 0x00
+#define CCL_INSEL2_TCA0_gc 0x08
+#define CCL_INSEL2_SPI0_gc 0x0B
+
+// TCA0 and TCB0
+#define TCA_SINGLE_ENABLE_bm 0x01
+#define TCA_SINGLE_CMP0EN_bm 0x10
+#define TCA_SINGLE_WGMODE_SINGLESLOPE_gc 0x03
+#define TCB_ENABLE_bm 0x01
+#define TCB_CLKSEL_CLKDIV2_gc 0x02
+#define TCB_CNTMODE_INT_gc 0x00
+
+// NVMCTRL
+#define NVMCTRL_CMD_PAGEWRITE_gc 0x01
+#define NVMCTRL_CMD_PAGEERASE_gc 0x02
+#define NVMCTRL_CMD_PAGEERASEWRITE_gc 0x03
+#define NVMCTRL_CMD_PAGEBUFCLR_gc 0x04
+#define NVMCTRL_FBUSY_bm 0x01
+#define NVMCTRL_EEBUSY_bm 0x02
+
+// BOD
+#define BOD_VLMLVL_25ABOVE_gc 0x02
+#define BOD_VLMCFG_BELOW_gc 0x00
+#define BOD_VLMIE_bm 0x01
+#define BOD_VLMIF_bm 0x01
+
+// ports, clock and the rest of setup()
+#define PORT_PULLUPEN_bm 0x08
+#define PIN0_bm 0x01
+#define PIN1_bm 0x02
+#define PIN2_bm 0x04
+#define PIN4_bm 0x10
+#define PIN5_bm 0x20
+#define PORTMUX_USART0_ALTERNATE_gc 0x01
+#define PORTMUX_SPI0_ALTERNATE_gc 0x04
+#define PORTMUX_LUT1_ALTERNATE_gc 0x20
+#define CPUINT_IVSEL_bm 0x40
+#define CLKCTRL_CLKSEL_EXTCLK_gc 0x03
+#define CLKCTRL_PDIV_4X_gc 0x02
+#define CLKCTRL_ENABLE_bm 0x01
+#define AC_ENABLE_bm 0x01
+#define AC_OUTEN_bm 0x40
+#define AC_HYSMODE_25mV_gc 0x06
+#define EVSYS_ASYNCCH0_CCL_LUT0_gc 0x03
+#define EVSYS_ASYNCUSER0_ASYNCCH0_gc 0x03
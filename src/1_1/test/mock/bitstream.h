@@ -0,0 +1,203 @@
+// Reader side of the RF link for host tests
+//
+// reader_samples() turns a command packet into the bytes SPI0 receives:
+// the frame (preamble, sync code, packet, EDC) is Manchester encoded at
+// 2 samples per bit and starts `shift` bits into a received byte, after
+// idle samples. Samples can be inverted, flipped, dropped or repeated to
+// model the polarity of the demodulator, noise and bit slips.
+// decode_response() recovers the packet from the bytes the card sent,
+// decode_modulation() from the modulation the CCL made of them.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// CRC16-CCITT as in the EDC of the frame, bit by bit
+inline uint16_t reference_crc16(const uint8_t *data, int len, uint16_t crc = 0)
+{
+    for (int i = 0; i < len; i++)
+    {
+        crc ^= data[i] << 8;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// frame of a packet: preamble, sync code, packet and EDC
+inline std::vector<uint8_t> reader_frame(const std::vector<uint8_t> &packet)
+{
+    std::vector<uint8_t> frame = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
+    frame.insert(frame.end(), packet.begin(), packet.end());
+    uint16_t edc = reference_crc16(packet.data(), packet.size());
+    frame.push_back(edc >> 8);
+    frame.push_back(edc & 0xFF);
+    return frame;
+}
+
+// one bit per element, first bit first
+typedef std::vector<uint8_t> bits_t;
+
+// Manchester code of a frame, 1 is sent as 10 and 0 as 01
+inline bits_t manchester_bits(const std::vector<uint8_t> &frame)
+{
+    bits_t bits;
+    for (uint8_t x : frame)
+    {
+        for (int i = 7; i >= 0; i--)
+        {
+            int bit = (x >> i) & 1;
+            bits.push_back(bit);
+            bits.push_back(!bit);
+        }
+    }
+    return bits;
+}
+
+// bits of a frame sent at 424kbps, sampled once per bit in its first or
+// second half
+inline bits_t sampled_bits(const std::vector<uint8_t> &frame, bool second_half)
+{
+    bits_t bits;
+    for (uint8_t x : frame)
+    {
+        for (int i = 7; i >= 0; i--)
+            bits.push_back(((x >> i) & 1) ^ second_half);
+    }
+    return bits;
+}
+
+// pack bits into received bytes, first bit in the MSB
+// the last byte is filled up with the idle level
+inline std::vector<uint8_t> pack_bits(const bits_t &bits, int idle)
+{
+    std::vector<uint8_t> bytes((bits.size() + 7) / 8, idle ? 0xFF : 0x00);
+    for (size_t i = 0; i < bits.size(); i++)
+    {
+        uint8_t bit = 0x80 >> (i % 8);
+        if (bits[i])
+            bytes[i / 8] |= bit;
+        else
+            bytes[i / 8] &= ~bit;
+    }
+    return bytes;
+}
+
+// options of reader_samples()
+struct link_options_t
+{
+    int shift = 0;            // bit of a received byte where the sync code starts
+    bool invert = false;      // demodulator polarity, inverts the idle level too
+    bool fast = false;        // 424kbps, one sample per bit
+    bool second_half = false; // 424kbps: sample the second half of each bit
+    int idle_before = 4;      // idle bytes before the frame
+    int idle_after = 4;       // idle bytes after the frame
+    std::vector<int> flips;   // samples to invert, counted from the first preamble sample
+    std::vector<int> drops;   // samples to drop (one bit later from there on)
+    std::vector<int> repeats; // samples to repeat (one bit earlier)
+};
+
+// samples SPI0 receives for a command packet
+inline std::vector<uint8_t> reader_samples(const std::vector<uint8_t> &packet, const link_options_t &o = {})
+{
+    std::vector<uint8_t> frame = reader_frame(packet);
+    bits_t frame_bits = o.fast ? sampled_bits(frame, o.second_half) : manchester_bits(frame);
+
+    for (int i : o.flips)
+        frame_bits[i] ^= 1;
+
+    // apply slips from the end so earlier positions stay valid
+    for (int i = frame_bits.size() - 1; i >= 0; i--)
+    {
+        for (int d : o.drops)
+        {
+            if (d == i)
+                frame_bits.erase(frame_bits.begin() + i);
+        }
+        for (int r : o.repeats)
+        {
+            if (r == i)
+                frame_bits.insert(frame_bits.begin() + i, frame_bits[i]);
+        }
+    }
+
+    // the sync code follows the preamble
+    int preamble = o.fast ? 6 * 8 : 6 * 16;
+    int lead = (o.shift - preamble % 8 + 8) % 8;
+
+    bits_t bits(8 * o.idle_before + lead, 0);
+    bits.insert(bits.end(), frame_bits.begin(), frame_bits.end());
+    bits.resize(bits.size() + 8 * o.idle_after, 0);
+
+    if (o.invert)
+    {
+        for (auto &bit : bits)
+            bit ^= 1;
+    }
+    return pack_bits(bits, o.invert);
+}
+
+// response decoded from the bytes sent while transmitting
+struct response_frame_t
+{
+    bool valid = false;          // preamble, sync code, length and EDC are correct
+    std::vector<uint8_t> packet; // without EDC
+};
+
+// decode the Manchester code sent by the card
+// bytes hold 4 bits each, up to the first byte that is not Manchester code
+inline response_frame_t decode_response(const std::vector<uint8_t> &tx)
+{
+    std::vector<uint8_t> frame;
+    uint8_t x = 0;
+    int nibbles = 0;
+    for (uint8_t data : tx)
+    {
+        uint8_t nibble = 0;
+        bool manchester = true;
+        for (int i = 3; i >= 0; i--)
+        {
+            int pair = (data >> (2 * i)) & 3;
+            if (pair == 2)
+                nibble |= 1 << i;
+            else if (pair != 1)
+                manchester = false;
+        }
+        if (!manchester)
+        {
+            // leading flush bytes are skipped
+            if (frame.empty() && nibbles == 0)
+                continue;
+            break;
+        }
+
+        x = (x << 4) | nibble;
+        if (++nibbles % 2 == 0)
+            frame.push_back(x);
+    }
+
+    response_frame_t result;
+    static const uint8_t header[8] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xB2, 0x4D};
+    if (frame.size() < 11 || memcmp(frame.data(), header, 8) != 0)
+        return result;
+
+    int len = frame[8];
+    if (len == 0 || frame.size() < 8 + (size_t)len + 2)
+        return result;
+
+    result.packet.assign(frame.begin() + 8, frame.begin() + 8 + len);
+    uint16_t edc = (frame[8 + len] << 8) | frame[9 + len];
+    result.valid = edc == reference_crc16(result.packet.data(), len);
+    return result;
+}
+
+// decode the modulation of a response, sampled in the middle of every
+// Manchester half-bit of `cycles` CPU cycles
+inline response_frame_t decode_modulation(const std::vector<uint8_t> &modulation, int cycles)
+{
+    bits_t halves;
+    for (size_t i = cycles / 2; i < modulation.size(); i += cycles)
+        halves.push_back(modulation[i]);
+    return decode_response(pack_bits(halves, 0));
+}
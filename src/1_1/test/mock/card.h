@@ -0,0 +1,80 @@
+// The whole card on the host: firmware sources, mocked peripherals and
+// the reader side of the link
+//
+// A test program defines the SILICA_* options it needs, then includes
+// this header once. The firmware is compiled into the test itself, so
+// tests can call its static functions directly.
+
+#pragma once
+#include "silica.cpp"
+#include "storage.cpp"
+#include "main.cpp"
+#include "mac.cpp"
+#include "mock.h"
+#include "bitstream.h"
+
+// erase the card and power it up
+inline void card_reset()
+{
+    mock_reset();
+    setup();
+}
+
+// power up again, keeping the EEPROM and flash
+inline void card_power_cycle()
+{
+    mock_power_loss();
+    setup();
+}
+
+// send a command packet to the card and run the main loop once
+// return the decoded response, invalid if the card did not respond
+inline response_frame_t card_exchange(const std::vector<uint8_t> &packet, const link_options_t &options = {})
+{
+    mock_rx.clear();
+    mock_tx.clear();
+    mock_tx_sck.clear();
+    mock_tx_sck_high.clear();
+    mock_modulation.clear();
+    mock_rx_idle = options.invert ? 0xFF : 0x00;
+    mock_receive(reader_samples(packet, options));
+    try
+    {
+        loop();
+    }
+    catch (const mock_idle_t &)
+    {
+        // no frame was found in the samples
+    }
+    return decode_response(mock_tx);
+}
+
+// IDm of the card
+inline std::vector<uint8_t> card_idm()
+{
+    return std::vector<uint8_t>(idm, idm + 8);
+}
+
+// Read Without Encryption of blocks of one service
+inline std::vector<uint8_t> read_command(uint16_t service, const std::vector<uint8_t> &blocks)
+{
+    std::vector<uint8_t> command = {0, 0x06};
+    std::vector<uint8_t> id = card_idm();
+    command.insert(command.end(), id.begin(), id.end());
+    command.insert(command.end(), {1, (uint8_t)(service & 0xFF), (uint8_t)(service >> 8), (uint8_t)blocks.size()});
+    for (uint8_t block : blocks)
+        command.insert(command.end(), {0x80, block});
+    command[0] = command.size();
+    return command;
+}
+
+// Write Without Encryption of blocks of one service
+// data holds 16 bytes for each block
+inline std::vector<uint8_t> write_command(uint16_t service, const std::vector<uint8_t> &blocks, const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> command = read_command(service, blocks);
+    command[1] = 0x08;
+    command.insert(command.end(), data.begin(), data.end());
+    command[0] = command.size();
+    return command;
+}
@@ -0,0 +1,442 @@
+// Simulation behind the peripheral mocks in avr/io.h
+//
+// Time is counted in CPU cycles of fclk = fc/4. Every byte written to
+// SPI0.DATA takes one SCK byte period, (TCA0.SINGLE.PER + 1) * 8 cycles,
+// and shifts in the next byte of the received samples queued by a test.
+// While the CCL is enabled, written bytes are captured as the response,
+// along with the output of LUT0 in every cycle they take.
+// Interrupts run in place whenever time passes with the I bit set.
+//
+// Include this header once per test program, after the firmware sources.
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+// CPU clock
+static constexpr double MOCK_FCLK = 13.56e6 / 4;
+
+// EEPROM and flash erase/write time
+static constexpr uint32_t MOCK_NVM_WRITE_CYCLES = MOCK_FCLK * 0.004;
+
+// thrown when the firmware keeps waiting for a frame after all queued
+// samples and mock_idle_limit idle bytes have been received
+struct mock_idle_t
+{
+};
+
+// memory, 0xFF when erased
+uint8_t mock_eeprom[EEPROM_SIZE];
+uint8_t mock_userrow[USER_SIGNATURES_SIZE];
+uint8_t mock_flash[PROGMEM_SIZE];
+
+// contents as of the last erase/write, restored by mock_power_loss()
+static uint8_t mock_eeprom_saved[EEPROM_SIZE];
+static uint8_t mock_userrow_saved[USER_SIGNATURES_SIZE];
+static uint8_t mock_flash_saved[PROGMEM_SIZE];
+
+// erase/write cycles of every byte and of every flash page
+uint32_t mock_eeprom_wear[EEPROM_SIZE];
+uint32_t mock_userrow_wear[USER_SIGNATURES_SIZE];
+uint32_t mock_flash_wear[PROGMEM_SIZE / PROGMEM_PAGE_SIZE];
+
+SPI_t SPI0;
+USART_t USART0;
+CCL_t CCL;
+TCA_t TCA0;
+TCB_t TCB0;
+NVMCTRL_t NVMCTRL;
+BOD_t BOD;
+PORT_t PORTA;
+PORT_t PORTB;
+PORTMUX_t PORTMUX;
+CPUINT_t CPUINT;
+CLKCTRL_t CLKCTRL;
+AC_t AC0;
+EVSYS_t EVSYS;
+mock_register_t<uint8_t, mock_sreg_read, mock_sreg_write> SREG;
+
+// simulated time
+uint64_t mock_cycles = 0;
+
+// received samples, and the level of the carrier without a frame
+std::deque<uint8_t> mock_rx;
+uint8_t mock_rx_idle = 0x00;
+int mock_idle_limit = 1024;
+static int mock_idle_count = 0;
+static uint8_t mock_spi_latch = 0;
+
+// SPI flags raised by a test, cleared by writing 1 like the hardware
+uint8_t mock_spi_status = 0;
+
+// bytes written while the CCL was enabled, the SCK period and high time
+// of each and the cycle the first one was written at
+std::vector<uint8_t> mock_tx;
+std::vector<uint16_t> mock_tx_sck;
+std::vector<uint16_t> mock_tx_sck_high;
+uint64_t mock_tx_start = 0;
+
+// output of LUT0 in every cycle of the bytes in mock_tx
+std::vector<uint8_t> mock_modulation;
+
+// the CPU is held up for mock_tx_stall_cycles before it writes byte
+// mock_tx_stall_at of a response, like by an interrupt, -1 for never
+int mock_tx_stall_at = -1;
+uint32_t mock_tx_stall_cycles = 0;
+
+// the last written byte has been shifted out at this cycle
+static uint64_t mock_spi_done = 0;
+
+// TCB0 counts from this cycle
+static uint64_t mock_tcb_start = 0;
+
+// EEPROM erase/write in progress until this cycle
+static uint64_t mock_eeprom_busy_until = 0;
+
+static uint8_t mock_sreg = 0;
+static bool mock_in_interrupt = false;
+
+// serial output, and serial input with the cycle each byte arrives at
+std::string mock_serial_output;
+std::deque<std::pair<uint64_t, uint8_t>> mock_serial_input;
+static std::deque<uint8_t> mock_usart_fifo;
+static bool mock_usart_overflow = false;
+int mock_serial_overruns = 0;
+
+// the supply voltage fell below the VLM level
+static bool mock_vlm_pending = false;
+
+extern "C" void USART0_DRE_vect() __attribute__((weak));
+extern "C" void USART0_RXC_vect() __attribute__((weak));
+extern "C" void BOD_VLM_vect() __attribute__((weak));
+
+// an ISR is null if the firmware does not define it
+static inline bool mock_defined(void (*isr)())
+{
+    return isr != nullptr;
+}
+
+// run pending interrupts if enabled
+static void mock_interrupts()
+{
+    if (!(mock_sreg & 0x80) || mock_in_interrupt)
+        return;
+    mock_in_interrupt = true;
+    mock_sreg &= ~0x80;
+
+    if (mock_vlm_pending && (BOD.INTCTRL & BOD_VLMIE_bm) && mock_defined(BOD_VLM_vect))
+    {
+        mock_vlm_pending = false;
+        BOD_VLM_vect();
+    }
+
+    // the receiver holds 2 bytes, further bytes are lost
+    while (!mock_serial_input.empty() && mock_serial_input.front().first <= mock_cycles)
+    {
+        if (mock_usart_fifo.size() < 2)
+            mock_usart_fifo.push_back(mock_serial_input.front().second);
+        else
+        {
+            mock_usart_overflow = true;
+            mock_serial_overruns++;
+        }
+        mock_serial_input.pop_front();
+    }
+    while (!mock_usart_fifo.empty() && (USART0.CTRLA & USART_RXCIE_bm) && mock_defined(USART0_RXC_vect))
+        USART0_RXC_vect();
+
+    // output is sent at once
+    while ((USART0.CTRLA & USART_DREIE_bm) && mock_defined(USART0_DRE_vect))
+        USART0_DRE_vect();
+
+    mock_sreg |= 0x80;
+    mock_in_interrupt = false;
+}
+
+void mock_advance(uint32_t cycles)
+{
+    mock_cycles += cycles;
+    mock_interrupts();
+}
+
+// cycles per SPI byte
+static inline uint32_t mock_sck_byte()
+{
+    return (TCA0.SINGLE.PER + 1) * 8;
+}
+
+// input n of LUT0 at TCA0 count `count` while MISO sends `miso`
+static int mock_lut0_input(int n, int count, int miso)
+{
+    static const uint8_t SPI0_INPUT = 0x0B;
+    static const uint8_t TCA0_INPUT = 0x08;
+    uint8_t insel = n == 0 ? CCL.LUT0CTRLB & 0x0F : n == 1 ? CCL.LUT0CTRLB >> 4 : CCL.LUT0CTRLC & 0x0F;
+    const uint16_t cmp[3] = {TCA0.SINGLE.CMP0, TCA0.SINGLE.CMP1, TCA0.SINGLE.CMP2};
+
+    // WOn is high from BOTTOM to CMPn
+    if (insel == TCA0_INPUT)
+        return count < cmp[n];
+
+    // SCK, MOSI and MISO, SCK comes from WO0
+    if (insel == SPI0_INPUT)
+        return n == 0 ? count < cmp[0] : n == 2 ? miso : 0;
+
+    return 0;
+}
+
+// LUT0 output for every cycle of a transmitted byte
+// MISO changes at the falling edge of SCK, when TCA0 reaches CMP0
+static void mock_modulate(uint8_t data)
+{
+    int period = TCA0.SINGLE.PER + 1;
+    for (int i = 7; i >= 0; i--)
+    {
+        int miso = (data >> i) & 1;
+        for (int c = 0; c < period; c++)
+        {
+            int count = (TCA0.SINGLE.CMP0 + c) % period;
+            int index = 0;
+            for (int n = 0; n < 3; n++)
+                index |= mock_lut0_input(n, count, miso) << n;
+            mock_modulation.push_back((CCL.TRUTH0 >> index) & 1);
+        }
+    }
+}
+
+void mock_spi_write(uint8_t data)
+{
+    if (CCL.CTRLA & CCL_ENABLE_bm)
+    {
+        if ((int)mock_tx.size() == mock_tx_stall_at)
+            mock_advance(mock_tx_stall_cycles);
+
+        // the buffer holds one byte besides the shift register, so the
+        // stream breaks if a byte comes more than one byte time late
+        if (!mock_tx.empty() && mock_cycles > mock_spi_done)
+            mock_spi_status |= SPI_TXCIF_bm;
+    }
+
+    mock_advance(mock_sck_byte());
+    mock_spi_done = mock_cycles + mock_sck_byte();
+
+    if (CCL.CTRLA & CCL_ENABLE_bm)
+    {
+        // the reader does not send while the card responds
+        if (mock_tx.empty())
+            mock_tx_start = mock_cycles;
+        mock_tx.push_back(data);
+        mock_tx_sck.push_back(TCA0.SINGLE.PER + 1);
+        mock_tx_sck_high.push_back(TCA0.SINGLE.CMP0);
+        mock_modulate(data);
+        mock_spi_latch = mock_rx_idle;
+        return;
+    }
+
+    if (!mock_rx.empty())
+    {
+        mock_spi_latch = mock_rx.front();
+        mock_rx.pop_front();
+        return;
+    }
+
+    mock_spi_latch = mock_rx_idle;
+    if (++mock_idle_count > mock_idle_limit)
+        throw mock_idle_t();
+}
+
+uint8_t mock_spi_read()
+{
+    return mock_spi_latch;
+}
+
+// TXCIF is set once the last written byte has been shifted out
+uint8_t mock_spi_flags()
+{
+    mock_advance(3);
+    uint8_t flags = SPI_DREIF_bm | mock_spi_status;
+    if (mock_cycles >= mock_spi_done)
+        flags |= SPI_TXCIF_bm;
+    return flags;
+}
+
+void mock_spi_clear_flags(uint8_t flags)
+{
+    mock_spi_status &= ~flags;
+}
+
+uint16_t mock_tcb_read()
+{
+    mock_advance(4);
+    return (mock_cycles - mock_tcb_start) / 2;
+}
+
+void mock_tcb_write(uint16_t value)
+{
+    mock_tcb_start = mock_cycles - 2 * (uint64_t)value;
+}
+
+uint8_t mock_nvm_status()
+{
+    mock_advance(4);
+    return mock_cycles < mock_eeprom_busy_until ? NVMCTRL_EEBUSY_bm : 0;
+}
+
+// count and keep the bytes loaded since the last erase/write
+// return true if any byte changed
+static bool mock_nvm_save(uint8_t *memory, uint8_t *saved, uint32_t *wear, int size, int unit)
+{
+    bool changed = false;
+    for (int i = 0; i < size; i++)
+    {
+        if (memory[i] != saved[i])
+        {
+            saved[i] = memory[i];
+            wear[i / unit]++;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void mock_nvm_command(uint8_t command)
+{
+    if (command != NVMCTRL_CMD_PAGEERASEWRITE_gc)
+        return;
+
+    // the user row is written like the EEPROM
+    bool eeprom = mock_nvm_save(mock_eeprom, mock_eeprom_saved, mock_eeprom_wear, EEPROM_SIZE, 1);
+    bool userrow = mock_nvm_save(mock_userrow, mock_userrow_saved, mock_userrow_wear, USER_SIGNATURES_SIZE, 1);
+    if (eeprom || userrow)
+        mock_eeprom_busy_until = mock_cycles + MOCK_NVM_WRITE_CYCLES;
+
+    // the CPU halts while flash is written
+    uint32_t pages[PROGMEM_SIZE / PROGMEM_PAGE_SIZE] = {};
+    if (mock_nvm_save(mock_flash, mock_flash_saved, pages, PROGMEM_SIZE, PROGMEM_PAGE_SIZE))
+    {
+        for (int i = 0; i < PROGMEM_SIZE / PROGMEM_PAGE_SIZE; i++)
+            mock_flash_wear[i] += pages[i] != 0;
+        mock_cycles += MOCK_NVM_WRITE_CYCLES;
+    }
+}
+
+void mock_usart_ctrla(uint8_t)
+{
+    mock_interrupts();
+}
+
+void mock_usart_transmit(uint8_t data)
+{
+    mock_serial_output += (char)data;
+}
+
+// reading the data clears the overflow flag
+uint8_t mock_usart_receive()
+{
+    mock_usart_overflow = false;
+    if (mock_usart_fifo.empty())
+        return 0;
+    uint8_t data = mock_usart_fifo.front();
+    mock_usart_fifo.pop_front();
+    return data;
+}
+
+uint8_t mock_usart_receive_status()
+{
+    return mock_usart_overflow ? USART_BUFOVF_bm : 0;
+}
+
+uint8_t mock_sreg_read()
+{
+    return mock_sreg;
+}
+
+void mock_sreg_write(uint8_t value)
+{
+    mock_sreg = value;
+    mock_interrupts();
+}
+
+// queue received samples, the idle count starts over
+void mock_receive(const std::vector<uint8_t> &samples)
+{
+    mock_rx.insert(mock_rx.end(), samples.begin(), samples.end());
+    mock_idle_count = 0;
+}
+
+// queue bytes arriving over serial, one every 10 bit times from now
+void mock_serial_receive(const std::vector<uint8_t> &data, uint32_t baud = 230400)
+{
+    uint64_t t = mock_cycles;
+    if (!mock_serial_input.empty())
+        t = std::max(t, mock_serial_input.back().first);
+    for (uint8_t x : data)
+    {
+        t += (uint64_t)(10 * MOCK_FCLK / baud);
+        mock_serial_input.push_back({t, x});
+    }
+}
+
+// the supply starts to drop, the VLM interrupt runs if enabled
+void mock_supply_drop()
+{
+    mock_vlm_pending = true;
+    mock_interrupts();
+}
+
+// power is lost: writes not started are gone and the RAM state of the
+// firmware must be initialized again by the test
+void mock_power_loss()
+{
+    memcpy(mock_eeprom, mock_eeprom_saved, EEPROM_SIZE);
+    memcpy(mock_userrow, mock_userrow_saved, USER_SIGNATURES_SIZE);
+    memcpy(mock_flash, mock_flash_saved, PROGMEM_SIZE);
+    mock_eeprom_busy_until = 0;
+    mock_vlm_pending = false;
+    mock_sreg = 0;
+}
+
+// erase all memory and clear the simulation state
+void mock_reset()
+{
+    memset(mock_eeprom, 0xFF, EEPROM_SIZE);
+    memset(mock_userrow, 0xFF, USER_SIGNATURES_SIZE);
+    memset(mock_flash, 0xFF, PROGMEM_SIZE);
+    memcpy(mock_eeprom_saved, mock_eeprom, EEPROM_SIZE);
+    memcpy(mock_userrow_saved, mock_userrow, USER_SIGNATURES_SIZE);
+    memcpy(mock_flash_saved, mock_flash, PROGMEM_SIZE);
+    memset(mock_eeprom_wear, 0, sizeof(mock_eeprom_wear));
+    memset(mock_userrow_wear, 0, sizeof(mock_userrow_wear));
+    memset(mock_flash_wear, 0, sizeof(mock_flash_wear));
+
+    mock_cycles = 0;
+    mock_rx.clear();
+    mock_rx_idle = 0x00;
+    mock_idle_count = 0;
+    mock_spi_status = 0;
+    mock_tx.clear();
+    mock_tx_sck.clear();
+    mock_tx_sck_high.clear();
+    mock_modulation.clear();
+    mock_tx_stall_at = -1;
+    mock_tx_stall_cycles = 0;
+    mock_spi_done = 0;
+    mock_tcb_start = 0;
+    mock_eeprom_busy_until = 0;
+    mock_sreg = 0;
+    mock_in_interrupt = false;
+    mock_serial_output.clear();
+    mock_serial_input.clear();
+    mock_usart_fifo.clear();
+    mock_usart_overflow = false;
+    mock_serial_overruns = 0;
+    mock_vlm_pending = false;
+    USART0.CTRLA.value = 0;
+    CCL.CTRLA = 0;
+    TCA0.SINGLE.PER = 7;
+    TCA0.SINGLE.CMP0 = 3;
+}
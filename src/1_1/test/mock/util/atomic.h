@@ -0,0 +1,11 @@
+// Host mock of <util/atomic.h>
+// the block runs with the I bit of SREG cleared and restores it after
+
+#pragma once
+#include <avr/interrupt.h>
+
+#define ATOMIC_RESTORESTATE 0
+
+#define ATOMIC_BLOCK(type)                                                  \
+    for (uint8_t mock_sreg_save = SREG, mock_atomic_once = (cli(), 1);      \
+         mock_atomic_once; SREG = mock_sreg_save, mock_atomic_once = 0)
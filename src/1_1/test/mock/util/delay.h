@@ -0,0 +1,11 @@
+// Host mock of <util/delay.h>, the delay passes in simulated time
+
+#pragma once
+#include <stdint.h>
+
+void mock_advance(uint32_t cycles);
+
+inline void _delay_us(double us)
+{
+    mock_advance(us * 3.39);
+}
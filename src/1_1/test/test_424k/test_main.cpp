@@ -0,0 +1,109 @@
+// Responses at 424kbps within the timing of the SPI slave
+
+#define SILICA_424K
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+static const std::vector<uint8_t> POLLING = {0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00};
+
+// cycles of a Manchester half-bit at 212kbps and 424kbps
+static const int HALF_BIT_212K = 8;
+static const int HALF_BIT_424K = 4;
+
+// the SPI slave needs SCK high and low for more than 2 cycles each
+static void assert_sck_in_spec()
+{
+    TEST_ASSERT_FALSE(mock_tx_sck.empty());
+    for (size_t i = 0; i < mock_tx_sck.size(); i++)
+    {
+        TEST_ASSERT_GREATER_THAN(2, mock_tx_sck_high[i]);
+        TEST_ASSERT_GREATER_THAN(2, mock_tx_sck[i] - mock_tx_sck_high[i]);
+    }
+}
+
+// a command at 424kbps is answered at 424kbps, in either sampling phase
+void test_response_at_424k()
+{
+    for (bool second_half : {false, true})
+    {
+        link_options_t o;
+        o.fast = true;
+        o.second_half = second_half;
+        response_frame_t response = card_exchange(POLLING, o);
+        assert_sck_in_spec();
+
+        response = decode_modulation(mock_modulation, HALF_BIT_424K);
+        TEST_ASSERT_TRUE(response.valid);
+        TEST_ASSERT_EQUAL(0x01, response.packet[1]);
+
+        // the bytes themselves are not Manchester code
+        TEST_ASSERT_FALSE(decode_response(mock_tx).valid);
+    }
+}
+
+// the modulation stops with the last bit of the EDC
+void test_nothing_is_sent_after_the_edc()
+{
+    link_options_t o;
+    o.fast = true;
+    card_exchange(POLLING, o);
+    response_frame_t response = decode_modulation(mock_modulation, HALF_BIT_424K);
+    TEST_ASSERT_TRUE(response.valid);
+
+    // the header, the packet and the EDC, 8 bits of 2 half-bits each
+    size_t bytes = 8 + response.packet.size() + 2;
+    TEST_ASSERT_EQUAL(bytes * 8 * 2 * HALF_BIT_424K, mock_modulation.size());
+}
+
+// block data sent from storage, with the EDC calculated beforehand
+void test_read_at_424k()
+{
+    std::vector<uint8_t> blocks;
+    for (int i = 0; i < 12; i++)
+        blocks.push_back(i);
+
+    link_options_t o;
+    o.fast = true;
+    card_exchange(read_command(0xFFFF, blocks), o);
+    assert_sck_in_spec();
+
+    response_frame_t response = decode_modulation(mock_modulation, HALF_BIT_424K);
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[11]);
+    TEST_ASSERT_EQUAL(13 + 16 * 12, response.packet.size());
+}
+
+// the next command at 212kbps is answered with the 212kbps modulation
+void test_212k_after_424k()
+{
+    link_options_t o;
+    o.fast = true;
+    card_exchange(POLLING, o);
+    TEST_ASSERT_TRUE(decode_modulation(mock_modulation, HALF_BIT_424K).valid);
+
+    response_frame_t response = card_exchange(POLLING);
+    assert_sck_in_spec();
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_TRUE(decode_modulation(mock_modulation, HALF_BIT_212K).valid);
+    TEST_ASSERT_EQUAL(3, TCA0.SINGLE.CMP0);
+    TEST_ASSERT_EQUAL_HEX8(0xF0, CCL.TRUTH0);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_response_at_424k);
+    RUN_TEST(test_nothing_is_sent_after_the_edc);
+    RUN_TEST(test_read_at_424k);
+    RUN_TEST(test_212k_after_424k);
+    return UNITY_END();
+}
@@ -0,0 +1,285 @@
+// Manchester decoding with the lookup table
+// checked against the per-bit extract_byte() it replaced
+
+#include <chrono>
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// extract_byte() as it was before the lookup table, copied verbatim
+// from src/silica.cpp of the first version
+// extract one byte from 3 bytes of received data
+// according to the specified bit shift
+uint8_t extract_byte(int shift, uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    uint8_t x = 0;
+
+    if (shift == 0)
+    {
+        if (data1 & 0x80)
+            x |= 0x80;
+        if (data1 & 0x20)
+            x |= 0x40;
+        if (data1 & 0x08)
+            x |= 0x20;
+        if (data1 & 0x02)
+            x |= 0x10;
+        if (data2 & 0x80)
+            x |= 0x08;
+        if (data2 & 0x20)
+            x |= 0x04;
+        if (data2 & 0x08)
+            x |= 0x02;
+        if (data2 & 0x02)
+            x |= 0x01;
+    }
+    if (shift == 1)
+    {
+        if (data1 & 0x40)
+            x |= 0x80;
+        if (data1 & 0x10)
+            x |= 0x40;
+        if (data1 & 0x04)
+            x |= 0x20;
+        if (data1 & 0x01)
+            x |= 0x10;
+        if (data2 & 0x40)
+            x |= 0x08;
+        if (data2 & 0x10)
+            x |= 0x04;
+        if (data2 & 0x04)
+            x |= 0x02;
+        if (data2 & 0x01)
+            x |= 0x01;
+    }
+    if (shift == 2)
+    {
+        if (data1 & 0x20)
+            x |= 0x80;
+        if (data1 & 0x08)
+            x |= 0x40;
+        if (data1 & 0x02)
+            x |= 0x20;
+        if (data2 & 0x80)
+            x |= 0x10;
+        if (data2 & 0x20)
+            x |= 0x08;
+        if (data2 & 0x08)
+            x |= 0x04;
+        if (data2 & 0x02)
+            x |= 0x02;
+        if (data3 & 0x80)
+            x |= 0x01;
+    }
+    if (shift == 3)
+    {
+        if (data1 & 0x10)
+            x |= 0x80;
+        if (data1 & 0x04)
+            x |= 0x40;
+        if (data1 & 0x01)
+            x |= 0x20;
+        if (data2 & 0x40)
+            x |= 0x10;
+        if (data2 & 0x10)
+            x |= 0x08;
+        if (data2 & 0x04)
+            x |= 0x04;
+        if (data2 & 0x01)
+            x |= 0x02;
+        if (data3 & 0x40)
+            x |= 0x01;
+    }
+    if (shift == 4)
+    {
+        if (data1 & 0x08)
+            x |= 0x80;
+        if (data1 & 0x02)
+            x |= 0x40;
+        if (data2 & 0x80)
+            x |= 0x20;
+        if (data2 & 0x20)
+            x |= 0x10;
+        if (data2 & 0x08)
+            x |= 0x08;
+        if (data2 & 0x02)
+            x |= 0x04;
+        if (data3 & 0x80)
+            x |= 0x02;
+        if (data3 & 0x20)
+            x |= 0x01;
+    }
+    if (shift == 5)
+    {
+        if (data1 & 0x04)
+            x |= 0x80;
+        if (data1 & 0x01)
+            x |= 0x40;
+        if (data2 & 0x40)
+            x |= 0x20;
+        if (data2 & 0x10)
+            x |= 0x10;
+        if (data2 & 0x04)
+            x |= 0x08;
+        if (data2 & 0x01)
+            x |= 0x04;
+        if (data3 & 0x40)
+            x |= 0x02;
+        if (data3 & 0x10)
+            x |= 0x01;
+    }
+    if (shift == 6)
+    {
+        if (data1 & 0x02)
+            x |= 0x80;
+        if (data2 & 0x80)
+            x |= 0x40;
+        if (data2 & 0x20)
+            x |= 0x20;
+        if (data2 & 0x08)
+            x |= 0x10;
+        if (data2 & 0x02)
+            x |= 0x08;
+        if (data3 & 0x80)
+            x |= 0x04;
+        if (data3 & 0x20)
+            x |= 0x02;
+        if (data3 & 0x08)
+            x |= 0x01;
+    }
+    if (shift == 7)
+    {
+        if (data1 & 0x01)
+            x |= 0x80;
+        if (data2 & 0x40)
+            x |= 0x40;
+        if (data2 & 0x10)
+            x |= 0x20;
+        if (data2 & 0x04)
+            x |= 0x10;
+        if (data2 & 0x01)
+            x |= 0x08;
+        if (data3 & 0x40)
+            x |= 0x04;
+        if (data3 & 0x10)
+            x |= 0x02;
+        if (data3 & 0x04)
+            x |= 0x01;
+    }
+
+    return x;
+}
+
+template <int SHIFT>
+static uint8_t decode_byte(uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    return decode_bits(window_bits<SHIFT>(data1, data2), window_bits<SHIFT>(data2, data3));
+}
+
+// every received byte triple at one shift
+template <int SHIFT>
+static void check_all_inputs()
+{
+    for (uint32_t i = 0; i < 0x1000000; i++)
+    {
+        uint8_t data1 = i >> 16, data2 = i >> 8, data3 = i;
+        if (decode_byte<SHIFT>(data1, data2, data3) != extract_byte(SHIFT, data1, data2, data3))
+        {
+            char str[64];
+            snprintf(str, sizeof(str), "shift %d: %02X %02X %02X", SHIFT, data1, data2, data3);
+            TEST_FAIL_MESSAGE(str);
+        }
+    }
+}
+
+void test_table_matches_extract_byte_for_every_input()
+{
+    check_all_inputs<0>();
+    check_all_inputs<1>();
+    check_all_inputs<2>();
+    check_all_inputs<3>();
+    check_all_inputs<4>();
+    check_all_inputs<5>();
+    check_all_inputs<6>();
+    check_all_inputs<7>();
+}
+
+// random packets of every length through receive_command()
+void test_packets_decode_at_every_shift_and_polarity()
+{
+    uint32_t seed = 1;
+    for (int len = 3; len <= PACKET_MAX; len += 7)
+    {
+        std::vector<uint8_t> packet(len);
+        packet[0] = len;
+        for (int i = 1; i < len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            packet[i] = seed >> 16;
+        }
+
+        for (int invert = 0; invert < 2; invert++)
+        {
+            for (int shift = 0; shift < 8; shift++)
+            {
+                link_options_t o;
+                o.shift = shift;
+                o.invert = invert;
+                mock_rx.clear();
+                mock_rx_idle = invert ? 0xFF : 0x00;
+                mock_receive(reader_samples(packet, o));
+
+                uint8_t *command = receive_command();
+                TEST_ASSERT_NOT_NULL(command);
+                TEST_ASSERT_EQUAL_UINT8_ARRAY(packet.data(), command, len);
+            }
+        }
+    }
+}
+
+// host time per decoded byte, only reported
+void test_benchmark_decoder()
+{
+    static uint8_t samples[3 * 0x110];
+    for (size_t i = 0; i < sizeof(samples); i++)
+        samples[i] = i * 37;
+
+    volatile uint8_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 1000; n++)
+    {
+        for (int i = 0; i + 2 < (int)sizeof(samples); i += 2)
+            sink = sink + extract_byte(5, samples[i], samples[i + 1], samples[i + 2]);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int n = 0; n < 1000; n++)
+    {
+        for (int i = 0; i + 2 < (int)sizeof(samples); i += 2)
+            sink = sink + decode_byte<5>(samples[i], samples[i + 1], samples[i + 2]);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double bytes = 1000.0 * (sizeof(samples) / 2);
+    double bitwise = std::chrono::duration<double, std::nano>(middle - start).count() / bytes;
+    double table = std::chrono::duration<double, std::nano>(end - middle).count() / bytes;
+    char str[96];
+    snprintf(str, sizeof(str), "decode per byte: extract_byte %.2fns, table %.2fns", bitwise, table);
+    TEST_MESSAGE(str);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_table_matches_extract_byte_for_every_input);
+    RUN_TEST(test_packets_decode_at_every_shift_and_polarity);
+    RUN_TEST(test_benchmark_decoder);
+    return UNITY_END();
+}
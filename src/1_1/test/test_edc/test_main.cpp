@@ -0,0 +1,128 @@
+// EDC updated while receiving and transmitting, with the CRC table
+
+#define SILICA_CRC_TABLE
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+void test_table_matches_bitwise_update()
+{
+    for (uint32_t crc = 0; crc < 0x10000; crc++)
+    {
+        for (int data = 0; data < 0x100; data++)
+        {
+            if (crc16_update(crc, data) != _crc_xmodem_update(crc, data))
+                TEST_FAIL_MESSAGE("table differs from _crc_xmodem_update()");
+        }
+    }
+}
+
+void test_receive_edc_is_calculated_while_decoding()
+{
+    uint32_t seed = 7;
+    for (int len = 3; len <= PACKET_MAX; len += 4)
+    {
+        std::vector<uint8_t> packet(len);
+        packet[0] = len;
+        for (int i = 1; i < len; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            packet[i] = seed >> 16;
+        }
+
+        link_options_t o;
+        o.shift = len % 8;
+        mock_rx.clear();
+        mock_receive(reader_samples(packet, o));
+
+        int shift;
+        bool invert;
+        TEST_ASSERT_EQUAL(1, capture_sync(shift, invert));
+
+        uint8_t dst[PACKET_MAX + 2];
+        uint16_t edc;
+        TEST_ASSERT_EQUAL(len + 2, receive_packet(shift, invert, dst, edc));
+        TEST_ASSERT_EQUAL_HEX16(reference_crc16(packet.data(), len), edc);
+    }
+}
+
+// send a response and check the EDC decoded from the captured bytes
+//
+// The cycles reported are SPI time of the mock, which charges nothing for
+// the CPU, so they can't show the time saved. On the target, the EDC pass
+// removed from before the first byte took len updates of about 20 to 30
+// cycles each (an estimate, not a measurement: no AVR simulator was at
+// hand), about 6000 cycles or 1.8ms for a 205-byte response at 3.39MHz.
+// Build with SILICA_LATENCY_STATS to measure it on the card: the
+// transmit stage ends with the first byte of the response.
+static void check_response(const response_t &response, int len)
+{
+    mock_tx.clear();
+    uint64_t start = mock_cycles;
+    send_response(&response);
+
+    response_frame_t frame = decode_response(mock_tx);
+    TEST_ASSERT_TRUE(frame.valid);
+    TEST_ASSERT_EQUAL(len, frame.packet.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(response.packet, frame.packet.data(), len - 16 * response.block_count);
+    for (int i = 0; i < response.block_count; i++)
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(response.blocks[i], frame.packet.data() + len - 16 * (response.block_count - i), 16);
+
+    char str[96];
+    snprintf(str, sizeof(str), "%d-byte response: first byte after %d cycles, frame %d cycles",
+             len, (int)(mock_tx_start - start), (int)(mock_cycles - start));
+    TEST_MESSAGE(str);
+}
+
+// the EDC is calculated as bytes are sent
+void test_polling_and_read_responses()
+{
+    uint8_t polling[18] = {18, 0x01};
+    for (int i = 2; i < 18; i++)
+        polling[i] = 0x10 * i;
+    response_t short_response = {polling, 0, {}};
+
+    uint8_t read[13] = {13 + 16 * 12, 0x07};
+    uint8_t blocks[12][16];
+    response_t long_response = {read, 12, {}};
+    for (int i = 0; i < 12; i++)
+    {
+        for (int j = 0; j < 16; j++)
+            blocks[i][j] = 17 * i + j;
+        long_response.blocks[i] = blocks[i];
+    }
+
+    check_response(short_response, 18);
+    check_response(long_response, 205);
+}
+
+void test_read_response_of_12_blocks_over_the_link()
+{
+    uint8_t data[16 * 12];
+    for (int i = 0; i < (int)sizeof(data); i++)
+        data[i] = i * 5;
+    storage_write(data, block_data_eep, sizeof(data));
+
+    response_frame_t response = card_exchange(read_command(0xFFFF, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL(205, response.packet.size());
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data, response.packet.data() + 13, sizeof(data));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_table_matches_bitwise_update);
+    RUN_TEST(test_receive_edc_is_calculated_while_decoding);
+    RUN_TEST(test_polling_and_read_responses);
+    RUN_TEST(test_read_response_of_12_blocks_over_the_link);
+    return UNITY_END();
+}
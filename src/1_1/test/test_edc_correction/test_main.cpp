@@ -0,0 +1,99 @@
+// Correction of single-bit errors with the EDC syndrome
+
+#define SILICA_EDC_CORRECTION
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// packet of len bytes followed by its EDC
+static std::vector<uint8_t> make_packet(int len, uint32_t seed)
+{
+    std::vector<uint8_t> packet(len + 2);
+    packet[0] = len;
+    for (int i = 1; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        packet[i] = seed >> 16;
+    }
+    uint16_t edc = reference_crc16(packet.data(), len);
+    packet[len] = edc >> 8;
+    packet[len + 1] = edc & 0xFF;
+    return packet;
+}
+
+// every bit after the length byte, including the EDC itself
+void test_every_single_bit_error_is_corrected()
+{
+    for (int len : {2, 3, 18, 100, 255})
+    {
+        std::vector<uint8_t> packet = make_packet(len, len);
+        for (int bit = 8; bit < 8 * (len + 2); bit++)
+        {
+            std::vector<uint8_t> received = packet;
+            received[bit / 8] ^= 0x80 >> (bit % 8);
+
+            uint16_t edc = reference_crc16(received.data(), len);
+            TEST_ASSERT_TRUE(verify_edc(received.data(), len, edc));
+
+            // an error in the last bit is accepted as it is
+            int checked = bit == 8 * (len + 2) - 1 ? len : len + 2;
+            TEST_ASSERT_EQUAL_UINT8_ARRAY(packet.data(), received.data(), checked);
+        }
+    }
+}
+
+// CRC16-CCITT has a Hamming distance of 4, so a 2-bit error is never
+// taken for a single-bit error somewhere else
+void test_two_bit_errors_are_rejected()
+{
+    int len = 255;
+    std::vector<uint8_t> packet = make_packet(len, 1);
+    uint32_t seed = 3;
+    for (int n = 0; n < 20000; n++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int bit1 = 8 + (seed >> 8) % (8 * (len + 1));
+        seed = seed * 1103515245 + 12345;
+        int bit2 = 8 + (seed >> 8) % (8 * (len + 1));
+        if (bit1 == bit2)
+            continue;
+
+        std::vector<uint8_t> received = packet;
+        received[bit1 / 8] ^= 0x80 >> (bit1 % 8);
+        received[bit2 / 8] ^= 0x80 >> (bit2 % 8);
+
+        uint16_t edc = reference_crc16(received.data(), len);
+        TEST_ASSERT_FALSE(verify_edc(received.data(), len, edc));
+    }
+}
+
+// a bit error over the link is corrected and counted
+void test_corrected_frame_is_answered()
+{
+    uint16_t corrected = corrected_frames;
+
+    link_options_t o;
+    o.shift = 5;
+    // both halves of the first bit of the system code
+    o.flips = {16 * (8 + 2), 16 * (8 + 2) + 1};
+    response_frame_t response = card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00}, o);
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL(corrected + 1, corrected_frames);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_single_bit_error_is_corrected);
+    RUN_TEST(test_two_bit_errors_are_rejected);
+    RUN_TEST(test_corrected_frame_is_answered);
+    return UNITY_END();
+}
@@ -0,0 +1,115 @@
+// EEPROM endurance under a realistic write mix
+//
+// Every tap powers the card up, polls it, reads 4 blocks and writes a
+// hot block with a new value. Every 10th tap also writes a cold block,
+// and every tap sends 2 commands that fail and go to the error log.
+// The card leaves the field with a supply drop, which writes back the
+// cache. The wear counts of the mock give the writes per cell and tap,
+// and the projected lifetime at 100k erase/write cycles per cell.
+// Written in place, the hot block would cost one write per tap, 100k
+// taps; the journal must spread it over its slots.
+
+#include <algorithm>
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+static constexpr uint32_t EEPROM_ENDURANCE = 100000;
+static constexpr int TAPS = 1000;
+
+// the highest wear of the EEPROM cells in a range
+static uint32_t max_wear(int offset, int len)
+{
+    uint32_t wear = 0;
+    for (int i = offset; i < offset + len; i++)
+        wear = std::max(wear, mock_eeprom_wear[i]);
+    return wear;
+}
+
+static void report(const char *name, uint32_t wear)
+{
+    char message[120];
+    if (wear == 0)
+        snprintf(message, sizeof(message), "%-10s not written", name);
+    else
+        snprintf(message, sizeof(message), "%-10s %.2f writes per tap, %lu taps of lifetime", name,
+                 (double)wear / TAPS, (unsigned long)((uint64_t)EEPROM_ENDURANCE * TAPS / wear));
+    TEST_MESSAGE(message);
+}
+
+static void tap(int n)
+{
+    card_power_cycle();
+    card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00});
+    card_exchange(read_command(0x000B, {0, 1, 2, 3}));
+
+    std::vector<uint8_t> hot(16, 0x00);
+    hot[0] = n;
+    hot[1] = n >> 8;
+    card_exchange(write_command(0x0009, {1}, hot));
+
+    if (n % 10 == 0)
+        card_exchange(write_command(0x0009, {5}, std::vector<uint8_t>(16, n / 10)));
+
+    // an unknown command and a read of an unknown service, which differ
+    // from tap to tap
+    std::vector<uint8_t> unknown = {0, 0x7E};
+    std::vector<uint8_t> id = card_idm();
+    unknown.insert(unknown.end(), id.begin(), id.end());
+    unknown.push_back(n);
+    unknown[0] = unknown.size();
+    card_exchange(unknown);
+    card_exchange(read_command(0x1008 + 0x40 * (n % 16), {0}));
+
+    mock_supply_drop();
+}
+
+void test_write_mix()
+{
+    // the wear of setting up the card is not counted
+    memset(mock_eeprom_wear, 0, sizeof(mock_eeprom_wear));
+    memset(mock_flash_wear, 0, sizeof(mock_flash_wear));
+
+    for (int n = 1; n <= TAPS; n++)
+        tap(n);
+
+    int blocks = mock_eeprom_address(block_data_eep);
+    int errors = mock_eeprom_address(last_error_eep);
+    uint32_t hot = max_wear(blocks + 16, 16);
+    uint32_t cold = max_wear(blocks + 16 * 5, 16);
+    uint32_t error_log = max_wear(errors, sizeof(last_error_eep));
+    uint32_t journal = max_wear(mock_eeprom_address(journal_eep), sizeof(journal_eep));
+    uint32_t settings = mock_flash_wear[(FLASH_DATA_START + IDM_DATA_OFFSET) / PROGMEM_PAGE_SIZE];
+
+    report("hot block", hot);
+    report("cold block", cold);
+    report("error log", error_log);
+    report("journal", journal);
+
+    // the hot block and the error log change a byte or two per tap and
+    // go to the journal, which lasts at least twice as long as the hot
+    // block written in place
+    uint32_t worst = std::max({hot, error_log, journal});
+    TEST_ASSERT_LESS_OR_EQUAL(TAPS / 2, worst);
+
+    // the cold block changes 16 bytes and is written in place
+    TEST_ASSERT_LESS_OR_EQUAL(TAPS / 10, cold);
+
+    // IDm, PMm and the code tables are never rewritten unchanged
+    TEST_ASSERT_EQUAL(0, settings);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_write_mix);
+    return UNITY_END();
+}
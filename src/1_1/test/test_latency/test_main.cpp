@@ -0,0 +1,84 @@
+// Latency statistics in blocks F0h-FBh and on serial
+
+#define SILICA_LATENCY_STATS
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+static uint16_t get16(const std::vector<uint8_t> &packet, int offset)
+{
+    return packet[offset] | (packet[offset + 1] << 8);
+}
+
+void test_polling_latency_is_recorded()
+{
+    const int POLLS = 10;
+    for (int i = 0; i < POLLS; i++)
+        TEST_ASSERT_TRUE(card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x00, 0x03}).valid);
+
+    // min/max of command code 00h and the histogram of each stage
+    response_frame_t response = card_exchange(read_command(0xFFFF, {0xF0, 0xF8, 0xF9, 0xFA, 0xFB}));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL(13 + 16 * 5, response.packet.size());
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        uint16_t min = get16(response.packet, 13 + 4 * stage);
+        uint16_t max = get16(response.packet, 15 + 4 * stage);
+        TEST_ASSERT_LESS_OR_EQUAL(max, min);
+        TEST_ASSERT_NOT_EQUAL(0xFFFF, min);
+    }
+
+    // the response starts in one of 4 time slots after the Polling delay
+    uint16_t transmit_min = get16(response.packet, 13 + 4 * LATENCY_TRANSMIT);
+    uint16_t transmit_max = get16(response.packet, 15 + 4 * LATENCY_TRANSMIT);
+    TEST_ASSERT_GREATER_OR_EQUAL(POLLING_DELAY - TRANSMIT_LATENCY, transmit_min);
+    TEST_ASSERT_LESS_THAN(POLLING_DELAY + 4 * TIME_SLOT, transmit_max);
+
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        int count = 0;
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+            count += get16(response.packet, 29 + 16 * stage + 2 * bucket);
+        TEST_ASSERT_EQUAL(POLLS, count);
+    }
+
+    // the 4 time slots span 4096 to 12288 ticks, buckets 5 and 6
+    int slots = get16(response.packet, 29 + 16 * LATENCY_TRANSMIT + 2 * 5) +
+                get16(response.packet, 29 + 16 * LATENCY_TRANSMIT + 2 * 6);
+    TEST_ASSERT_EQUAL(POLLS, slots);
+
+    // reading block F0h dumps the statistics to serial
+    TEST_ASSERT_TRUE(mock_serial_output.find("00: ") != std::string::npos);
+    TEST_ASSERT_TRUE(mock_serial_output.find("S3: ") != std::string::npos);
+    TEST_ASSERT_TRUE(mock_serial_output.find("SPI headroom") != std::string::npos);
+}
+
+void test_unused_command_codes_stay_empty()
+{
+    TEST_ASSERT_TRUE(card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x00, 0x03}).valid);
+
+    response_frame_t response = card_exchange(read_command(0xFFFF, {0xF1}));
+    TEST_ASSERT_TRUE(response.valid);
+    for (int stage = 0; stage < LATENCY_STAGES; stage++)
+    {
+        TEST_ASSERT_EQUAL_HEX16(0xFFFF, get16(response.packet, 13 + 4 * stage));
+        TEST_ASSERT_EQUAL_HEX16(0x0000, get16(response.packet, 15 + 4 * stage));
+    }
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_polling_latency_is_recorded);
+    RUN_TEST(test_unused_command_codes_stay_empty);
+    return UNITY_END();
+}
@@ -0,0 +1,119 @@
+// Receive and transmit through the mocked SPI0 and CCL
+// frames from the bitstream generator at every bit shift and polarity,
+// and a response the CPU falls behind on
+
+#include <unity.h>
+#include "card.h"
+
+// Polling for any system code, requesting the system code
+static const std::vector<uint8_t> POLLING = {0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00};
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// Polling response of the erased card
+static void check_polling_response(const response_frame_t &response)
+{
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL(20, response.packet.size());
+    TEST_ASSERT_EQUAL_HEX8(0x01, response.packet[1]);
+    for (int i = 2; i < 18; i++)
+        TEST_ASSERT_EQUAL_HEX8(0xFF, response.packet[i]);
+}
+
+void test_polling_at_every_shift_and_polarity()
+{
+    for (int invert = 0; invert < 2; invert++)
+    {
+        for (int shift = 0; shift < 8; shift++)
+        {
+            link_options_t o;
+            o.shift = shift;
+            o.invert = invert;
+            check_polling_response(card_exchange(POLLING, o));
+        }
+    }
+}
+
+void test_noise_before_the_frame_is_ignored()
+{
+    // a short burst between idle bytes and a damaged start of the preamble
+    mock_receive({0x00, 0x24, 0x81, 0x00});
+    link_options_t o;
+    o.shift = 3;
+    o.flips = {1, 6, 17};
+    mock_rx_idle = 0x00;
+    std::vector<uint8_t> samples = reader_samples(POLLING, o);
+    mock_receive(samples);
+    try
+    {
+        loop();
+    }
+    catch (const mock_idle_t &)
+    {
+    }
+    check_polling_response(decode_response(mock_tx));
+}
+
+void test_bit_error_in_the_packet_is_rejected()
+{
+    for (int shift = 0; shift < 8; shift++)
+    {
+        link_options_t o;
+        o.shift = shift;
+        // both halves of the first bit of the system code
+        o.flips = {16 * (8 + 2), 16 * (8 + 2) + 1};
+        TEST_ASSERT_FALSE(card_exchange(POLLING, o).valid);
+    }
+}
+
+void test_frame_without_sync_is_not_answered()
+{
+    // preamble only
+    mock_receive(pack_bits(manchester_bits({0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}), 0));
+    mock_receive({0x00, 0x00, 0x00});
+    try
+    {
+        loop();
+    }
+    catch (const mock_idle_t &)
+    {
+    }
+    TEST_ASSERT_TRUE(mock_tx.empty());
+}
+
+// the CPU held up in the middle of a response, by more than the byte the
+// SPI buffers, breaks the modulation and is reported
+void test_transmit_underrun_is_reported()
+{
+    check_polling_response(card_exchange(POLLING));
+    TEST_ASSERT_EQUAL(std::string::npos, mock_serial_output.find("Transmit underrun"));
+
+    mock_tx_stall_at = 20;
+    mock_tx_stall_cycles = 2 * mock_sck_byte();
+    card_exchange(POLLING);
+    TEST_ASSERT_NOT_EQUAL(std::string::npos, mock_serial_output.find("Transmit underrun"));
+}
+
+void test_eemem_variables_fill_the_eeprom()
+{
+    TEST_ASSERT_EQUAL(EEPROM_SIZE, __stop_mock_eemem - __start_mock_eemem);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_polling_at_every_shift_and_polarity);
+    RUN_TEST(test_noise_before_the_frame_is_ignored);
+    RUN_TEST(test_bit_error_in_the_packet_is_rejected);
+    RUN_TEST(test_frame_without_sync_is_not_answered);
+    RUN_TEST(test_transmit_underrun_is_reported);
+    RUN_TEST(test_eemem_variables_fill_the_eeprom);
+    return UNITY_END();
+}
@@ -0,0 +1,286 @@
+// Lite-S MAC_A and the write count with SILICA_MAC_A
+//
+// The DES vector is the worked example of FIPS 81. The two-key
+// Triple-DES vectors were computed with DES3 of PyCryptodome, which
+// shares no code with mac.cpp, for the FIPS 81 plaintext under the keys
+// K1 = 0123456789ABCDEF and K2 = FEDCBA9876543210, in both key orders.
+//
+// No published MAC_A example of Lite-S was at hand, so the MAC_A vectors
+// are not independent: they come from a model of the Lite-S description
+// in mac.cpp, built on the Triple-DES of OpenSSL (des-ede-cbc), with
+// 8-byte units reversed into DES byte order, the session key as the CBC
+// encryption of RC under CK, and the MAC as the CBC-MAC from RC1 with
+// SK1/SK2, swapped for writing. They catch regressions, not a misreading
+// of the description; replace them with vectors from a real card or
+// reader library when one is available.
+
+#define SILICA_MAC_A
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+static const uint8_t CK[16] = {
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F};
+static const uint8_t RC[16] = {
+    0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF,
+    0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10};
+
+// MAC_A of reading block 00h, holding A0h to AFh, and MAC_A
+static const uint8_t READ_MAC[8] = {0xD8, 0xD6, 0x36, 0xFC, 0x29, 0x7A, 0x15, 0x72};
+
+// MAC_A of writing 30h to 3Fh to block 00h at WCNT 123456h
+static const uint32_t WRITE_WCNT = 0x123456;
+static const uint8_t WRITE_MAC[8] = {0x22, 0x79, 0x2D, 0xB1, 0x64, 0x7E, 0x11, 0x8D};
+
+// 8 bytes in reverse order, between DES and card byte order
+static void reverse8(const uint8_t *src, uint8_t *dst)
+{
+    for (int i = 0; i < 8; i++)
+        dst[i] = src[7 - i];
+}
+
+static std::vector<uint8_t> bytes(const uint8_t *data, int len)
+{
+    return std::vector<uint8_t>(data, data + len);
+}
+
+static std::vector<uint8_t> counting(uint8_t first)
+{
+    std::vector<uint8_t> data(16);
+    for (int i = 0; i < 16; i++)
+        data[i] = first + i;
+    return data;
+}
+
+// status flag 2 of a write
+static uint8_t write_status(const std::vector<uint8_t> &blocks, const std::vector<uint8_t> &data)
+{
+    response_frame_t response = card_exchange(write_command(0x0009, blocks, data));
+    TEST_ASSERT_TRUE(response.valid);
+    return response.packet[11];
+}
+
+// WCNT read from block 90h
+static uint32_t read_wcnt()
+{
+    response_frame_t response = card_exchange(read_command(0x000B, {0x90}));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[11]);
+    const uint8_t *block = &response.packet[13];
+    return block[0] | (block[1] << 8) | (block[2] << 16);
+}
+
+// power up with a counter record in the user row
+static void power_up_with_wcnt(uint32_t count)
+{
+    mock_reset();
+    uint8_t record[4] = {(uint8_t)count, (uint8_t)(count >> 8), (uint8_t)(count >> 16)};
+    record[3] = counter_crc(record);
+    memcpy(mock_userrow, record, 4);
+    mock_nvm_command(NVMCTRL_CMD_PAGEERASEWRITE_gc);
+    setup();
+}
+
+// single DES is Triple-DES with both keys equal
+void test_des_known_answer()
+{
+    static const uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
+    static const uint8_t plain[8] = {0x4E, 0x6F, 0x77, 0x20, 0x69, 0x73, 0x20, 0x74};
+    static const uint8_t cipher[8] = {0x3F, 0xA4, 0x0E, 0x8A, 0x98, 0x4D, 0x48, 0x15};
+
+    uint8_t card_key[8];
+    uint8_t data[8];
+    uint8_t expected[8];
+    reverse8(key, card_key);
+    reverse8(plain, data);
+    reverse8(cipher, expected);
+
+    expand_key(card_key, schedule[0]);
+    expand_key(card_key, schedule[1]);
+    triple_des(data, 0);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, data, 8);
+}
+
+// two different keys, the second one decrypts; swapped for writing
+void test_two_key_triple_des_known_answer()
+{
+    static const uint8_t key1[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
+    static const uint8_t key2[8] = {0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10};
+    static const uint8_t plain[8] = {0x4E, 0x6F, 0x77, 0x20, 0x69, 0x73, 0x20, 0x74};
+    static const uint8_t cipher[2][8] = {
+        {0xD8, 0x0A, 0x0D, 0x8B, 0x2B, 0xAE, 0x5E, 0x4E},
+        {0xF5, 0x66, 0xF4, 0xC1, 0xC3, 0xC6, 0x67, 0xC0}};
+
+    uint8_t card_key[8];
+    reverse8(key1, card_key);
+    expand_key(card_key, schedule[0]);
+    reverse8(key2, card_key);
+    expand_key(card_key, schedule[1]);
+
+    for (int first = 0; first < 2; first++)
+    {
+        uint8_t data[8];
+        uint8_t expected[8];
+        reverse8(plain, data);
+        reverse8(cipher[first], expected);
+        triple_des(data, first);
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(expected, data, 8);
+    }
+}
+
+// decryption undoes the encryption for every byte value in the state
+void test_des_round_trip()
+{
+    static const uint8_t key[8] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF};
+    expand_key(key, schedule[0]);
+    expand_key(key, schedule[1]);
+
+    // the subkeys in reverse order decrypt
+    for (int x = 0; x < 256; x++)
+    {
+        uint8_t data[8];
+        memset(data, x, 8);
+        data[x % 8] ^= 0x80;
+        uint8_t original[8];
+        memcpy(original, data, 8);
+
+        triple_des(data, 0);
+        TEST_ASSERT_TRUE(memcmp(data, original, 8) != 0);
+
+        key_schedule_t saved;
+        memcpy(saved, schedule[0], sizeof(saved));
+        for (int round = 0; round < 16; round++)
+        {
+            memcpy(schedule[0][round], saved[15 - round], sizeof(saved[0]));
+            memcpy(schedule[1][round], saved[15 - round], sizeof(saved[0]));
+        }
+        triple_des(data, 0);
+        memcpy(schedule[0], saved, sizeof(saved));
+        memcpy(schedule[1], saved, sizeof(saved));
+        TEST_ASSERT_EQUAL_HEX8_ARRAY(original, data, 8);
+    }
+}
+
+void test_read_mac_vector()
+{
+    mac_start_session(CK, RC);
+    mac_begin(false);
+    static const uint8_t block_nums[8] = {0x00, 0x00, 0x91, 0x00, 0xFF, 0xFF, 0xFF, 0xFF};
+    std::vector<uint8_t> data = counting(0xA0);
+    mac_update(block_nums);
+    mac_update(data.data());
+    mac_update(data.data() + 8);
+
+    uint8_t mac[8];
+    mac_end(mac);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(READ_MAC, mac, 8);
+}
+
+// CK, RC and the blocks through the link, WCNT from the user row
+void test_mac_a_over_the_link()
+{
+    // 3 writes before the one with MAC_A
+    power_up_with_wcnt(WRITE_WCNT - 3);
+    TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x87}, bytes(CK, 16)));
+    TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x00}, counting(0xA0)));
+    TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x80}, bytes(RC, 16)));
+    TEST_ASSERT_EQUAL_HEX32(WRITE_WCNT, read_wcnt());
+
+    response_frame_t response = card_exchange(read_command(0x000B, {0x00, 0x91}));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[11]);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(READ_MAC, &response.packet[13 + 16], 8);
+
+    std::vector<uint8_t> data = counting(0x30);
+    data.insert(data.end(), WRITE_MAC, WRITE_MAC + 8);
+    data.resize(32, 0x00);
+    TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x00, 0x91}, data));
+    TEST_ASSERT_EQUAL_HEX32(WRITE_WCNT + 1, read_wcnt());
+
+    // the same write again is refused, WCNT has moved on
+    TEST_ASSERT_EQUAL_HEX8(0xA9, write_status({0x00, 0x91}, data));
+}
+
+// MAC_A of a write at the current WCNT, computed by the card's own engine
+static std::vector<uint8_t> write_with_mac(const std::vector<uint8_t> &block, uint32_t count)
+{
+    uint8_t unit[8] = {(uint8_t)count, (uint8_t)(count >> 8), (uint8_t)(count >> 16), 0x00, 0x00, 0x00, 0x91, 0x00};
+    mac_begin(true);
+    mac_update(unit);
+    mac_update(block.data());
+    mac_update(block.data() + 8);
+
+    std::vector<uint8_t> data = block;
+    data.resize(32, 0x00);
+    mac_end(&data[16]);
+    return data;
+}
+
+// a write accepted before a power loss can't be replayed after it
+void test_wcnt_never_goes_back()
+{
+    TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x87}, bytes(CK, 16)));
+    for (int i = 0; i < 40; i++)
+    {
+        TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x80}, bytes(RC, 16)));
+        uint32_t count = read_wcnt();
+        std::vector<uint8_t> data = write_with_mac(counting(i), count);
+        TEST_ASSERT_EQUAL_HEX8(0x00, write_status({0x00, 0x91}, data));
+
+        // no write-back of the EEPROM cache
+        card_power_cycle();
+        TEST_ASSERT_GREATER_THAN(count, read_wcnt());
+    }
+}
+
+// the newest record is lost if its write is cut short
+void test_torn_record_falls_back()
+{
+    power_up_with_wcnt(100);
+    storage_write_counter(200);
+    storage_write_counter(300);
+    TEST_ASSERT_EQUAL(300, storage_read_counter());
+
+    // the record of 300 is in the third slot
+    mock_userrow[2 * 4 + 1] ^= 0x01;
+    TEST_ASSERT_EQUAL(200, storage_read_counter());
+
+    // and the next record goes after the valid one
+    storage_write_counter(400);
+    TEST_ASSERT_EQUAL(400, storage_read_counter());
+    TEST_ASSERT_EQUAL_HEX8(400 & 0xFF, mock_userrow[2 * 4]);
+}
+
+// records go round the user row, each cell is written once every 8 records
+void test_journal_wear_is_spread()
+{
+    for (uint32_t value = 1; value <= 800; value++)
+        storage_write_counter(value);
+    TEST_ASSERT_EQUAL(800, storage_read_counter());
+
+    for (int i = 0; i < USER_SIGNATURES_SIZE; i++)
+        TEST_ASSERT_LESS_OR_EQUAL(100, mock_userrow_wear[i]);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_des_known_answer);
+    RUN_TEST(test_two_key_triple_des_known_answer);
+    RUN_TEST(test_des_round_trip);
+    RUN_TEST(test_read_mac_vector);
+    RUN_TEST(test_mac_a_over_the_link);
+    RUN_TEST(test_wcnt_never_goes_back);
+    RUN_TEST(test_torn_record_falls_back);
+    RUN_TEST(test_journal_wear_is_spread);
+    return UNITY_END();
+}
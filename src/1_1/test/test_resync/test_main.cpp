@@ -0,0 +1,125 @@
+// Bit slip recovery of the decoder with SILICA_RESYNC
+
+#define SILICA_RESYNC
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// received bytes joined the way the AVR does it without widening them:
+// uint8_t is promoted to the 16-bit int, data << 8 is negative from 0x80 on
+// and is sign-extended when it is converted to uint32_t
+static uint32_t join_with_16_bit_int(uint8_t data0, uint8_t data1, uint8_t data2, uint8_t data3)
+{
+    int16_t shifted = (int16_t)(uint16_t)(data2 << 8);
+    return ((uint32_t)data0 << 24) | ((uint32_t)data1 << 16) | (uint32_t)(int32_t)shifted | data3;
+}
+
+// every byte stays in its place whatever its top bit
+void test_samples_are_not_sign_extended()
+{
+    const uint8_t others[] = {0x00, 0x55, 0xA6, 0xFF};
+    for (int data2 = 0; data2 < 256; data2++)
+    {
+        for (uint8_t x : others)
+        {
+            uint32_t samples = join_samples(x, x ^ 0x0F, data2, x ^ 0xF0);
+            TEST_ASSERT_EQUAL_HEX8(x, samples >> 24);
+            TEST_ASSERT_EQUAL_HEX8(x ^ 0x0F, (samples >> 16) & 0xFF);
+            TEST_ASSERT_EQUAL_HEX8(data2, (samples >> 8) & 0xFF);
+            TEST_ASSERT_EQUAL_HEX8(x ^ 0xF0, samples & 0xFF);
+
+            // the model shows what the cast prevents
+            uint32_t unwidened = join_with_16_bit_int(x, x ^ 0x0F, data2, x ^ 0xF0);
+            if (data2 < 0x80)
+                TEST_ASSERT_EQUAL_HEX32(samples, unwidened);
+            else
+                TEST_ASSERT_EQUAL_HEX32(samples | 0xFFFF0000, unwidened);
+        }
+    }
+}
+
+// the second half of the sync code decides the polarity: its bytes have
+// the top bit set at several shifts, which the model above would corrupt
+void test_every_shift_and_polarity_is_received()
+{
+    for (int shift = 0; shift < 8; shift++)
+    {
+        for (bool invert : {false, true})
+        {
+            link_options_t o;
+            o.shift = shift;
+            o.invert = invert;
+            response_frame_t response = card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00}, o);
+            TEST_ASSERT_TRUE(response.valid);
+            TEST_ASSERT_EQUAL(0x01, response.packet[1]);
+        }
+    }
+}
+
+// one sample inserted or deleted at every point of a write command,
+// at every shift and polarity
+//
+// A slip is only seen at the next transition of the data, and the bits in
+// between are decoded complemented, so not every frame can be saved.
+// Without SILICA_RESYNC, none is. The floors keep the rates measured when
+// the test was written, about 65% of insertions and 22% of deletions.
+void test_slips_in_packet_are_followed()
+{
+    std::vector<uint8_t> data(16);
+    for (int i = 0; i < 16; i++)
+        data[i] = i * 37 + 11;
+    std::vector<uint8_t> packet = write_command(0x0009, {0}, data);
+
+    // the first sample of the length byte, after preamble and sync code
+    const int packet_start = 16 * 8;
+
+    int frames = 0;
+    int repeated = 0;
+    int dropped = 0;
+    for (int shift = 0; shift < 8; shift++)
+    {
+        for (bool invert : {false, true})
+        {
+            // from the second byte, a slip in the length byte can't be told
+            // from a different length
+            for (int slip = 16; slip < 16 * (int)packet.size(); slip++)
+            {
+                link_options_t o;
+                o.shift = shift;
+                o.invert = invert;
+                o.repeats = {packet_start + slip};
+                repeated += card_exchange(packet, o).valid;
+
+                o.repeats.clear();
+                o.drops = {packet_start + slip};
+                dropped += card_exchange(packet, o).valid;
+
+                frames++;
+            }
+        }
+    }
+
+    char message[80];
+    snprintf(message, sizeof(message), "received %d of %d with an inserted sample, %d with a deleted one",
+             repeated, frames, dropped);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_GREATER_OR_EQUAL(frames * 60 / 100, repeated);
+    TEST_ASSERT_GREATER_OR_EQUAL(frames * 20 / 100, dropped);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_samples_are_not_sign_extended);
+    RUN_TEST(test_every_shift_and_polarity_is_received);
+    RUN_TEST(test_slips_in_packet_are_followed);
+    return UNITY_END();
+}
@@ -0,0 +1,228 @@
+// Serial command channel: frames are answered between RF frames, an RF
+// frame is not slowed down by a serial frame, and a serial frame that
+// loses bytes or its buffer is dropped and resent
+
+#define SILICA_UART_COMMANDS
+#include <unity.h>
+#include "card.h"
+
+// Polling for any system code, requesting the system code or not
+static const std::vector<uint8_t> POLLING = {0x06, 0x00, 0xFF, 0xFF, 0x01, 0x00};
+static const std::vector<uint8_t> POLLING_NO_REQUEST = {0x06, 0x00, 0xFF, 0xFF, 0x00, 0x00};
+
+// cycles a byte takes at 230400bps
+static const uint32_t SERIAL_BYTE_CYCLES = 10 * MOCK_FCLK / 230400;
+
+void setUp()
+{
+    card_reset();
+    memset(link_stats, 0, sizeof(link_stats));
+}
+
+void tearDown()
+{
+}
+
+// frame of the serial channel, see uart.py
+static std::vector<uint8_t> serial_frame(uint8_t type, const std::vector<uint8_t> &payload)
+{
+    std::vector<uint8_t> body = {type, (uint8_t)payload.size()};
+    body.insert(body.end(), payload.begin(), payload.end());
+    uint16_t crc = reference_crc16(body.data(), body.size());
+
+    std::vector<uint8_t> frame = {0xA5};
+    frame.insert(frame.end(), body.begin(), body.end());
+    frame.push_back(crc >> 8);
+    frame.push_back(crc & 0xFF);
+    return frame;
+}
+
+struct serial_answer_t
+{
+    uint8_t type;
+    std::vector<uint8_t> payload;
+};
+
+// frames with a valid CRC in the serial output, skipping log messages
+static std::vector<serial_answer_t> serial_answers()
+{
+    std::vector<uint8_t> out(mock_serial_output.begin(), mock_serial_output.end());
+    std::vector<serial_answer_t> answers;
+    for (size_t i = 0; i + 5 <= out.size(); i++)
+    {
+        size_t len = out[i + 2];
+        if (out[i] != 0xA5 || i + 5 + len > out.size())
+            continue;
+        uint16_t crc = (out[i + 3 + len] << 8) | out[i + 4 + len];
+        if (crc != reference_crc16(&out[i + 1], len + 2))
+            continue;
+        answers.push_back({out[i + 1], std::vector<uint8_t>(&out[i + 3], &out[i + 3 + len])});
+        i += 4 + len;
+    }
+    return answers;
+}
+
+// run the main loop for about the given time while no RF frame arrives
+static void run_idle(uint32_t cycles)
+{
+    uint64_t end = mock_cycles + cycles;
+    while (mock_cycles < end)
+    {
+        mock_receive({});
+        mock_idle_limit = (end - mock_cycles) / mock_sck_byte() + 1;
+        try
+        {
+            loop();
+        }
+        catch (const mock_idle_t &)
+        {
+        }
+    }
+    mock_idle_limit = 1024;
+}
+
+// send a frame over serial and collect the answers
+static std::vector<serial_answer_t> serial_exchange(const std::vector<uint8_t> &frame)
+{
+    mock_serial_output.clear();
+    mock_serial_receive(frame);
+    run_idle(SERIAL_BYTE_CYCLES * (frame.size() + 300));
+    return serial_answers();
+}
+
+void test_command_is_answered()
+{
+    std::vector<serial_answer_t> answers = serial_exchange(serial_frame('C', POLLING));
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('R', answers[0].type);
+    TEST_ASSERT_EQUAL(20, answers[0].payload.size());
+    TEST_ASSERT_EQUAL_HEX8(0x01, answers[0].payload[1]);
+}
+
+void test_bad_crc_is_answered_with_an_error()
+{
+    std::vector<uint8_t> frame = serial_frame('C', POLLING);
+    frame.back() ^= 1;
+    std::vector<serial_answer_t> answers = serial_exchange(frame);
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('E', answers[0].type);
+    TEST_ASSERT_EQUAL(1, link_stats[LINK_SERIAL_ERRORS]);
+}
+
+void test_serial_frame_cut_by_an_rf_frame_is_dropped()
+{
+    std::vector<uint8_t> frame = serial_frame('C', POLLING_NO_REQUEST);
+    mock_serial_output.clear();
+    mock_serial_receive(frame);
+
+    // the USART interrupts are masked during the RF frame, so bytes are
+    // lost, but the RF frame is received and answered
+    response_frame_t response = card_exchange(POLLING);
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL(20, response.packet.size());
+    TEST_ASSERT_GREATER_THAN(0, mock_serial_overruns);
+
+    // the rest of the serial frame is skipped, the host retries
+    run_idle(SERIAL_BYTE_CYCLES * (frame.size() + 300));
+    TEST_ASSERT_EQUAL(0, serial_answers().size());
+    TEST_ASSERT_EQUAL(1, link_stats[LINK_SERIAL_ERRORS]);
+
+    std::vector<serial_answer_t> answers = serial_exchange(frame);
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('R', answers[0].type);
+    TEST_ASSERT_EQUAL(18, answers[0].payload.size());
+}
+
+void test_rf_frame_discards_a_pending_serial_frame()
+{
+    std::vector<uint8_t> frame = serial_frame('C', POLLING_NO_REQUEST);
+    mock_serial_output.clear();
+    mock_serial_receive(frame);
+    for (size_t i = 0; i <= frame.size(); i++)
+        mock_advance(SERIAL_BYTE_CYCLES);
+    TEST_ASSERT_TRUE(serial_frame_ready);
+
+    // an RF frame starting right away is received into the command
+    // buffer, which holds the serial frame
+    link_options_t o;
+    o.idle_before = 0;
+    mock_receive(reader_samples(POLLING, o));
+    uint8_t *command = receive_command();
+    serial_resume();
+    TEST_ASSERT_NOT_NULL(command);
+    TEST_ASSERT_EQUAL_HEX8(0x01, command[4]);
+    TEST_ASSERT_FALSE(serial_frame_ready);
+    TEST_ASSERT_EQUAL(1, link_stats[LINK_SERIAL_ERRORS]);
+
+    // the host retries
+    run_idle(SERIAL_BYTE_CYCLES * 100);
+    TEST_ASSERT_EQUAL(0, serial_answers().size());
+    std::vector<serial_answer_t> answers = serial_exchange(frame);
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('R', answers[0].type);
+    TEST_ASSERT_EQUAL(18, answers[0].payload.size());
+}
+
+void test_noise_keeps_the_serial_channel()
+{
+    std::vector<uint8_t> frame = serial_frame('C', POLLING);
+    mock_serial_output.clear();
+    mock_serial_receive(frame);
+
+    // short bursts between idle bytes mask the USART interrupts until
+    // the next idle byte, too briefly for the receiver to overflow
+    uint64_t end = mock_cycles + SERIAL_BYTE_CYCLES * (frame.size() + 300);
+    while (mock_cycles < end)
+    {
+        mock_receive({0x24, 0x81});
+        mock_idle_limit = 16;
+        try
+        {
+            loop();
+        }
+        catch (const mock_idle_t &)
+        {
+        }
+    }
+    mock_idle_limit = 1024;
+
+    std::vector<serial_answer_t> answers = serial_answers();
+    TEST_ASSERT_EQUAL(0, mock_serial_overruns);
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('R', answers[0].type);
+    TEST_ASSERT_EQUAL(20, answers[0].payload.size());
+    TEST_ASSERT_EQUAL(0, link_stats[LINK_SERIAL_ERRORS]);
+}
+
+void test_overflow_drops_the_serial_frame()
+{
+    std::vector<uint8_t> frame = serial_frame('C', POLLING);
+    mock_serial_output.clear();
+    mock_serial_receive(frame);
+
+    // a long burst of noise: bytes are lost, the frame is not answered
+    mock_advance(SERIAL_BYTE_CYCLES * 4);
+    std::vector<uint8_t> noise(16, 0x24);
+    noise.push_back(0x00);
+    mock_receive(noise);
+    run_idle(SERIAL_BYTE_CYCLES * (frame.size() + 300));
+    TEST_ASSERT_GREATER_THAN(0, mock_serial_overruns);
+    TEST_ASSERT_EQUAL(0, serial_answers().size());
+    TEST_ASSERT_EQUAL(1, link_stats[LINK_SERIAL_ERRORS]);
+
+    std::vector<serial_answer_t> answers = serial_exchange(frame);
+    TEST_ASSERT_EQUAL(1, answers.size());
+    TEST_ASSERT_EQUAL_HEX8('R', answers[0].type);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_command_is_answered);
+    RUN_TEST(test_bad_crc_is_answered_with_an_error);
+    RUN_TEST(test_serial_frame_cut_by_an_rf_frame_is_dropped);
+    RUN_TEST(test_rf_frame_discards_a_pending_serial_frame);
+    RUN_TEST(test_noise_keeps_the_serial_channel);
+    RUN_TEST(test_overflow_drops_the_serial_frame);
+    return UNITY_END();
+}
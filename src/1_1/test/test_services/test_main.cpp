@@ -0,0 +1,100 @@
+// Access to the services listed in SER_C through the node index
+
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// write SER_C through the wildcard service, little endian codes
+static void set_service_codes(const std::vector<uint16_t> &codes)
+{
+    std::vector<uint8_t> block(16, 0xFF);
+    for (size_t i = 0; i < codes.size(); i++)
+    {
+        block[2 * i] = codes[i] & 0xFF;
+        block[2 * i + 1] = codes[i] >> 8;
+    }
+    response_frame_t response = card_exchange(write_command(0xFFFF, {0x84}, block));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[11]);
+}
+
+// status flag 2 of a command
+static uint8_t status_of(const std::vector<uint8_t> &command)
+{
+    response_frame_t response = card_exchange(command);
+    TEST_ASSERT_TRUE(response.valid);
+    return response.packet[11];
+}
+
+// the setup for Amusement IC in the README
+void test_listed_area_is_readable()
+{
+    set_service_codes({0x0000, 0x000B});
+    TEST_ASSERT_EQUAL_HEX8(0x00, status_of(read_command(0x0000, {0})));
+    TEST_ASSERT_EQUAL_HEX8(0x00, status_of(read_command(0x000B, {0, 1})));
+
+    // and stays readable after a power cycle
+    mock_supply_drop();
+    card_power_cycle();
+    TEST_ASSERT_EQUAL_HEX8(0x00, status_of(read_command(0x0000, {0})));
+}
+
+// writes follow the attribute: an area is not writable
+void test_listed_area_is_not_writable()
+{
+    set_service_codes({0x0000, 0x000B});
+    std::vector<uint8_t> data(16, 0x42);
+    TEST_ASSERT_EQUAL_HEX8(0xA5, status_of(write_command(0x0000, {0}, data)));
+    TEST_ASSERT_EQUAL_HEX8(0x00, status_of(write_command(0x0009, {0}, data)));
+}
+
+// codes not in SER_C or the built-in nodes are still rejected
+void test_unlisted_code_is_rejected()
+{
+    set_service_codes({0x000B});
+    TEST_ASSERT_EQUAL_HEX8(0xA6, status_of(read_command(0x0000, {0})));
+    TEST_ASSERT_EQUAL_HEX8(0xA6, status_of(read_command(0x1008, {0})));
+}
+
+// erased entries of SER_C leave the wildcard service writable
+void test_wildcard_stays_writable()
+{
+    set_service_codes({0x0000});
+    std::vector<uint8_t> data(16, 0x24);
+    TEST_ASSERT_EQUAL_HEX8(0x00, status_of(write_command(0xFFFF, {1}, data)));
+}
+
+// two services in one Read Without Encryption
+void test_several_services_are_read()
+{
+    set_service_codes({0x0000, 0x000B});
+    std::vector<uint8_t> command = {0, 0x06};
+    std::vector<uint8_t> id = card_idm();
+    command.insert(command.end(), id.begin(), id.end());
+    command.insert(command.end(), {2, 0x00, 0x00, 0x0B, 0x00, 2, 0x80, 0, 0x81, 1});
+    command[0] = command.size();
+
+    response_frame_t response = card_exchange(command);
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[11]);
+    TEST_ASSERT_EQUAL(2, response.packet[12]);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_listed_area_is_readable);
+    RUN_TEST(test_listed_area_is_not_writable);
+    RUN_TEST(test_unlisted_code_is_rejected);
+    RUN_TEST(test_wildcard_stays_writable);
+    RUN_TEST(test_several_services_are_read);
+    return UNITY_END();
+}
@@ -0,0 +1,159 @@
+// EEPROM write-back cache: pages written after responses and on power loss,
+// and small changes kept in the journal
+// built without serial output, where nothing else enables interrupts
+
+#define SILICA_LOG_LEVEL 0
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// 12 blocks of data starting at block 0, spanning 6 EEPROM pages
+static std::vector<uint8_t> block_data()
+{
+    std::vector<uint8_t> data(16 * 12);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = i * 3 + 1;
+    return data;
+}
+
+static void write_blocks()
+{
+    response_frame_t response = card_exchange(write_command(0xFFFF, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}, block_data()));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_HEX8(0x00, response.packet[10]);
+}
+
+// offset of block 0 in the EEPROM
+static int block_offset()
+{
+    return mock_eeprom_address(block_data_eep);
+}
+
+// wait for a frame for the given time in cycles
+static void idle(uint32_t cycles)
+{
+    mock_rx.clear();
+    mock_idle_limit = cycles / mock_sck_byte();
+    try
+    {
+        loop();
+    }
+    catch (const mock_idle_t &)
+    {
+    }
+    mock_idle_limit = 1024;
+}
+
+void test_interrupts_are_enabled_without_serial_output()
+{
+    TEST_ASSERT_TRUE(SREG & 0x80);
+}
+
+void test_pages_are_written_back_after_responses()
+{
+    write_blocks();
+
+    // a page after each response, once the EEPROM is done with the
+    // previous one
+    for (int i = 0; i < 8; i++)
+    {
+        idle(MOCK_NVM_WRITE_CYCLES);
+        TEST_ASSERT_TRUE(card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x00, 0x00}).valid);
+    }
+    idle(MOCK_NVM_WRITE_CYCLES);
+
+    // no flush on power loss
+    mock_power_loss();
+    std::vector<uint8_t> data = block_data();
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), mock_eeprom + block_offset(), data.size());
+}
+
+// waiting for a frame never writes, so no frame loses bytes to it
+void test_nothing_is_written_while_idle()
+{
+    write_blocks();
+    idle(8 * MOCK_NVM_WRITE_CYCLES);
+
+    // only the page written after the response
+    mock_power_loss();
+    std::vector<uint8_t> data = block_data();
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), mock_eeprom + block_offset(), EEPROM_PAGE_SIZE);
+    TEST_ASSERT_EQUAL_HEX8(0xFF, mock_eeprom[block_offset() + EEPROM_PAGE_SIZE]);
+}
+
+void test_pages_are_flushed_on_supply_drop()
+{
+    write_blocks();
+    mock_supply_drop();
+    mock_power_loss();
+
+    std::vector<uint8_t> data = block_data();
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), mock_eeprom + block_offset(), data.size());
+
+    // and read back after power-up
+    setup();
+    response_frame_t response = card_exchange(read_command(0xFFFF, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}));
+    TEST_ASSERT_TRUE(response.valid);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), response.packet.data() + 13, data.size());
+}
+
+// without the flush, pages not yet written back are lost
+void test_power_loss_before_write_back_loses_the_pages()
+{
+    write_blocks();
+    mock_power_loss();
+    TEST_ASSERT_EQUAL_HEX8(0xFF, mock_eeprom[block_offset() + 16 * 11]);
+}
+
+// small changes go to the journal, whose slots are reused many times
+void test_journaled_bytes_survive_power_cycles()
+{
+    write_blocks();
+    mock_supply_drop();
+    std::vector<uint8_t> data = block_data();
+
+    for (int n = 0; n < 40; n++)
+    {
+        // one or two bytes of blocks in different pages
+        int block = (n * 5) % 12;
+        data[16 * block + n % 3] = n;
+        if (n % 4 == 0)
+            data[16 * block + 15] = ~n;
+        std::vector<uint8_t> block_bytes(data.begin() + 16 * block, data.begin() + 16 * (block + 1));
+        TEST_ASSERT_TRUE(card_exchange(write_command(0xFFFF, {(uint8_t)block}, block_bytes)).valid);
+
+        mock_supply_drop();
+        mock_power_loss();
+        setup();
+
+        response_frame_t response = card_exchange(read_command(0xFFFF, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11}));
+        TEST_ASSERT_TRUE(response.valid);
+        TEST_ASSERT_EQUAL_UINT8_ARRAY(data.data(), response.packet.data() + 13, data.size());
+    }
+
+    // the blocks themselves were not rewritten for every change
+    int writes = 0;
+    for (int i = 0; i < 16 * 12; i++)
+        writes = std::max(writes, (int)mock_eeprom_wear[block_offset() + i]);
+    TEST_ASSERT_LESS_THAN(10, writes);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_interrupts_are_enabled_without_serial_output);
+    RUN_TEST(test_pages_are_written_back_after_responses);
+    RUN_TEST(test_nothing_is_written_while_idle);
+    RUN_TEST(test_pages_are_flushed_on_supply_drop);
+    RUN_TEST(test_power_loss_before_write_back_loses_the_pages);
+    RUN_TEST(test_journaled_bytes_survive_power_cycles);
+    return UNITY_END();
+}
@@ -0,0 +1,180 @@
+// Sync pattern search with the combined table of both polarities
+// checked against get_shift_from_sync() and find_sync_index() it replaced
+
+#include <chrono>
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// get_shift_from_sync() as it was before the table
+static int get_shift_from_sync(uint8_t sync1, uint8_t sync2)
+{
+    uint8_t a1 = sync1 & 0xAA;
+    uint8_t b1 = sync1 & 0x55;
+
+    uint8_t a2 = sync2 & 0xAA;
+    uint8_t b2 = sync2 & 0x55;
+
+    if (a1 == 0x8A && a2 == 0x08)
+        return 0;
+    if (b1 == 0x45 && b2 == 0x04)
+        return 1;
+    if (a1 == 0x22 && a2 == 0x82)
+        return 2;
+    if (b1 == 0x11 && b2 == 0x41)
+        return 3;
+    if (a1 == 0x08 && a2 == 0xA0)
+        return 4;
+    if (b1 == 0x04 && b2 == 0x50)
+        return 5;
+    if (a1 == 0x02 && a2 == 0x28)
+        return 6;
+    if (b1 == 0x01 && b2 == 0x14)
+        return 7;
+
+    return -1;
+}
+
+// one position of find_sync_index() as it was before the table
+static bool find_sync(uint8_t sync1, uint8_t sync2, int &shift, bool &invert)
+{
+    int shift1 = get_shift_from_sync(sync1, sync2);
+    int shift2 = get_shift_from_sync(~sync1, ~sync2);
+    if (shift1 != -1 && shift1 > shift2)
+    {
+        shift = shift1;
+        invert = false;
+        return true;
+    }
+    if (shift2 != -1 && shift2 > shift1)
+    {
+        shift = shift2;
+        invert = true;
+        return true;
+    }
+    return false;
+}
+
+void test_match_sync_for_every_input()
+{
+    for (uint32_t i = 0; i < 0x10000; i++)
+    {
+        uint8_t sync1 = i >> 8, sync2 = i;
+        int expected_shift = -1, shift = -1;
+        bool expected_invert = false, invert = false;
+        bool expected = find_sync(sync1, sync2, expected_shift, expected_invert);
+        bool found = match_sync(sync_candidates(sync1), sync2, shift, invert);
+
+        TEST_ASSERT_EQUAL(expected, found);
+        if (expected)
+        {
+            TEST_ASSERT_EQUAL(expected_shift, shift);
+            TEST_ASSERT_EQUAL(expected_invert, invert);
+        }
+    }
+}
+
+// capture_sync() stops at the same byte as a search over the whole frame
+void test_incremental_search_matches_whole_frame()
+{
+    uint32_t seed = 11;
+    for (int n = 0; n < 2000; n++)
+    {
+        // preamble-like bytes, then random bytes that never end the frame
+        std::vector<uint8_t> frame = {0x55, 0x55};
+        for (int i = 0; i < 40; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            uint8_t x = seed >> 16;
+            frame.push_back(x == 0x00 || x == 0xFF ? 0x55 : x);
+        }
+
+        int expected_index = -1, expected_shift = -1;
+        bool expected_invert = false;
+        for (size_t i = 0; i + 1 < frame.size(); i++)
+        {
+            if (find_sync(frame[i], frame[i + 1], expected_shift, expected_invert))
+            {
+                expected_index = i + 1;
+                break;
+            }
+        }
+
+        mock_rx.clear();
+        mock_receive({0x00});
+        mock_receive(frame);
+        mock_receive({0x00, 0x00});
+        int shift = -1;
+        bool invert = false;
+        int result = capture_sync(shift, invert);
+
+        if (expected_index < 0)
+        {
+            TEST_ASSERT_EQUAL(-1, result);
+            continue;
+        }
+        TEST_ASSERT_EQUAL(1, result);
+        TEST_ASSERT_EQUAL(expected_shift, shift);
+        TEST_ASSERT_EQUAL(expected_invert, invert);
+
+        // bytes after the second sync byte are left
+        TEST_ASSERT_EQUAL(frame.size() - expected_index - 1 + 2, mock_rx.size());
+    }
+}
+
+// host time per searched byte, only reported
+void test_benchmark_sync_search()
+{
+    static uint8_t data[4096];
+    uint32_t seed = 5;
+    for (size_t i = 0; i < sizeof(data); i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+
+    volatile int sink = 0;
+    int shift;
+    bool invert;
+    auto start = std::chrono::steady_clock::now();
+    for (int n = 0; n < 200; n++)
+    {
+        for (size_t i = 0; i + 1 < sizeof(data); i++)
+            sink = sink + find_sync(data[i], data[i + 1], shift, invert);
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for (int n = 0; n < 200; n++)
+    {
+        uint16_t candidates = sync_candidates(data[0]);
+        for (size_t i = 1; i < sizeof(data); i++)
+        {
+            sink = sink + match_sync(candidates, data[i], shift, invert);
+            candidates = sync_candidates(data[i]);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double bytes = 200.0 * (sizeof(data) - 1);
+    double before = std::chrono::duration<double, std::nano>(middle - start).count() / bytes;
+    double table = std::chrono::duration<double, std::nano>(end - middle).count() / bytes;
+    char str[96];
+    snprintf(str, sizeof(str), "sync search per byte: compares %.2fns, table %.2fns", before, table);
+    TEST_MESSAGE(str);
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_match_sync_for_every_input);
+    RUN_TEST(test_incremental_search_matches_whole_frame);
+    RUN_TEST(test_benchmark_sync_search);
+    return UNITY_END();
+}
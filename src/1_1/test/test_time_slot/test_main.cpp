@@ -0,0 +1,67 @@
+// Polling responses in time slots, timed by TCB0 from the end of the frame
+
+#include <unity.h>
+#include "card.h"
+
+void setUp()
+{
+    card_reset();
+}
+
+void tearDown()
+{
+}
+
+// cycles of one TCB0 tick
+static constexpr int TICK = 2;
+
+// send Polling with n time slots, return the slot the response started in
+// the response must start at the slot boundary
+static int poll(int n)
+{
+    response_frame_t response = card_exchange({0x06, 0x00, 0xFF, 0xFF, 0x00, (uint8_t)n});
+    TEST_ASSERT_TRUE(response.valid);
+
+    // the first byte starts one SCK byte before it is captured
+    int64_t start = mock_tx_start - mock_sck_byte() - mock_tcb_start;
+    int64_t after_delay = start - TICK * POLLING_DELAY;
+    int slot = (after_delay + TICK * TIME_SLOT / 2) / (TICK * TIME_SLOT);
+
+    // the busy wait ends within a few polls of TCB0
+    int64_t error = after_delay - (int64_t)slot * TICK * TIME_SLOT;
+    TEST_ASSERT_GREATER_OR_EQUAL(0, error);
+    TEST_ASSERT_LESS_THAN(32, error);
+    return slot;
+}
+
+void test_every_slot_count()
+{
+    for (int n = 0; n < 16; n++)
+    {
+        int used[16] = {};
+        for (int i = 0; i < 40 * (n + 1); i++)
+        {
+            int slot = poll(n);
+            TEST_ASSERT_GREATER_OR_EQUAL(0, slot);
+            TEST_ASSERT_LESS_OR_EQUAL(n, slot);
+            used[slot]++;
+        }
+        for (int slot = 0; slot <= n; slot++)
+            TEST_ASSERT_GREATER_THAN(0, used[slot]);
+    }
+}
+
+// at most 16 time slots are defined
+void test_slot_count_above_15_is_limited()
+{
+    for (int i = 0; i < 200; i++)
+        TEST_ASSERT_LESS_OR_EQUAL(15, poll(0xFF));
+}
+
+int main()
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_every_slot_count);
+    RUN_TEST(test_slot_count_above_15_is_limited);
+    return UNITY_END();
+}
@@ -0,0 +1,200 @@
+#!/usr/bin/env python3
+
+# Provision SiliCa over the serial port instead of RF commands.
+# The firmware must be built with SILICA_UART_COMMANDS.
+# The card still runs on the clock and supply of the RF carrier, so it
+# must sit in the field of a reader, and BAUD_RATE only holds with the
+# 13.56MHz carrier. Frames the reader sends meanwhile take priority: a
+# serial frame that overlaps one is lost, and is sent again after the
+# timeout of SerialChannel.
+# Usage examples:
+# python uart.py /dev/ttyUSB0 stats
+# python uart.py /dev/ttyUSB0 err
+#
+# Card images are dumped and restored over the serial port with
+# python image.py --port /dev/ttyUSB0 dump card.json
+
+import argparse
+import struct
+import sys
+
+import image
+
+BAUD_RATE = 230400
+
+FRAME_START = 0xA5
+FRAME_COMMAND = ord('C')
+FRAME_RESPONSE = ord('R')
+FRAME_UNSUPPORTED = ord('N')
+FRAME_STATS = ord('S')
+FRAME_ERROR = ord('E')
+
+COMMAND_POLLING = 0x00
+
+# counters of the 'S' frame in firmware order
+STATS_NAMES = [
+    "frames",
+    "SPI overflows",
+    "sync errors",
+    "length errors",
+    "EDC errors",
+    "bit slips",
+    "relocks",
+    "serial errors",
+    "corrected frames",
+    "dropped log messages",
+]
+
+
+class SerialError(Exception):
+    pass
+
+
+class CommandError(Exception):
+    """The card answered with nonzero status flags."""
+
+    def __init__(self, status: int):
+        super().__init__(f"status {status:04X}")
+        self.status = status
+
+
+def crc16(data: bytes, crc: int = 0) -> int:
+    """CRC16-CCITT as used for the EDC, initial value 0."""
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+        crc &= 0xFFFF
+    return crc
+
+
+def encode_frame(frame_type: int, payload: bytes) -> bytes:
+    body = bytes([frame_type, len(payload)]) + payload
+    return bytes([FRAME_START]) + body + struct.pack(">H", crc16(body))
+
+
+class SerialChannel:
+    """
+    Frames over a serial port. The port may be anything with read(n) that
+    returns fewer bytes on timeout and write(data), such as serial.Serial.
+    Log messages of the firmware between frames are collected in log.
+    """
+
+    def __init__(self, port, retries: int = 3):
+        self.port = port
+        self.retries = retries
+        self.log = bytearray()
+
+    @classmethod
+    def open(cls, path: str, timeout: float = 1.0) -> "SerialChannel":
+        import serial
+        return cls(serial.Serial(path, BAUD_RATE, timeout=timeout))
+
+    def _read(self, n: int) -> bytes:
+        data = self.port.read(n)
+        if len(data) != n:
+            raise SerialError("timeout")
+        return data
+
+    def receive_frame(self) -> tuple[int, bytes]:
+        while True:
+            b = self._read(1)[0]
+            if b != FRAME_START:
+                self.log.append(b)
+                continue
+            header = self._read(2)
+            payload = self._read(header[1])
+            crc = struct.unpack(">H", self._read(2))[0]
+            if crc == crc16(header + payload):
+                return header[0], payload
+            # a log byte looked like a frame start, keep searching
+            self.log += bytes([b]) + header + payload
+
+    def exchange(self, frame_type: int, payload: bytes = b"") -> tuple[int, bytes]:
+        """Send a frame and return the answer, retrying garbled frames."""
+        for _ in range(self.retries):
+            self.port.write(encode_frame(frame_type, payload))
+            try:
+                answer = self.receive_frame()
+            except SerialError:
+                # a truncated frame, the next one completes it and is rejected
+                continue
+            if answer[0] != FRAME_ERROR:
+                return answer
+        raise SerialError("no valid answer")
+
+    def stats(self) -> dict[str, int]:
+        frame_type, payload = self.exchange(FRAME_STATS)
+        if frame_type != FRAME_STATS:
+            raise SerialError("unexpected answer")
+        counters = struct.unpack(f"<{len(payload) // 2}H", payload)
+        return dict(zip(STATS_NAMES, counters))
+
+
+class SerialTag:
+    """
+    SiliCa on a serial channel, with the command interface of nfcpy's
+    Type3Tag, so the functions of read.py and write.py work on it.
+    """
+
+    def __init__(self, channel: SerialChannel):
+        self.channel = channel
+        self.idm, self.pmm = self.polling()
+
+    def exchange(self, packet: bytes) -> bytes:
+        frame_type, payload = self.channel.exchange(FRAME_COMMAND, packet)
+        if frame_type == FRAME_UNSUPPORTED:
+            raise CommandError(0xFFFF)
+        if frame_type != FRAME_RESPONSE:
+            raise SerialError("unexpected answer")
+        return payload
+
+    def polling(self, system_code: int = 0xFFFF) -> tuple[bytes, bytes]:
+        cmd = bytes([6, COMMAND_POLLING]) + struct.pack(">H", system_code) + bytes([0, 0])
+        rsp = self.exchange(cmd)
+        return rsp[2:10], rsp[10:18]
+
+    def send_cmd_recv_rsp(self, cmd_code: int, cmd_data: bytes, timeout: float = 1.0) -> bytes:
+        cmd = bytes([2 + len(self.idm) + len(cmd_data), cmd_code]) + self.idm + cmd_data
+        rsp = self.exchange(cmd)
+        if rsp[10] != 0:
+            raise CommandError(struct.unpack(">H", rsp[10:12])[0])
+        return rsp[12:]
+
+    def __str__(self) -> str:
+        return f"SiliCa on serial ID={self.idm.hex().upper()} PMM={self.pmm.hex().upper()}"
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(
+        prog=argv[0],
+        description="Provision SiliCa over the serial port.",
+    )
+    parser.add_argument("port", help="serial port, e.g. /dev/ttyUSB0 or COM3")
+    parser.add_argument("command", choices=["stats", "err"])
+    args = parser.parse_args(argv[1:])
+
+    try:
+        channel = SerialChannel.open(args.port)
+
+        if args.command == "stats":
+            for name, value in channel.stats().items():
+                print(f"{name}: {value}")
+            return 0
+
+        tag = SerialTag(channel)
+        print("Tag found:", tag)
+
+        data = b"".join(image.read_blocks(tag, [image.ERROR_BLOCK, image.ERROR_BLOCK + 1]))
+        length = data[0]
+        print("Last Error Command:", data[1:length].hex(' ').upper())
+
+    except (SerialError, CommandError, OSError) as exc:
+        print("Error:", exc)
+        return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
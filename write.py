@@ -16,16 +16,19 @@ import sys
 import argparse
 import nfc
 
+COMMAND_READ = 0x06
 COMMAND_WRITE = 0x08
 DEFAULT_PMM = bytes.fromhex("0001FFFFFFFFFFFF")  # 8 bytes
 MAX_SYSTEM = 4
 MAX_SERVICE = 4
+MAX_BLOCK = 16  # blocks 0-11 in EEPROM, 12-15 in flash
 
 
 def write_system_block(tag: nfc.tag.Tag, block_num: int, data: bytes, timeout: float = 1.0) -> None:
     """
-    Write a 16-byte system block to a FeliCa tag.
-    Raises nfc.tag.tt3.Type3TagCommandError on write failure.
+    Write a 16-byte system block to a FeliCa tag and verify it by reading it back.
+    Raises nfc.tag.tt3.Type3TagCommandError on write failure
+    and ValueError if the block reads back different data.
     """
     if not (0 <= block_num <= 0xFF):
         raise ValueError("block_num must fit in one byte (0-255)")
@@ -39,8 +42,10 @@ def write_system_block(tag: nfc.tag.Tag, block_num: int, data: bytes, timeout: f
 
     if block_num == 0x83:
         tag.idm = data[0:8]  # Update IDm if written
-    # Second write to ensure data is written correctly
-    tag.send_cmd_recv_rsp(COMMAND_WRITE, bytes(cmd_data), timeout)
+
+    cmd_read = bytearray([1, 0xFF, 0xFF, 1, 0x80, block_num])
+    if tag.send_cmd_recv_rsp(COMMAND_READ, bytes(cmd_read), timeout)[1:] != data:
+        raise ValueError(f"block {block_num:02X}h reads back different data")
 
 
 def parse_hex_parameter(s: str) -> Optional[bytes]:
@@ -57,8 +62,8 @@ def build_data_for_command(command: str, param: bytes) -> Optional[tuple[int, by
     """
     if command.isdigit():
         block = int(command)
-        if not (0 <= block < 12):
-            print("Block number must be between 0 and 11")
+        if not (0 <= block < MAX_BLOCK):
+            print(f"Block number must be between 0 and {MAX_BLOCK - 1}")
             return None
         if len(param) != 16:
             print("Data must be exactly 16 bytes for raw write")